@@ -0,0 +1,16 @@
+#ifndef FLEET_UPDATE_DEMO_CONFIGURATION_H_
+#define FLEET_UPDATE_DEMO_CONFIGURATION_H_
+
+// The defaults shipped in src/c, with file and fleet updates enabled.
+#include "../../../src/c/LumenProtocolConfiguration.h"
+
+#undef USE_PROJECT_UPDATE_FROM_FILE
+#define USE_PROJECT_UPDATE_FROM_FILE true
+
+#undef USE_PROJECT_UPDATE_FLEET
+#define USE_PROJECT_UPDATE_FLEET true
+// Only defined by the defaults when USE_PROJECT_UPDATE_FLEET is true there.
+#define PROJECT_UPDATE_FLEET_MAX_LINKS 32
+#define PROJECT_UPDATE_FLEET_LINK_TIMEOUT_IN_MS 10000
+
+#endif /* FLEET_UPDATE_DEMO_CONFIGURATION_H_ */
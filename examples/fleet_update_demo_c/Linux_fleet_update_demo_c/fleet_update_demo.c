@@ -0,0 +1,142 @@
+#include "LumenProtocol.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Usage: fleet_update_demo <project.bin> <serial port> [<serial port> ...]
+
+#define MAX_PORTS PROJECT_UPDATE_FLEET_MAX_LINKS
+#define RECEIVE_BUFFER_SIZE 256
+
+typedef struct {
+  int fd;
+  uint8_t received[RECEIVE_BUFFER_SIZE];
+  uint32_t receivedLength;
+  uint32_t readIndex;
+  uint8_t blockBuffer[PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH + 2];
+} serial_port_t;
+
+static serial_port_t ports[MAX_PORTS];
+
+// The library's own link is not used here, every display is a fleet link.
+void lumen_write_bytes(uint8_t *data, uint32_t length) {
+  (void)data;
+  (void)length;
+}
+
+uint16_t lumen_get_byte() {
+  return DATA_NULL;
+}
+
+static void port_write_bytes(void *context, uint8_t *data, uint32_t length) {
+  serial_port_t *port = (serial_port_t *)context;
+
+  while (length > 0) {
+    ssize_t written = write(port->fd, data, length);
+    if (written <= 0) {
+      return;
+    }
+    data += written;
+    length -= (uint32_t)written;
+  }
+}
+
+static uint16_t port_get_byte(void *context) {
+  serial_port_t *port = (serial_port_t *)context;
+
+  if (port->readIndex < port->receivedLength) {
+    return port->received[port->readIndex++];
+  }
+  return DATA_NULL;
+}
+
+static int open_port(const char *path) {
+  struct termios settings;
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+  if (fd < 0) {
+    return -1;
+  }
+  tcgetattr(fd, &settings);
+  cfmakeraw(&settings);
+  cfsetispeed(&settings, B115200);
+  cfsetospeed(&settings, B115200);
+  tcsetattr(fd, TCSANOW, &settings);
+  return fd;
+}
+
+static uint32_t now_in_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+int main(int argc, char **argv) {
+  struct pollfd pollFds[MAX_PORTS];
+  uint32_t quantityOfPorts = 0;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <project.bin> <serial port> [<serial port> ...]\n", argv[0]);
+    return 1;
+  }
+
+  for (int i = 2; (i < argc) && (quantityOfPorts < MAX_PORTS); ++i) {
+    serial_port_t *port = &ports[quantityOfPorts];
+    lumen_update_link_io_t io = { port_write_bytes, port_get_byte, port };
+
+    port->fd = open_port(argv[i]);
+    if (port->fd < 0) {
+      fprintf(stderr, "cannot open %s\n", argv[i]);
+      return 1;
+    }
+    lumen_fleet_update_add_link(&io, port->blockBuffer, sizeof(port->blockBuffer));
+    pollFds[quantityOfPorts].fd = port->fd;
+    pollFds[quantityOfPorts].events = POLLIN;
+    ++quantityOfPorts;
+  }
+
+  uint32_t lastTime = now_in_ms();
+
+  // Event loop: wait for any display to answer (or 1 ms), then step every link once.
+  while (!lumen_fleet_project_update_from_file(argv[1], true)) {
+    if (lumen_project_and_firmware_update_file_error() != 0) {
+      fprintf(stderr, "cannot map %s: %s\n", argv[1], strerror(lumen_project_and_firmware_update_file_error()));
+      return 1;
+    }
+    poll(pollFds, quantityOfPorts, 1);
+
+    for (uint32_t i = 0; i < quantityOfPorts; ++i) {
+      serial_port_t *port = &ports[i];
+
+      if (port->readIndex >= port->receivedLength) {
+        ssize_t length = read(port->fd, port->received, sizeof(port->received));
+        port->receivedLength = (length > 0) ? (uint32_t)length : 0;
+        port->readIndex = 0;
+      }
+    }
+
+    uint32_t currentTime = now_in_ms();
+    lumen_fleet_update_tick(currentTime - lastTime);
+    lastTime = currentTime;
+  }
+
+  int result = 0;
+
+  for (uint32_t i = 0; i < quantityOfPorts; ++i) {
+    lumen_fleet_link_status_t status;
+
+    lumen_fleet_update_link_status(i, &status);
+    printf("%s: %s, %u blocks, %u retries\n", argv[i + 2], status.failed ? "failed" : "updated", status.acknowledged_blocks,
+           status.retries);
+    if (status.failed) {
+      result = 1;
+    }
+    close(ports[i].fd);
+  }
+  return result;
+}
@@ -1,9 +1,40 @@
 #include "LumenProtocol.h"
 
+#if USE_PROJECT_UPDATE_FROM_FILE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#if USE_TRACEPOINTS
+#include <sys/sdt.h>
+
+// USDT probes, listed by `bpftrace -l 'usdt:<program>:lumen:*'`.
+#define LUMEN_TRACE1(name, a) DTRACE_PROBE1(lumen, name, a)
+#define LUMEN_TRACE2(name, a, b) DTRACE_PROBE2(lumen, name, a, b)
+#else
+#define LUMEN_TRACE1(name, a) \
+  do { \
+  } while (0)
+#define LUMEN_TRACE2(name, a, b) \
+  do { \
+  } while (0)
+#endif
+
 // Version 1.4
 
 extern void lumen_write_bytes(uint8_t *data, uint32_t length);
 extern uint16_t lumen_get_byte();
+#if USE_CLOCK
+extern uint32_t lumen_now_us();
+#endif
 
 typedef union {
   struct
@@ -86,22 +117,168 @@ typedef enum {
   kReadMultipleVariables
 } Command_t;
 
+#if USE_ACK || USE_PROJECT_UPDATE
+// A timer holds a deadline on the library's time base: the clock read with lumen_now_us
+// when USE_CLOCK is enabled, the time passed to the tick functions otherwise.
+// Deadlines are compared by their signed distance, so they keep working when the time base wraps around.
+typedef struct {
+  uint32_t deadline;
+#if USE_CLOCK
+  uint16_t heapPosition;  // 0 when the timer is not queued
+#endif
+} lumen_timer_t;
+
+#if USE_CLOCK
+#define kTimeUnitsPerMs 1000
+#else
+#define kTimeUnitsPerMs 1
+#endif
+
+static bool lumen_time_reached(uint32_t now, uint32_t deadline) {
+  return (int32_t)(now - deadline) >= 0;
+}
+
+#if USE_CLOCK
+#if USE_ACK
+#define kAckTimers QUANTITY_OF_DATABUFFER_FOR_RETRY
+#else
+#define kAckTimers 0
+#endif
+#if USE_PROJECT_UPDATE_FLEET
+// And the progress timeout of every fleet link.
+#define kUpdateLinkTimers (5 * (1 + PROJECT_UPDATE_FLEET_MAX_LINKS) + PROJECT_UPDATE_FLEET_MAX_LINKS)
+#elif USE_PROJECT_UPDATE
+#define kUpdateLinkTimers 5
+#else
+#define kUpdateLinkTimers 0
+#endif
+
+// Every armed timer, as a binary min-heap on the deadline. Positions start at 1, the earliest deadline is at 1.
+static lumen_timer_t *_deadlineHeap[1 + kAckTimers + kUpdateLinkTimers];
+static uint16_t _quantityOfDeadlines = 0;
+
+static void lumen_deadline_place(uint16_t position, lumen_timer_t *timer) {
+  _deadlineHeap[position] = timer;
+  timer->heapPosition = position;
+}
+
+static bool lumen_deadline_is_earlier(uint16_t position, uint16_t otherPosition) {
+  return (int32_t)(_deadlineHeap[position]->deadline - _deadlineHeap[otherPosition]->deadline) < 0;
+}
+
+static void lumen_deadline_swap(uint16_t position, uint16_t otherPosition) {
+  lumen_timer_t *timer = _deadlineHeap[position];
+
+  lumen_deadline_place(position, _deadlineHeap[otherPosition]);
+  lumen_deadline_place(otherPosition, timer);
+}
+
+static void lumen_deadline_sift(uint16_t position) {
+  while ((position > 1) && lumen_deadline_is_earlier(position, position / 2)) {
+    lumen_deadline_swap(position, position / 2);
+    position /= 2;
+  }
+
+  while (true) {
+    uint16_t earliest = position;
+    uint16_t child = position * 2;
+
+    if ((child <= _quantityOfDeadlines) && lumen_deadline_is_earlier(child, earliest)) {
+      earliest = child;
+    }
+    if ((child + 1 <= _quantityOfDeadlines) && lumen_deadline_is_earlier(child + 1, earliest)) {
+      earliest = child + 1;
+    }
+    if (earliest == position) {
+      return;
+    }
+    lumen_deadline_swap(position, earliest);
+    position = earliest;
+  }
+}
+#endif
+
+static void lumen_timer_arm(lumen_timer_t *timer, uint32_t now, uint32_t delayInMs) {
+  timer->deadline = now + delayInMs * kTimeUnitsPerMs;
+#if USE_CLOCK
+  if (timer->heapPosition == 0) {
+    ++_quantityOfDeadlines;
+    lumen_deadline_place(_quantityOfDeadlines, timer);
+  }
+  lumen_deadline_sift(timer->heapPosition);
+#endif
+}
+
+static void lumen_timer_disarm(lumen_timer_t *timer) {
+#if USE_CLOCK
+  uint16_t position = timer->heapPosition;
+
+  if (position == 0) {
+    return;
+  }
+  timer->heapPosition = 0;
+  --_quantityOfDeadlines;
+  if (position <= _quantityOfDeadlines) {
+    lumen_deadline_place(position, _deadlineHeap[_quantityOfDeadlines + 1]);
+    lumen_deadline_sift(position);
+  }
+#else
+  (void)timer;
+#endif
+}
+
+// With the clock, a timer leaves the heap once its deadline passed, so a timer that is not queued has expired.
+static bool lumen_timer_expired(const lumen_timer_t *timer, uint32_t now) {
+#if USE_CLOCK
+  if (timer->heapPosition == 0) {
+    return true;
+  }
+#endif
+  return lumen_time_reached(now, timer->deadline);
+}
+
+#if USE_CLOCK
+uint32_t lumen_next_deadline_us() {
+  uint32_t now = lumen_now_us();
+  bool reached = false;
+
+  while ((_quantityOfDeadlines > 0) && lumen_time_reached(now, _deadlineHeap[1]->deadline)) {
+    lumen_timer_disarm(_deadlineHeap[1]);
+    reached = true;
+  }
+
+  if (reached) {
+    return 0;
+  }
+  if (_quantityOfDeadlines == 0) {
+    return LUMEN_NO_DEADLINE;
+  }
+  return _deadlineHeap[1]->deadline - now;
+}
+#endif
+#endif
+
 #if USE_PROJECT_UPDATE
 typedef enum lumen_project_update_response {
   kNull,
   kOk,
   kFail,
+  kReceivedBlocks,
   kWaitingCommand,
   kReceivingProjectImageBlock
 } lumen_project_update_response_t;
 
 volatile bool g_is_updating = false;
+// Set while variable frames are interleaved with the blocks of a running update.
+static bool _updateMultiplexed = false;
 #endif
 
 static uint8_t quantityOfPacketsAvailable = 0;
 
 static lumen_packet_t packets[QUANTITY_OF_PACKETS];
 static bool occupiedSlots[QUANTITY_OF_PACKETS];
+// Slots handed out by lumen_borrow_first_packet: Pack leaves them alone until they are released.
+static bool borrowedSlots[QUANTITY_OF_PACKETS];
 
 #if USE_CRC
 static u16_union_t _crc;
@@ -114,12 +291,21 @@ static uint16_t receivedData;
 static uint8_t _dataIn[kDataLength];
 static uint8_t _dataOut[QUANTITY_OF_DATABUFFER_FOR_RETRY][kDataLength];
 #if USE_ACK
-static uint32_t _dataOutElapsedTime[QUANTITY_OF_DATABUFFER_FOR_RETRY];
+static lumen_timer_t _dataOutRetryTimers[QUANTITY_OF_DATABUFFER_FOR_RETRY];
 static uint8_t _dataOutRetries[QUANTITY_OF_DATABUFFER_FOR_RETRY] = { 0, 0, 0, 0, 0 };
 static uint8_t _dataOutLengths[QUANTITY_OF_DATABUFFER_FOR_RETRY] = { 0, 0, 0, 0, 0 };
+static bool _dataOutPending[QUANTITY_OF_DATABUFFER_FOR_RETRY];
+static uint8_t _dataOutGenerations[QUANTITY_OF_DATABUFFER_FOR_RETRY];
+static uint8_t _dataOutInFlight = 0;
 static uint8_t _dataOutIndex = 1;
+static lumen_write_handle_t _lastWriteHandle = LUMEN_INVALID_WRITE_HANDLE;
+static lumen_ack_callback_t _onAcked = NULL;
+static lumen_ack_callback_t _onFailed = NULL;
 static uint8_t _ackDataOut[] = { START_FLAG, ACK_FLAG, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 static uint8_t _ackDataOutLength = 0;
+#if USE_LATENCY_HISTOGRAMS
+static uint32_t _dataOutSentTimes[QUANTITY_OF_DATABUFFER_FOR_RETRY];
+#endif
 #else
 static uint8_t _dataOutIndex = 0;
 #endif
@@ -155,234 +341,777 @@ void calculate_crc(uint16_t data) {
 
 static uint8_t writeTempData;
 
-#if USE_ACK
-uint32_t elapsed_time_in_ms = 0;
-void lumen_ack_trigger(uint32_t time_in_ms) {
+#if USE_STATISTICS
+static lumen_stats_t _stats;
 
-#if USE_PROJECT_UPDATE
-  if (g_is_updating)
-    return;
+// Only the library's thread writes the counters, so an update is a load and a store.
+// With STATISTICS_ATOMIC both are relaxed atomics, which lumen_get_stats can read from any thread.
+#if STATISTICS_ATOMIC
+#define LUMEN_STAT_LOAD(counter) __atomic_load_n(&_stats.counter, __ATOMIC_RELAXED)
+#define LUMEN_STAT_STORE(counter, value) __atomic_store_n(&_stats.counter, (value), __ATOMIC_RELAXED)
+#else
+#define LUMEN_STAT_LOAD(counter) (_stats.counter)
+#define LUMEN_STAT_STORE(counter, value) (_stats.counter = (value))
 #endif
 
-  for (uint8_t dataOutIndex = 1; dataOutIndex < QUANTITY_OF_DATABUFFER_FOR_RETRY; ++dataOutIndex) {
-    if (_dataOutRetries[dataOutIndex] > 0) {
-      _dataOutElapsedTime[dataOutIndex] += time_in_ms;
-      if (_dataOutElapsedTime[dataOutIndex] >= ELAPSED_TIME_TO_RETRY) {
-        lumen_write_bytes(_dataOut[dataOutIndex], _dataOutLengths[dataOutIndex]);
-        --_dataOutRetries[dataOutIndex];
-        _dataOutElapsedTime[dataOutIndex] = 0;
-      }
-    }
+#define LUMEN_STAT_ADD(counter, value) LUMEN_STAT_STORE(counter, LUMEN_STAT_LOAD(counter) + (uint32_t)(value))
+#define LUMEN_STAT_MAX(counter, value) \
+  do { \
+    if ((uint32_t)(value) > LUMEN_STAT_LOAD(counter)) { \
+      LUMEN_STAT_STORE(counter, (uint32_t)(value)); \
+    } \
+  } while (0)
+
+// Bytes sent or received per 1000 bytes of unescaped data.
+static uint16_t lumen_stats_expansion(uint32_t bytes, uint32_t escapes) {
+  if (bytes <= escapes) {
+    return 1000;
   }
+  return (uint16_t)((uint64_t)bytes * 1000 / (bytes - escapes));
 }
-#endif
 
-uint32_t lumen_write(uint16_t address, uint8_t *data, uint32_t length) {
-
-#if USE_PROJECT_UPDATE
-  if (g_is_updating)
-    return 0;
-#endif
+void lumen_get_stats(lumen_stats_t *stats) {
+  stats->frames_sent = LUMEN_STAT_LOAD(frames_sent);
+  stats->bytes_sent = LUMEN_STAT_LOAD(bytes_sent);
+  stats->escapes_sent = LUMEN_STAT_LOAD(escapes_sent);
+  stats->frames_received = LUMEN_STAT_LOAD(frames_received);
+  stats->bytes_received = LUMEN_STAT_LOAD(bytes_received);
+  stats->escapes_received = LUMEN_STAT_LOAD(escapes_received);
+  stats->crc_errors = LUMEN_STAT_LOAD(crc_errors);
+  stats->packets_dropped = LUMEN_STAT_LOAD(packets_dropped);
+  stats->writes_refused = LUMEN_STAT_LOAD(writes_refused);
+  stats->retries = LUMEN_STAT_LOAD(retries);
+  stats->ack_timeouts = LUMEN_STAT_LOAD(ack_timeouts);
+  stats->stale_acks = LUMEN_STAT_LOAD(stale_acks);
+  stats->max_packets_available = LUMEN_STAT_LOAD(max_packets_available);
+  stats->max_writes_in_flight = LUMEN_STAT_LOAD(max_writes_in_flight);
+  stats->max_multiplex_queue = LUMEN_STAT_LOAD(max_multiplex_queue);
+  stats->sent_expansion_permille = lumen_stats_expansion(stats->bytes_sent, stats->escapes_sent);
+  stats->received_expansion_permille = lumen_stats_expansion(stats->bytes_received, stats->escapes_received);
+}
 
-  static uint32_t outDataIndex;
-  outDataIndex = 0;
+// In an encoded frame, the only ESCAPE_FLAG bytes are the escapes themselves.
+static void lumen_stats_frame_sent(const uint8_t *frame, uint32_t length) {
+  uint32_t escapes = 0;
 
-  _dataOut[_dataOutIndex][outDataIndex] = START_FLAG;
-  ++outDataIndex;
+  for (uint32_t i = 0; i < length; ++i) {
+    if (frame[i] == ESCAPE_FLAG) {
+      ++escapes;
+    }
+  }
+  LUMEN_STAT_ADD(frames_sent, 1);
+  LUMEN_STAT_ADD(bytes_sent, length);
+  LUMEN_STAT_ADD(escapes_sent, escapes);
+}
 
-  _dataOut[_dataOutIndex][outDataIndex] = WRITE_FLAG;
-#if USE_CRC
-  _crc.value = 0xFFFF;
-  calculate_crc(_dataOut[_dataOutIndex][outDataIndex]);
+// Call it from the library's thread: it races with the counters otherwise.
+void lumen_reset_stats() {
+  memset(&_stats, 0, sizeof(_stats));
+}
+#else
+#define LUMEN_STAT_ADD(counter, value) \
+  do { \
+  } while (0)
+#define LUMEN_STAT_MAX(counter, value) \
+  do { \
+  } while (0)
 #endif
-  ++outDataIndex;
 
-  writeTempData = address & 0xFF;
-#if USE_CRC
-  calculate_crc(writeTempData);
+#if USE_LATENCY_HISTOGRAMS
+#if !USE_CLOCK
+#error "USE_LATENCY_HISTOGRAMS needs USE_CLOCK"
 #endif
-  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
-    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
-  } else {
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
-  }
-  ++outDataIndex;
 
-  writeTempData = address >> 8;
-#if USE_CRC
-  calculate_crc(writeTempData);
+#if (LATENCY_HISTOGRAM_PRECISION < 1) || (LATENCY_HISTOGRAM_PRECISION > 7)
+#error "LATENCY_HISTOGRAM_PRECISION must be from 1 to 7"
 #endif
-  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
-    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
-  } else {
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
+
+#define kLatencySubBuckets (1 << LATENCY_HISTOGRAM_PRECISION)
+// Requests waiting for their answer; the oldest one is forgotten when a new request needs its place.
+#define kLatencyPendingRequests 4
+
+typedef struct {
+  uint16_t address;
+  bool pending;
+  uint32_t sentTime;
+} lumen_latency_request_t;
+
+static lumen_latency_histogram_t _latencies[kQuantityOfLatencies];
+static lumen_latency_request_t _latencyRequests[kLatencyPendingRequests];
+static uint8_t _latencyNextRequest = 0;
+
+// Values under 2^(LATENCY_HISTOGRAM_PRECISION + 1) have a bucket each. Above, every power of two
+// is split in kLatencySubBuckets buckets, so the relative error is the same at every scale.
+static uint32_t lumen_latency_bucket(uint32_t value) {
+  if (value < 2 * kLatencySubBuckets) {
+    return value;
   }
-  ++outDataIndex;
+  uint32_t shift = (31 - __builtin_clz(value)) - LATENCY_HISTOGRAM_PRECISION;
+  return (shift + 1) * kLatencySubBuckets + (value >> shift) - kLatencySubBuckets;
+}
 
-#if USE_CRC
-  for (uint16_t i = 0; i < length; i++) {
-    calculate_crc(data[i]);
+static uint32_t lumen_latency_bucket_highest_value(uint32_t bucket) {
+  if (bucket < 2 * kLatencySubBuckets) {
+    return bucket;
   }
-#endif
+  uint32_t shift = bucket / kLatencySubBuckets - 1;
+  uint64_t subBucket = bucket % kLatencySubBuckets + kLatencySubBuckets;
+  return (uint32_t)(((subBucket + 1) << shift) - 1);
+}
 
-  for (uint16_t i = 0; i < length; i++) {
-    if (data[i] == START_FLAG || data[i] == END_FLAG || data[i] == ESCAPE_FLAG) {
-      _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-      ++outDataIndex;
-      _dataOut[_dataOutIndex][outDataIndex] = data[i] ^ XOR_FLAG;
-      ++outDataIndex;
-    } else {
-      _dataOut[_dataOutIndex][outDataIndex] = data[i];
-      ++outDataIndex;
-    }
+static void lumen_latency_record(lumen_latency_t latency, uint32_t sentTime) {
+  lumen_latency_histogram_t *histogram = &_latencies[latency];
+  uint32_t value = lumen_now_us() - sentTime;
+
+  ++histogram->counts[lumen_latency_bucket(value)];
+  if ((histogram->count == 0) || (value < histogram->min_us)) {
+    histogram->min_us = value;
   }
+  if (value > histogram->max_us) {
+    histogram->max_us = value;
+  }
+  ++histogram->count;
+  histogram->total_us += value;
+}
 
-#if USE_ACK
+static void lumen_latency_request_sent(uint16_t address) {
+  uint8_t requestIndex = _latencyNextRequest;
 
-  if (_dataOutIndex == START_FLAG || _dataOutIndex == END_FLAG || _dataOutIndex == ESCAPE_FLAG) {
-    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = _dataOutIndex ^ XOR_FLAG;
-    ++outDataIndex;
-  } else {
-    _dataOut[_dataOutIndex][outDataIndex] = _dataOutIndex;
-    ++outDataIndex;
+  for (uint8_t i = 0; i < kLatencyPendingRequests; ++i) {
+    if (_latencyRequests[i].pending && (_latencyRequests[i].address == address)) {
+      requestIndex = i;
+      break;
+    }
+  }
+  if (requestIndex == _latencyNextRequest) {
+    _latencyNextRequest = (_latencyNextRequest + 1) % kLatencyPendingRequests;
   }
 
-  _dataOut[_dataOutIndex][outDataIndex] = 0;
-  ++outDataIndex;
+  _latencyRequests[requestIndex].address = address;
+  _latencyRequests[requestIndex].pending = true;
+  _latencyRequests[requestIndex].sentTime = lumen_now_us();
+}
 
-#if USE_CRC
-  calculate_crc(_dataOutIndex);
-  calculate_crc(0);
-#endif
-#endif
+static void lumen_latency_answer_parsed(uint16_t address) {
+  for (uint8_t i = 0; i < kLatencyPendingRequests; ++i) {
+    if (_latencyRequests[i].pending && (_latencyRequests[i].address == address)) {
+      _latencyRequests[i].pending = false;
+      lumen_latency_record(kLatencyRequest, _latencyRequests[i].sentTime);
+      return;
+    }
+  }
+}
 
-#if USE_CRC
-  if ((_crc.byte.high == (uint8_t)START_FLAG) || (_crc.byte.high == (uint8_t)END_FLAG)
-      || (_crc.byte.high == (uint8_t)ESCAPE_FLAG)) {
-    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.high ^ XOR_FLAG;
-    ++outDataIndex;
-  } else {
-    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.high;
-    ++outDataIndex;
+void lumen_latency_snapshot(lumen_latency_t latency, lumen_latency_histogram_t *histogram) {
+  if (latency < kQuantityOfLatencies) {
+    memcpy(histogram, &_latencies[latency], sizeof(*histogram));
   }
+}
 
-  if ((_crc.byte.low == (uint8_t)START_FLAG) || (_crc.byte.low == (uint8_t)END_FLAG)
-      || (_crc.byte.low == (uint8_t)ESCAPE_FLAG)) {
-    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.low ^ XOR_FLAG;
-    ++outDataIndex;
-  } else {
-    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.low;
-    ++outDataIndex;
+void lumen_latency_reset(lumen_latency_t latency) {
+  if (latency < kQuantityOfLatencies) {
+    memset(&_latencies[latency], 0, sizeof(_latencies[latency]));
   }
-#endif
+}
 
-  _dataOut[_dataOutIndex][outDataIndex] = END_FLAG;
-  ++outDataIndex;
+// Reported as the highest value of the bucket, never above the largest sample.
+uint32_t lumen_latency_percentile(const lumen_latency_histogram_t *histogram, uint32_t per_ten_thousand) {
+  uint64_t rank = ((uint64_t)histogram->count * per_ten_thousand + 9999) / 10000;
+  uint64_t seen = 0;
 
-  lumen_write_bytes(_dataOut[_dataOutIndex], outDataIndex);
+  if (histogram->count == 0) {
+    return 0;
+  }
+  if (rank == 0) {
+    rank = 1;
+  }
 
-#if USE_ACK
-  _dataOutLengths[_dataOutIndex] = outDataIndex;
-  _dataOutElapsedTime[_dataOutIndex] = 0;
-  _dataOutRetries[_dataOutIndex] = QUANTITY_OF_RETRIES;
-  for (_dataOutIndex = 1; _dataOutIndex < QUANTITY_OF_DATABUFFER_FOR_RETRY; ++_dataOutIndex) {
-    if (_dataOutRetries[_dataOutIndex] == 0) {
-      break;
+  for (uint32_t bucket = 0; bucket < LUMEN_LATENCY_BUCKETS; ++bucket) {
+    seen += histogram->counts[bucket];
+    if (seen >= rank) {
+      uint32_t value = lumen_latency_bucket_highest_value(bucket);
+      return (value < histogram->max_us) ? value : histogram->max_us;
     }
   }
-  if (_dataOutIndex >= QUANTITY_OF_DATABUFFER_FOR_RETRY) {
-    _dataOutIndex = QUANTITY_OF_DATABUFFER_FOR_RETRY - 1;
-  }
-#endif
+  return histogram->max_us;
+}
 
-  return outDataIndex;
+typedef struct {
+  char *buffer;
+  uint32_t size;
+  uint32_t length;
+} lumen_latency_text_t;
+
+// Keeps counting past the end of the buffer, so the caller learns it was too small.
+static void lumen_latency_append_text(lumen_latency_text_t *text, const char *string) {
+  for (; *string != '\0'; ++string) {
+    if (text->length < text->size) {
+      text->buffer[text->length] = *string;
+    }
+    ++text->length;
+  }
 }
 
+static void lumen_latency_append_number(lumen_latency_text_t *text, uint64_t value) {
+  char digits[21];
+  uint8_t index = sizeof(digits) - 1;
 
-uint32_t lumen_write_variable_list(uint16_t address, uint16_t index, uint8_t *data, uint32_t length) {
+  digits[index] = '\0';
+  do {
+    digits[--index] = '0' + (value % 10);
+    value /= 10;
+  } while (value > 0);
+  lumen_latency_append_text(text, &digits[index]);
+}
 
-#if USE_PROJECT_UPDATE
-  if (g_is_updating)
-    return 0;
-#endif
+uint32_t lumen_latency_export(char *buffer, uint32_t size) {
+  static const char *const names[kQuantityOfLatencies] = { "lumen_request_latency_us", "lumen_ack_latency_us" };
+  static const char *const quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+  static const uint32_t quantilesPerTenThousand[] = { 5000, 9000, 9900, 9990 };
+  lumen_latency_text_t text = { buffer, size, 0 };
 
-  static uint32_t outDataIndex;
-  outDataIndex = 0;
+  for (uint8_t latency = 0; latency < kQuantityOfLatencies; ++latency) {
+    if (!USE_ACK && (latency == kLatencyAck)) {
+      continue;
+    }
 
-  _dataOut[_dataOutIndex][outDataIndex] = START_FLAG;
-  ++outDataIndex;
+    lumen_latency_append_text(&text, "# TYPE ");
+    lumen_latency_append_text(&text, names[latency]);
+    lumen_latency_append_text(&text, " summary\n");
+    for (uint8_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+      lumen_latency_append_text(&text, names[latency]);
+      lumen_latency_append_text(&text, "{quantile=\"");
+      lumen_latency_append_text(&text, quantiles[i]);
+      lumen_latency_append_text(&text, "\"} ");
+      lumen_latency_append_number(&text, lumen_latency_percentile(&_latencies[latency], quantilesPerTenThousand[i]));
+      lumen_latency_append_text(&text, "\n");
+    }
+    lumen_latency_append_text(&text, names[latency]);
+    lumen_latency_append_text(&text, "_sum ");
+    lumen_latency_append_number(&text, _latencies[latency].total_us);
+    lumen_latency_append_text(&text, "\n");
+    lumen_latency_append_text(&text, names[latency]);
+    lumen_latency_append_text(&text, "_count ");
+    lumen_latency_append_number(&text, _latencies[latency].count);
+    lumen_latency_append_text(&text, "\n");
+  }
 
-  _dataOut[_dataOutIndex][outDataIndex] = WRITE_FLAG;
-#if USE_CRC
-  _crc.value = 0xFFFF;
-  calculate_crc(_dataOut[_dataOutIndex][outDataIndex]);
+  if (text.length >= size) {
+    return 0;
+  }
+  buffer[text.length] = '\0';
+  return text.length;
+}
 #endif
-  ++outDataIndex;
 
-  writeTempData = address & 0xFF;
-#if USE_CRC
-  calculate_crc(writeTempData);
+#if USE_CAPTURE
+#if !USE_CLOCK
+#error "USE_CAPTURE needs USE_CLOCK"
 #endif
-  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
-    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
-  } else {
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
-  }
-  ++outDataIndex;
 
-  writeTempData = address >> 8;
-#if USE_CRC
-  calculate_crc(writeTempData);
+#if (CAPTURE_RING_SIZE & (CAPTURE_RING_SIZE - 1)) || (CAPTURE_RING_SIZE < 256) || (CAPTURE_RING_SIZE > 0x40000)
+#error "CAPTURE_RING_SIZE must be a power of two, from 256 to 262144"
 #endif
-  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
-    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
-  } else {
-    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
-  }
-  ++outDataIndex;
 
-#if USE_CRC
-  for (uint16_t i = 0; i < length; i++) {
-    calculate_crc(data[i]);
-  }
-#endif
+#define kCaptureRingMask (CAPTURE_RING_SIZE - 1)
+#define kCaptureMaxRecordData LUMEN_CAPTURE_MAX_RECORD_DATA
+#define kCaptureRxChunkSize 64
+
+// Single-producer, single-consumer ring of capture records. The library appends records and
+// lumen_capture_read takes whole ones out, possibly from another thread. Each side only writes
+// its own index and publishes it with a release store, so neither side ever waits for the other.
+static uint8_t _captureRing[CAPTURE_RING_SIZE];
+static uint32_t _captureHead = 0;
+static uint32_t _captureTail = 0;
+static uint32_t _captureDropped = 0;
+// Bytes read one at a time are gathered into one record per burst.
+static uint8_t _captureRx[kCaptureRxChunkSize];
+static uint32_t _captureRxLength = 0;
+static uint32_t _captureRxTime = 0;
+
+static void lumen_capture_copy_in(uint32_t position, const uint8_t *data, uint32_t length) {
+  uint32_t offset = position & kCaptureRingMask;
+  uint32_t firstLength = (length < CAPTURE_RING_SIZE - offset) ? length : CAPTURE_RING_SIZE - offset;
+
+  memcpy(&_captureRing[offset], data, firstLength);
+  memcpy(_captureRing, &data[firstLength], length - firstLength);
+}
 
-  u16_union_t _index;
-  _index.value = index;
+static void lumen_capture_copy_out(uint32_t position, uint8_t *data, uint32_t length) {
+  uint32_t offset = position & kCaptureRingMask;
+  uint32_t firstLength = (length < CAPTURE_RING_SIZE - offset) ? length : CAPTURE_RING_SIZE - offset;
 
-  if (_index.byte.low == START_FLAG || _index.byte.low == END_FLAG || _index.byte.low == ESCAPE_FLAG) {
+  memcpy(data, &_captureRing[offset], firstLength);
+  memcpy(&data[firstLength], _captureRing, length - firstLength);
+}
+
+// Appends one record, or counts it as dropped when the reader has not made room for it.
+static void lumen_capture_record(uint8_t direction, uint32_t time, const uint8_t *data, uint32_t length) {
+  uint8_t header[LUMEN_CAPTURE_RECORD_HEADER_SIZE] = {
+    (uint8_t)time, (uint8_t)(time >> 8), (uint8_t)(time >> 16), (uint8_t)(time >> 24),
+    (uint8_t)length, (uint8_t)(length >> 8), direction
+  };
+  uint32_t head = _captureHead;
+  uint32_t tail = __atomic_load_n(&_captureTail, __ATOMIC_ACQUIRE);
+
+  if ((head - tail) + LUMEN_CAPTURE_RECORD_HEADER_SIZE + length > CAPTURE_RING_SIZE) {
+    __atomic_fetch_add(&_captureDropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  lumen_capture_copy_in(head, header, LUMEN_CAPTURE_RECORD_HEADER_SIZE);
+  lumen_capture_copy_in(head + LUMEN_CAPTURE_RECORD_HEADER_SIZE, data, length);
+  __atomic_store_n(&_captureHead, head + LUMEN_CAPTURE_RECORD_HEADER_SIZE + length, __ATOMIC_RELEASE);
+}
+
+static void lumen_capture_flush_rx() {
+  if (_captureRxLength > 0) {
+    lumen_capture_record(LUMEN_CAPTURE_RX, _captureRxTime, _captureRx, _captureRxLength);
+    _captureRxLength = 0;
+  }
+}
+
+static void lumen_capture_tx(const uint8_t *data, uint32_t length) {
+  uint32_t time = lumen_now_us();
+
+  lumen_capture_flush_rx();
+  // Long writes, such as update blocks, are split so every record fits in the ring.
+  while (length > kCaptureMaxRecordData) {
+    lumen_capture_record(LUMEN_CAPTURE_TX, time, data, kCaptureMaxRecordData);
+    data += kCaptureMaxRecordData;
+    length -= kCaptureMaxRecordData;
+  }
+  lumen_capture_record(LUMEN_CAPTURE_TX, time, data, length);
+}
+
+static void lumen_capture_rx(uint16_t data) {
+  if (data == DATA_NULL) {
+    lumen_capture_flush_rx();
+    return;
+  }
+  if (_captureRxLength == 0) {
+    _captureRxTime = lumen_now_us();
+  }
+  _captureRx[_captureRxLength] = (uint8_t)data;
+  ++_captureRxLength;
+  if (_captureRxLength == kCaptureRxChunkSize) {
+    lumen_capture_flush_rx();
+  }
+}
+
+uint32_t lumen_capture_log_header(uint8_t *buffer) {
+  buffer[0] = 'L';
+  buffer[1] = 'U';
+  buffer[2] = 'M';
+  buffer[3] = 'C';
+  buffer[4] = LUMEN_CAPTURE_LOG_VERSION;
+  buffer[5] = (USE_CRC ? LUMEN_CAPTURE_LOG_CRC : 0) | (USE_ACK ? LUMEN_CAPTURE_LOG_ACK : 0);
+  buffer[6] = 0;
+  buffer[7] = 0;
+  return LUMEN_CAPTURE_LOG_HEADER_SIZE;
+}
+
+uint32_t lumen_capture_read(uint8_t *buffer, uint32_t size) {
+  uint32_t tail = _captureTail;
+  uint32_t head = __atomic_load_n(&_captureHead, __ATOMIC_ACQUIRE);
+  uint32_t length = 0;
+
+  while (tail != head) {
+    uint8_t lengthBytes[2];
+    lumen_capture_copy_out(tail + 4, lengthBytes, sizeof(lengthBytes));
+
+    uint32_t recordLength = LUMEN_CAPTURE_RECORD_HEADER_SIZE + (lengthBytes[0] | ((uint32_t)lengthBytes[1] << 8));
+    if (length + recordLength > size) {
+      break;
+    }
+    lumen_capture_copy_out(tail, &buffer[length], recordLength);
+    tail += recordLength;
+    length += recordLength;
+  }
+
+  __atomic_store_n(&_captureTail, tail, __ATOMIC_RELEASE);
+  return length;
+}
+
+uint32_t lumen_capture_dropped() {
+  return __atomic_load_n(&_captureDropped, __ATOMIC_RELAXED);
+}
+#endif
+
+#if USE_RX_RING
+#if (RX_RING_SIZE & (RX_RING_SIZE - 1)) || (RX_RING_SIZE < 16)
+#error "RX_RING_SIZE must be a power of two, from 16"
+#endif
+
+#define kRxRingMask (RX_RING_SIZE - 1)
+
+// Single-producer, single-consumer ring of received bytes: lumen_rx_push fills it from an ISR,
+// a DMA callback or a reader thread, and the parser empties it. The indices run freely and
+// each side only writes its own. The parser reads the head once per batch of bytes and gives
+// the room back once per batch as well, so the barriers are paid per batch, not per byte.
+static uint8_t _rxRing[RX_RING_SIZE];
+static uint32_t _rxHead = 0;
+static uint32_t _rxTail = 0;
+static uint32_t _rxDropped = 0;
+// Parser side: next byte to read, and the head as last seen.
+static uint32_t _rxReadPosition = 0;
+static uint32_t _rxHeadSeen = 0;
+
+uint32_t lumen_rx_push(const uint8_t *data, uint32_t length) {
+  uint32_t head = _rxHead;
+  uint32_t room = RX_RING_SIZE - (head - __atomic_load_n(&_rxTail, __ATOMIC_ACQUIRE));
+
+  if (length > room) {
+    __atomic_store_n(&_rxDropped, _rxDropped + (length - room), __ATOMIC_RELAXED);
+    length = room;
+  }
+
+  uint32_t offset = head & kRxRingMask;
+  uint32_t firstLength = (length < RX_RING_SIZE - offset) ? length : RX_RING_SIZE - offset;
+  memcpy(&_rxRing[offset], data, firstLength);
+  memcpy(_rxRing, &data[firstLength], length - firstLength);
+
+  __atomic_store_n(&_rxHead, head + length, __ATOMIC_RELEASE);
+  return length;
+}
+
+uint32_t lumen_rx_dropped() {
+  return __atomic_load_n(&_rxDropped, __ATOMIC_RELAXED);
+}
+
+static void lumen_rx_ring_release() {
+  __atomic_store_n(&_rxTail, _rxReadPosition, __ATOMIC_RELEASE);
+}
+
+static uint16_t lumen_rx_ring_pop() {
+  if (_rxReadPosition == _rxHeadSeen) {
+    lumen_rx_ring_release();
+    _rxHeadSeen = __atomic_load_n(&_rxHead, __ATOMIC_ACQUIRE);
+    if (_rxReadPosition == _rxHeadSeen) {
+      return DATA_NULL;
+    }
+  }
+  return _rxRing[_rxReadPosition++ & kRxRingMask];
+}
+#endif
+
+// Every byte passed to lumen_write_bytes or read from lumen_get_byte goes through these two,
+// where USE_CAPTURE taps it. With USE_RX_RING, bytes are read from the ring instead.
+static void lumen_port_write_bytes(uint8_t *data, uint32_t length) {
+#if USE_CAPTURE
+  lumen_capture_tx(data, length);
+#endif
+  lumen_write_bytes(data, length);
+}
+
+static uint16_t lumen_port_get_byte() {
+#if USE_RX_RING
+  uint16_t data = lumen_rx_ring_pop();
+#else
+  uint16_t data = lumen_get_byte();
+#endif
+#if USE_CAPTURE
+  lumen_capture_rx(data);
+#endif
+  return data;
+}
+
+#if USE_ACK
+uint32_t elapsed_time_in_ms = 0;
+#if !USE_CLOCK
+static uint32_t _ackTime = 0;
+#endif
+
+static uint32_t lumen_ack_now() {
+#if USE_CLOCK
+  return lumen_now_us();
+#else
+  return _ackTime;
+#endif
+}
+
+#endif
+
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+static uint8_t _multiplexQueue[PROJECT_UPDATE_MULTIPLEX_QUEUE_SIZE];
+static uint32_t _multiplexQueueLength = 0;
+#if USE_ACK
+// Queue length up to the end of each slot's queued frame, 0 once the frame is sent.
+static uint32_t _dataOutQueuedUntil[QUANTITY_OF_DATABUFFER_FOR_RETRY];
+#endif
+
+// Sends the queued frames that fit in budget bytes, at least one, and keeps the rest in order.
+static void lumen_update_multiplex_flush(uint32_t budget) {
+  uint32_t length = 0;
+
+  for (uint32_t i = 0; i < _multiplexQueueLength; ++i) {
+    if (_multiplexQueue[i] == END_FLAG) {
+      if ((length > 0) && (i + 1 > budget)) {
+        break;
+      }
+      length = i + 1;
+    }
+  }
+  if (length == 0) {
+    return;
+  }
+
+  lumen_port_write_bytes(_multiplexQueue, length);
+  _multiplexQueueLength -= length;
+  memmove(_multiplexQueue, &_multiplexQueue[length], _multiplexQueueLength);
+
+#if USE_ACK
+  // A write waits for its ACK from the moment it leaves, not from the moment it was queued.
+  for (uint8_t dataOutIndex = 1; dataOutIndex < QUANTITY_OF_DATABUFFER_FOR_RETRY; ++dataOutIndex) {
+    if (_dataOutQueuedUntil[dataOutIndex] > length) {
+      _dataOutQueuedUntil[dataOutIndex] -= length;
+    } else if (_dataOutQueuedUntil[dataOutIndex] > 0) {
+      _dataOutQueuedUntil[dataOutIndex] = 0;
+      if (_dataOutPending[dataOutIndex]) {
+        lumen_timer_arm(&_dataOutRetryTimers[dataOutIndex], lumen_ack_now(), ELAPSED_TIME_TO_RETRY);
+      }
+    }
+  }
+#endif
+}
+#endif
+
+// Writes a complete frame, the write of ACK slot dataOutIndex or 0. While an update is multiplexed
+// the frame is queued instead, and goes out between two blocks. Returns false when the queue is full.
+static bool lumen_write_frame(uint8_t *frame, uint32_t length, uint8_t dataOutIndex) {
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  if (_updateMultiplexed) {
+    if (_multiplexQueueLength + length > PROJECT_UPDATE_MULTIPLEX_QUEUE_SIZE) {
+      LUMEN_STAT_ADD(writes_refused, 1);
+      return false;
+    }
+    memcpy(&_multiplexQueue[_multiplexQueueLength], frame, length);
+    _multiplexQueueLength += length;
+#if USE_ACK
+    if (dataOutIndex != 0) {
+      _dataOutQueuedUntil[dataOutIndex] = _multiplexQueueLength;
+    }
+#endif
+    LUMEN_STAT_MAX(max_multiplex_queue, _multiplexQueueLength);
+#if USE_STATISTICS
+    lumen_stats_frame_sent(frame, length);
+#endif
+    return true;
+  }
+#endif
+  (void)dataOutIndex;
+  lumen_port_write_bytes(frame, length);
+#if USE_STATISTICS
+  lumen_stats_frame_sent(frame, length);
+#endif
+  return true;
+}
+
+#if USE_ACK
+static lumen_write_handle_t lumen_ack_make_handle(uint8_t dataOutIndex) {
+  return ((lumen_write_handle_t)_dataOutGenerations[dataOutIndex] << 8) | dataOutIndex;
+}
+
+static bool lumen_ack_reserve_slot() {
+  for (_dataOutIndex = 1; _dataOutIndex < QUANTITY_OF_DATABUFFER_FOR_RETRY; ++_dataOutIndex) {
+    if (!_dataOutPending[_dataOutIndex]) {
+      ++_dataOutGenerations[_dataOutIndex];
+      return true;
+    }
+  }
+  // Every slot is still waiting for its ACK: refuse the write instead of overwriting one.
+  LUMEN_STAT_ADD(writes_refused, 1);
+  _dataOutIndex = 0;
+  return false;
+}
+
+static void lumen_ack_register_slot(uint32_t length) {
+  _dataOutLengths[_dataOutIndex] = length;
+  lumen_timer_arm(&_dataOutRetryTimers[_dataOutIndex], lumen_ack_now(), ELAPSED_TIME_TO_RETRY);
+  _dataOutRetries[_dataOutIndex] = QUANTITY_OF_RETRIES;
+  _dataOutPending[_dataOutIndex] = true;
+  ++_dataOutInFlight;
+  LUMEN_STAT_MAX(max_writes_in_flight, _dataOutInFlight);
+#if USE_LATENCY_HISTOGRAMS
+  _dataOutSentTimes[_dataOutIndex] = lumen_now_us();
+#endif
+  _lastWriteHandle = lumen_ack_make_handle(_dataOutIndex);
+}
+
+static void lumen_ack_resolve_slot(uint8_t dataOutIndex, bool acked) {
+  if (dataOutIndex == 0 || dataOutIndex >= QUANTITY_OF_DATABUFFER_FOR_RETRY) {
+    return;
+  }
+  if (!_dataOutPending[dataOutIndex]) {
+    return;
+  }
+
+  _dataOutPending[dataOutIndex] = false;
+  _dataOutRetries[dataOutIndex] = 0;
+  lumen_timer_disarm(&_dataOutRetryTimers[dataOutIndex]);
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  _dataOutQueuedUntil[dataOutIndex] = 0;
+#endif
+  --_dataOutInFlight;
+#if USE_LATENCY_HISTOGRAMS
+  if (acked) {
+    lumen_latency_record(kLatencyAck, _dataOutSentTimes[dataOutIndex]);
+  }
+#endif
+
+  // The slot is already free here, so callbacks are allowed to call lumen_write again.
+  if (acked) {
+    if (_onAcked != NULL) {
+      _onAcked(lumen_ack_make_handle(dataOutIndex));
+    }
+  } else {
+    if (_onFailed != NULL) {
+      _onFailed(lumen_ack_make_handle(dataOutIndex));
+    }
+  }
+}
+
+// The ACK echoes the id of the write: the slot, then its generation. An ACK of the slot's
+// previous write, late or answering one of its retries, must not resolve the write now in it.
+static void lumen_ack_received(uint8_t dataOutIndex, uint8_t generation) {
+  if (dataOutIndex == 0 || dataOutIndex >= QUANTITY_OF_DATABUFFER_FOR_RETRY) {
+    return;
+  }
+  if (!_dataOutPending[dataOutIndex] || (generation != _dataOutGenerations[dataOutIndex])) {
+    LUMEN_STAT_ADD(stale_acks, 1);
+    return;
+  }
+  lumen_ack_resolve_slot(dataOutIndex, true);
+}
+
+void lumen_ack_trigger(uint32_t time_in_ms) {
+
+#if USE_PROJECT_UPDATE
+  if (g_is_updating && !_updateMultiplexed)
+    return;
+#endif
+
+#if USE_CLOCK
+  (void)time_in_ms;
+#else
+  _ackTime += time_in_ms;
+#endif
+  uint32_t now = lumen_ack_now();
+
+  for (uint8_t dataOutIndex = 1; dataOutIndex < QUANTITY_OF_DATABUFFER_FOR_RETRY; ++dataOutIndex) {
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+    if (_dataOutQueuedUntil[dataOutIndex] > 0) {
+      // Still queued: its retry timer starts when it is flushed.
+      continue;
+    }
+#endif
+    if (_dataOutPending[dataOutIndex]) {
+      if (lumen_timer_expired(&_dataOutRetryTimers[dataOutIndex], now)) {
+        if (_dataOutRetries[dataOutIndex] > 0) {
+          if (lumen_write_frame(_dataOut[dataOutIndex], _dataOutLengths[dataOutIndex], dataOutIndex)) {
+            --_dataOutRetries[dataOutIndex];
+            LUMEN_STAT_ADD(retries, 1);
+            LUMEN_TRACE2(ack_retry, dataOutIndex, _dataOutRetries[dataOutIndex]);
+            lumen_timer_arm(&_dataOutRetryTimers[dataOutIndex], now, ELAPSED_TIME_TO_RETRY);
+          }
+        } else {
+          LUMEN_STAT_ADD(ack_timeouts, 1);
+          lumen_ack_resolve_slot(dataOutIndex, false);
+        }
+      }
+    }
+  }
+}
+
+void lumen_ack_set_callbacks(lumen_ack_callback_t on_acked, lumen_ack_callback_t on_failed) {
+  _onAcked = on_acked;
+  _onFailed = on_failed;
+}
+
+lumen_write_handle_t lumen_ack_last_write_handle() {
+  return _lastWriteHandle;
+}
+
+bool lumen_ack_is_pending(lumen_write_handle_t handle) {
+  uint8_t dataOutIndex = handle & 0xFF;
+
+  if (dataOutIndex == 0 || dataOutIndex >= QUANTITY_OF_DATABUFFER_FOR_RETRY) {
+    return false;
+  }
+  return _dataOutPending[dataOutIndex] && (lumen_ack_make_handle(dataOutIndex) == handle);
+}
+
+uint8_t lumen_ack_in_flight() {
+  return _dataOutInFlight;
+}
+
+uint8_t lumen_ack_free_slots() {
+  return (QUANTITY_OF_DATABUFFER_FOR_RETRY - 1) - _dataOutInFlight;
+}
+#endif
+
+uint32_t lumen_write(uint16_t address, uint8_t *data, uint32_t length) {
+
+#if USE_ACK
+  // Left invalid unless this write goes out, so no callback is attached to an earlier write.
+  _lastWriteHandle = LUMEN_INVALID_WRITE_HANDLE;
+#endif
+
+#if USE_PROJECT_UPDATE
+  if (g_is_updating && !_updateMultiplexed)
+    return 0;
+#endif
+
+#if USE_ACK
+  if (!lumen_ack_reserve_slot())
+    return 0;
+#endif
+
+  LUMEN_TRACE2(frame_encode_begin, address, length);
+
+  static uint32_t outDataIndex;
+  outDataIndex = 0;
+
+  _dataOut[_dataOutIndex][outDataIndex] = START_FLAG;
+  ++outDataIndex;
+
+  _dataOut[_dataOutIndex][outDataIndex] = WRITE_FLAG;
+#if USE_CRC
+  _crc.value = 0xFFFF;
+  calculate_crc(_dataOut[_dataOutIndex][outDataIndex]);
+#endif
+  ++outDataIndex;
+
+  writeTempData = address & 0xFF;
+#if USE_CRC
+  calculate_crc(writeTempData);
+#endif
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
     _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
     ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.low ^ XOR_FLAG;
-    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
   } else {
-    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.low;
-    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
   }
+  ++outDataIndex;
 
-  if (_index.byte.high == START_FLAG || _index.byte.high == END_FLAG || _index.byte.high == ESCAPE_FLAG) {
+  writeTempData = address >> 8;
+#if USE_CRC
+  calculate_crc(writeTempData);
+#endif
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
     _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
     ++outDataIndex;
-    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.high ^ XOR_FLAG;
-    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
   } else {
-    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.high;
-    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
+  }
+  ++outDataIndex;
+
+#if USE_CRC
+  for (uint16_t i = 0; i < length; i++) {
+    calculate_crc(data[i]);
   }
+#endif
 
   for (uint16_t i = 0; i < length; i++) {
     if (data[i] == START_FLAG || data[i] == END_FLAG || data[i] == ESCAPE_FLAG) {
@@ -397,16 +1126,32 @@ uint32_t lumen_write_variable_list(uint16_t address, uint16_t index, uint8_t *da
   }
 
 #if USE_ACK
-  _dataOut[_dataOutIndex][outDataIndex] = _dataOutIndex;
-#if USE_CRC
-  calculate_crc(_dataOut[_dataOutIndex][outDataIndex]);
-#endif
+
+  if (_dataOutIndex == START_FLAG || _dataOutIndex == END_FLAG || _dataOutIndex == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = _dataOutIndex ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = _dataOutIndex;
+    ++outDataIndex;
+  }
+
+  // The slot generation tells this write's ACK from a late one of the slot's previous write.
+  writeTempData = _dataOutGenerations[_dataOutIndex];
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
+  }
   ++outDataIndex;
-  _dataOut[_dataOutIndex][outDataIndex] = 0;
+
 #if USE_CRC
-  calculate_crc(_dataOut[_dataOutIndex][outDataIndex]);
+  calculate_crc(_dataOutIndex);
+  calculate_crc(_dataOutGenerations[_dataOutIndex]);
 #endif
-  ++outDataIndex;
 #endif
 
 #if USE_CRC
@@ -436,103 +1181,307 @@ uint32_t lumen_write_variable_list(uint16_t address, uint16_t index, uint8_t *da
   _dataOut[_dataOutIndex][outDataIndex] = END_FLAG;
   ++outDataIndex;
 
-  lumen_write_bytes(_dataOut[_dataOutIndex], outDataIndex);
+  LUMEN_TRACE2(frame_encode_end, address, outDataIndex);
+
+  if (!lumen_write_frame(_dataOut[_dataOutIndex], outDataIndex, _dataOutIndex))
+    return 0;
 
 #if USE_ACK
-  _dataOutLengths[_dataOutIndex] = outDataIndex;
-  _dataOutElapsedTime[_dataOutIndex] = 0;
-  _dataOutRetries[_dataOutIndex] = QUANTITY_OF_RETRIES;
-  for (_dataOutIndex = 1; _dataOutIndex < QUANTITY_OF_DATABUFFER_FOR_RETRY; ++_dataOutIndex) {
-    if (_dataOutRetries[_dataOutIndex] == 0) {
-      break;
-    }
-  }
-  if (_dataOutIndex >= QUANTITY_OF_DATABUFFER_FOR_RETRY) {
-    _dataOutIndex = QUANTITY_OF_DATABUFFER_FOR_RETRY - 1;
-  }
+  lumen_ack_register_slot(outDataIndex);
 #endif
 
   return outDataIndex;
 }
 
-uint32_t lumen_write_packet(lumen_packet_t *packet) {
+
+uint32_t lumen_write_variable_list(uint16_t address, uint16_t index, uint8_t *data, uint32_t length) {
+
+#if USE_ACK
+  // Left invalid unless this write goes out, so no callback is attached to an earlier write.
+  _lastWriteHandle = LUMEN_INVALID_WRITE_HANDLE;
+#endif
 
 #if USE_PROJECT_UPDATE
-  if (g_is_updating)
+  if (g_is_updating && !_updateMultiplexed)
+    return 0;
+#endif
+
+#if USE_ACK
+  if (!lumen_ack_reserve_slot())
+    return 0;
+#endif
+
+  LUMEN_TRACE2(frame_encode_begin, address, length);
+
+  static uint32_t outDataIndex;
+  outDataIndex = 0;
+
+  _dataOut[_dataOutIndex][outDataIndex] = START_FLAG;
+  ++outDataIndex;
+
+  _dataOut[_dataOutIndex][outDataIndex] = WRITE_FLAG;
+#if USE_CRC
+  _crc.value = 0xFFFF;
+  calculate_crc(_dataOut[_dataOutIndex][outDataIndex]);
+#endif
+  ++outDataIndex;
+
+  writeTempData = address & 0xFF;
+#if USE_CRC
+  calculate_crc(writeTempData);
+#endif
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
+  }
+  ++outDataIndex;
+
+  writeTempData = address >> 8;
+#if USE_CRC
+  calculate_crc(writeTempData);
+#endif
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
+  }
+  ++outDataIndex;
+
+#if USE_CRC
+  for (uint16_t i = 0; i < length; i++) {
+    calculate_crc(data[i]);
+  }
+#endif
+
+  u16_union_t _index;
+  _index.value = index;
+
+  if (_index.byte.low == START_FLAG || _index.byte.low == END_FLAG || _index.byte.low == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.low ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.low;
+    ++outDataIndex;
+  }
+
+  if (_index.byte.high == START_FLAG || _index.byte.high == END_FLAG || _index.byte.high == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.high ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = _index.byte.high;
+    ++outDataIndex;
+  }
+
+  for (uint16_t i = 0; i < length; i++) {
+    if (data[i] == START_FLAG || data[i] == END_FLAG || data[i] == ESCAPE_FLAG) {
+      _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+      ++outDataIndex;
+      _dataOut[_dataOutIndex][outDataIndex] = data[i] ^ XOR_FLAG;
+      ++outDataIndex;
+    } else {
+      _dataOut[_dataOutIndex][outDataIndex] = data[i];
+      ++outDataIndex;
+    }
+  }
+
+#if USE_ACK
+  if (_dataOutIndex == START_FLAG || _dataOutIndex == END_FLAG || _dataOutIndex == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = _dataOutIndex ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = _dataOutIndex;
+    ++outDataIndex;
+  }
+  // The slot generation tells this write's ACK from a late one of the slot's previous write.
+  writeTempData = _dataOutGenerations[_dataOutIndex];
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData ^ XOR_FLAG;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = writeTempData;
+  }
+  ++outDataIndex;
+#if USE_CRC
+  calculate_crc(_dataOutIndex);
+  calculate_crc(_dataOutGenerations[_dataOutIndex]);
+#endif
+#endif
+
+#if USE_CRC
+  if ((_crc.byte.high == (uint8_t)START_FLAG) || (_crc.byte.high == (uint8_t)END_FLAG)
+      || (_crc.byte.high == (uint8_t)ESCAPE_FLAG)) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.high ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.high;
+    ++outDataIndex;
+  }
+
+  if ((_crc.byte.low == (uint8_t)START_FLAG) || (_crc.byte.low == (uint8_t)END_FLAG)
+      || (_crc.byte.low == (uint8_t)ESCAPE_FLAG)) {
+    _dataOut[_dataOutIndex][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.low ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[_dataOutIndex][outDataIndex] = _crc.byte.low;
+    ++outDataIndex;
+  }
+#endif
+
+  _dataOut[_dataOutIndex][outDataIndex] = END_FLAG;
+  ++outDataIndex;
+
+  LUMEN_TRACE2(frame_encode_end, address, outDataIndex);
+
+  if (!lumen_write_frame(_dataOut[_dataOutIndex], outDataIndex, _dataOutIndex))
     return 0;
+
+#if USE_ACK
+  lumen_ack_register_slot(outDataIndex);
 #endif
 
+  return outDataIndex;
+}
+
+// Bytes of a packet's value on the wire, 0 for an unknown type.
+static uint32_t lumen_packet_value_length(const lumen_packet_t *packet) {
   switch (packet->type) {
     case kBool:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 1);
-      }
-      break;
-    case kString:
-      {
-        uint8_t index = 0;
-        for (; index < MAX_STRING_SIZE; ++index) {
-          if (packet->data._string[index] == '\0') {
-            break;
-          }
-        }
-
-        uint8_t length = index + 1;
-        lumen_write(packet->address, (uint8_t *)packet->data._string, length);
-      }
-      break;
     case kChar:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 1);
-      }
-      break;
     case kU8:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 1);
-      }
-      break;
     case kS8:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 1);
-      }
-      break;
+      return 1;
     case kU16:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 2);
-      }
-      break;
     case kS16:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 2);
-      }
-      break;
+      return 2;
     case kU32:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 4);
-      }
-      break;
     case kS32:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 4);
-      }
-      break;
     case kFloat:
-      {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 4);
-      }
-      break;
+      return 4;
     case kDouble:
+      return 8;
+    case kString:
       {
-        lumen_write(packet->address, (uint8_t *)packet->data._string, 8);
+        uint8_t index = 0;
+        for (; index < MAX_STRING_SIZE; ++index) {
+          if (packet->data._string[index] == '\0') {
+            break;
+          }
+        }
+        return index + 1;
       }
-      break;
     default:
-      {
+      return 0;
+  }
+}
+
+uint32_t lumen_write_packet(lumen_packet_t *packet) {
+
+#if USE_PROJECT_UPDATE
+  if (g_is_updating && !_updateMultiplexed)
+    return 0;
+#endif
+
+  uint32_t length = lumen_packet_value_length(packet);
+  if ((length > 0) && (lumen_write(packet->address, (uint8_t *)packet->data._string, length) == 0)) {
+    // Refused: every retry slot waits for its ACK, or the multiplex queue is full.
+    return 0;
+  }
+  return 1;
+}
+
+#if USE_TX_QUEUE
+#if (TX_QUEUE_SIZE & (TX_QUEUE_SIZE - 1)) || (TX_QUEUE_SIZE < 2)
+#error "TX_QUEUE_SIZE must be a power of two, from 2"
+#endif
+
+#define kTxQueueMask (TX_QUEUE_SIZE - 1)
+
+// Bounded multi-producer, single-consumer queue of packets, after Dmitry Vyukov's bounded queue.
+// Each cell's sequence tells whose turn it is at position p (p - index being its lap):
+// lap when the cell is free for a producer, lap + 1 once it holds a packet for the drainer.
+// Sequences are stored relative to their index, so the zero-initialised queue starts out empty.
+typedef struct {
+  uint32_t sequence;
+  lumen_packet_t packet;
+} lumen_tx_cell_t;
+
+static lumen_tx_cell_t _txCells[TX_QUEUE_SIZE];
+static uint32_t _txEnqueuePosition = 0;
+static uint32_t _txDequeuePosition = 0;
+static uint32_t _txDropped = 0;
+
+bool lumen_tx_enqueue(const lumen_packet_t *packet) {
+  uint32_t position = __atomic_load_n(&_txEnqueuePosition, __ATOMIC_RELAXED);
+  lumen_tx_cell_t *cell;
+
+  for (;;) {
+    cell = &_txCells[position & kTxQueueMask];
+    int32_t difference = (int32_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (position & ~kTxQueueMask));
+
+    if (difference == 0) {
+      // The cell is free: claim the position, or retry from the one another producer left.
+      if (__atomic_compare_exchange_n(&_txEnqueuePosition, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
       }
+    } else if (difference < 0) {
+      // The drainer has not emptied this cell since the last lap: the queue is full.
+      __atomic_fetch_add(&_txDropped, 1, __ATOMIC_RELAXED);
+      return false;
+    } else {
+      position = __atomic_load_n(&_txEnqueuePosition, __ATOMIC_RELAXED);
+    }
+  }
+
+  memcpy(&cell->packet, packet, sizeof(cell->packet));
+  __atomic_store_n(&cell->sequence, (position & ~kTxQueueMask) + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+uint32_t lumen_tx_drain(uint32_t max_packets) {
+  uint32_t quantityOfPackets = 0;
+
+  while ((max_packets == 0) || (quantityOfPackets < max_packets)) {
+    uint32_t position = _txDequeuePosition;
+    lumen_tx_cell_t *cell = &_txCells[position & kTxQueueMask];
+
+    // Empty, or its producer is still copying the packet.
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != (position & ~kTxQueueMask) + 1) {
       break;
+    }
+
+    // A write refused now (retry slots full, update running) is tried again by the next drain.
+    uint32_t length = lumen_packet_value_length(&cell->packet);
+    if ((length > 0) && (lumen_write(cell->packet.address, (uint8_t *)cell->packet.data._string, length) == 0)) {
+      break;
+    }
+
+    __atomic_store_n(&cell->sequence, (position & ~kTxQueueMask) + TX_QUEUE_SIZE, __ATOMIC_RELEASE);
+    _txDequeuePosition = position + 1;
+    ++quantityOfPackets;
   }
-  return 1;
+  return quantityOfPackets;
+}
+
+uint32_t lumen_tx_dropped() {
+  return __atomic_load_n(&_txDropped, __ATOMIC_RELAXED);
 }
+#endif
 
 void ParsePayload() {
   switch (_payloadIndex) {
@@ -631,6 +1580,9 @@ void SendAck() {
 
 void Pack() {
   if (_command == READ_FLAG) {
+#if USE_LATENCY_HISTOGRAMS
+    lumen_latency_answer_parsed(_address.value);
+#endif
     if (reading == true) {
       if (_address.value == readingPacket->address) {
 
@@ -644,9 +1596,12 @@ void Pack() {
       }
     }
 
+    bool stored = false;
+
     for (uint8_t packetIndex = 0; packetIndex < QUANTITY_OF_PACKETS; ++packetIndex) {
       if (occupiedSlots[packetIndex] == true) {
         if (packets[packetIndex].address == _address.value) {
+          stored = true;
           uint8_t dataSize = _dataIndex - kData;
 #if USE_ACK
           dataSize = dataSize - 2;
@@ -660,7 +1615,7 @@ void Pack() {
     }
 
     for (uint8_t packetIndex = 0; packetIndex < QUANTITY_OF_PACKETS; ++packetIndex) {
-      if (occupiedSlots[packetIndex] == false) {
+      if ((occupiedSlots[packetIndex] == false) && (borrowedSlots[packetIndex] == false)) {
 
         packets[packetIndex].address = _address.value;
 
@@ -672,465 +1627,1946 @@ void Pack() {
           packets[packetIndex].data._string[i] = _dataIn[i + kData];
         }
         occupiedSlots[packetIndex] = true;
+        stored = true;
 
         ++quantityOfPacketsAvailable;
+        LUMEN_STAT_MAX(max_packets_available, quantityOfPacketsAvailable);
+        LUMEN_TRACE2(packet_enqueued, _address.value, quantityOfPacketsAvailable);
         break;
       }
     }
 
-#if USE_ACK
-    SendAck();
+    if (!stored) {
+      LUMEN_STAT_ADD(packets_dropped, 1);
+      LUMEN_TRACE1(packet_dropped, _address.value);
+    }
+
+#if USE_ACK
+    SendAck();
+
+    _ackDataOut[_ackDataOutLength] = END_FLAG;
+    ++_ackDataOutLength;
+
+    lumen_write_frame(_ackDataOut, _ackDataOutLength, 0);
+#endif
+
+  }
+#if USE_ACK
+  else if (_command == ACK_FLAG) {
+    lumen_ack_received(_address.byte.low, _address.byte.high);
+  }
+#endif
+}
+
+static bool _started;
+static bool _escaped;
+#if USE_CRC
+static bool _crcStarted;
+static uint16_t _crcIndex;
+static uint16_t _crcIndexDelayed;
+static uint16_t _crcData[3];
+#endif
+
+// Feeds receivedData to the frame parser.
+static void ParseFrameByte() {
+  LUMEN_STAT_ADD(bytes_received, 1);
+
+  if (receivedData == START_FLAG) {
+
+#if USE_CRC
+    _crc.value = 0xFFFF;
+    _crcIndex = 0;
+    _crcStarted = false;
+    _crcIndexDelayed = 0;
+#endif
+    _started = true;
+    _escaped = false;
+    _dataIndex = 0;
+    _payloadIndex = kCommand;
+
+  } else if (receivedData == END_FLAG) {
+
+#if USE_CRC
+    _crc.value = 0xFFFF;
+    uint16_t _dataIndexOffseted = _dataIndex - 2;
+
+    for (uint16_t pos = 0; pos < _dataIndexOffseted; ++pos) {
+      calculate_crc(_dataIn[pos]);
+    }
+
+    if ((_dataIn[_dataIndex - 2] == (_crc.byte.high)) && (_dataIn[_dataIndex - 1] == (_crc.byte.low))) {
+      _dataIndex = _dataIndexOffseted;
+      LUMEN_STAT_ADD(frames_received, 1);
+      LUMEN_TRACE2(frame_accepted, _command, _address.value);
+      Pack();
+    } else {
+      LUMEN_STAT_ADD(crc_errors, 1);
+      LUMEN_TRACE2(frame_rejected, _command, _address.value);
+    }
+    _crcStarted = false;
+#else
+    LUMEN_STAT_ADD(frames_received, 1);
+    LUMEN_TRACE2(frame_accepted, _command, _address.value);
+    Pack();
+
+#endif
+    _started = false;
+    _payloadIndex = kPayloadNull;
+  } else if (_started) {
+    if (_escaped) {
+      receivedData ^= XOR_FLAG;
+      _escaped = false;
+      ParsePayload();
+    } else if (receivedData == ESCAPE_FLAG) {
+      LUMEN_STAT_ADD(escapes_received, 1);
+      _escaped = true;
+    } else {
+      ParsePayload();
+    }
+  }
+}
+
+// Parses at most max_bytes bytes and max_frames frames, 0 meaning no limit. A frame cut by the
+// budget is finished by the next call: the parser keeps its state in between.
+uint32_t lumen_poll(uint32_t max_bytes, uint32_t max_frames) {
+
+#if USE_PROJECT_UPDATE
+  if (g_is_updating) {
+    // While multiplexed, the update engine reads the incoming bytes and parses the variable frames.
+    return _updateMultiplexed ? quantityOfPacketsAvailable : 0;
+  }
+#endif
+
+  uint32_t quantityOfBytes = 0;
+  uint32_t quantityOfFrames = 0;
+
+  while (((max_bytes == 0) || (quantityOfBytes < max_bytes)) && ((max_frames == 0) || (quantityOfFrames < max_frames))) {
+    receivedData = lumen_port_get_byte();
+    if (receivedData == DATA_NULL) {
+      break;
+    }
+    ++quantityOfBytes;
+    // END_FLAG is always escaped inside a frame, so each one ends a frame.
+    if (receivedData == END_FLAG) {
+      ++quantityOfFrames;
+    }
+    ParseFrameByte();
+  }
+#if USE_RX_RING
+  // A budget may stop in the middle of a batch: the bytes parsed so far are room for the producer.
+  lumen_rx_ring_release();
+#endif
+  return quantityOfPacketsAvailable;
+}
+
+uint32_t lumen_available() {
+  return lumen_poll(0, 0);
+}
+
+// Takes the first unread packet out of the queue and returns its slot, QUANTITY_OF_PACKETS if there is none.
+static uint8_t lumen_take_first_packet() {
+
+#if USE_PROJECT_UPDATE
+  if (g_is_updating && !_updateMultiplexed)
+    return QUANTITY_OF_PACKETS;
+#endif
+
+  for (uint8_t i = 0; i < QUANTITY_OF_PACKETS; ++i) {
+    if (occupiedSlots[i]) {
+      occupiedSlots[i] = false;
+      --quantityOfPacketsAvailable;
+      return i;
+    }
+  }
+  return QUANTITY_OF_PACKETS;
+}
+
+lumen_packet_t *lumen_get_first_packet() {
+  uint8_t packetIndex = lumen_take_first_packet();
+
+  return (packetIndex < QUANTITY_OF_PACKETS) ? &packets[packetIndex] : NULL;
+}
+
+bool lumen_pop(lumen_packet_t *packet) {
+  uint8_t packetIndex = lumen_take_first_packet();
+
+  if (packetIndex == QUANTITY_OF_PACKETS) {
+    return false;
+  }
+  memcpy(packet, &packets[packetIndex], sizeof(*packet));
+  return true;
+}
+
+lumen_packet_t *lumen_borrow_first_packet() {
+  uint8_t packetIndex = lumen_take_first_packet();
+
+  if (packetIndex == QUANTITY_OF_PACKETS) {
+    return NULL;
+  }
+  borrowedSlots[packetIndex] = true;
+  return &packets[packetIndex];
+}
+
+bool lumen_release_packet(lumen_packet_t *packet) {
+  if ((packet < packets) || (packet >= &packets[QUANTITY_OF_PACKETS])) {
+    return false;
+  }
+
+  uint8_t packetIndex = packet - packets;
+  if (!borrowedSlots[packetIndex]) {
+    return false;
+  }
+  borrowedSlots[packetIndex] = false;
+  return true;
+}
+
+bool lumen_request(lumen_packet_t *packet) {
+
+#if USE_PROJECT_UPDATE
+  if (g_is_updating && !_updateMultiplexed)
+    return false;
+#endif
+
+  LUMEN_TRACE2(frame_encode_begin, packet->address, 0);
+
+  static uint32_t outDataIndex;
+  readingPacket = packet;
+  outDataIndex = 0;
+
+  _dataOut[0][outDataIndex] = START_FLAG;
+  ++outDataIndex;
+
+  _dataOut[0][outDataIndex] = READ_FLAG;
+#if USE_CRC
+  _crc.value = 0xFFFF;
+  calculate_crc(_dataOut[0][outDataIndex]);
+#endif
+  ++outDataIndex;
+
+  writeTempData = readingPacket->address & 0xFF;
+#if USE_CRC
+  calculate_crc(writeTempData);
+#endif
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
+    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[0][outDataIndex] = writeTempData ^ XOR_FLAG;
+  } else {
+    _dataOut[0][outDataIndex] = writeTempData;
+  }
+  ++outDataIndex;
+
+  writeTempData = readingPacket->address >> 8;
+#if USE_CRC
+  calculate_crc(writeTempData);
+#endif
+  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
+    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[0][outDataIndex] = writeTempData ^ XOR_FLAG;
+  } else {
+    _dataOut[0][outDataIndex] = writeTempData;
+  }
+  ++outDataIndex;
+
+  _dataOut[0][outDataIndex] = 1;
+#if USE_CRC
+  calculate_crc(_dataOut[0][outDataIndex]);
+#endif
+  ++outDataIndex;
+
+#if USE_CRC
+
+  if ((_crc.byte.high == (uint8_t)START_FLAG) || (_crc.byte.high == (uint8_t)END_FLAG)
+      || (_crc.byte.high == (uint8_t)ESCAPE_FLAG)) {
+    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[0][outDataIndex] = _crc.byte.high ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[0][outDataIndex] = _crc.byte.high;
+    ++outDataIndex;
+  }
+
+  if ((_crc.byte.low == (uint8_t)START_FLAG) || (_crc.byte.low == (uint8_t)END_FLAG)
+      || (_crc.byte.low == (uint8_t)ESCAPE_FLAG)) {
+    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
+    ++outDataIndex;
+    _dataOut[0][outDataIndex] = _crc.byte.low ^ XOR_FLAG;
+    ++outDataIndex;
+  } else {
+    _dataOut[0][outDataIndex] = _crc.byte.low;
+    ++outDataIndex;
+  }
+
+#endif
+
+  _dataOut[0][outDataIndex] = END_FLAG;
+  ++outDataIndex;
+
+  LUMEN_TRACE2(frame_encode_end, readingPacket->address, outDataIndex);
+
+  if (!lumen_write_frame(_dataOut[0], outDataIndex, 0))
+    return false;
+
+#if USE_LATENCY_HISTOGRAMS
+  lumen_latency_request_sent(readingPacket->address);
+#endif
+  return true;
+}
+
+bool lumen_read(lumen_packet_t *packet) {
+
+#if USE_PROJECT_UPDATE
+  if (g_is_updating)
+    return false;
+#endif
+
+  reading = true;
+
+  if (!lumen_request(packet)) {
+    return false;
+  }
+
+  uint32_t elapsedTickTimeOut = 0;
+
+  while (reading == true) {
+    lumen_available();
+
+    ++elapsedTickTimeOut;
+
+    if (elapsedTickTimeOut >= TICK_TIME_OUT) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if USE_PROJECT_UPDATE
+
+#define MESSAGE(x) lumen_update_write_bytes((uint8_t *)x, (uint32_t)strlen(x))
+
+#define kUpdateProject "UPDATE PROJECT A"
+#define kUpdateFirmware "UPDATE FIRMWARE A"
+#define kCommandFinished "FINISHED A"
+#define kCommandFinishedAndReset "FINISHED RESET A"
+// Inserted before the final "A" of the finish command after a delta manifest.
+#define kCommandFinishedCrc "CRC "
+#define kCommandNewDataBlock "NEW BLOCK A"
+#define kOKMessage "RECEIVED OK A"
+#define kNotOKMessage "RECEIVED NOT OK A"
+// Followed by the quantity of blocks the display holds and " A", in answer to RESUME BLOCK.
+#define kReceivedBlocksMessage "RECEIVED BLOCKS "
+
+#define kStartInterval 5
+#define kSendBlockInterval 1000
+
+#define kProjectUpdateBlockLength 1024
+#define kProjectUpdateCrcLength 2
+
+#define LUMEN_STRINGIFY(x) #x
+#define LUMEN_EXPAND_AND_STRINGIFY(x) LUMEN_STRINGIFY(x)
+
+#if (PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH % kProjectUpdateBlockLength) || (PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH > 65536)
+#error "PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH must be a multiple of 1024, up to 65536"
+#endif
+
+#if USE_PROJECT_UPDATE_FLEET && !USE_PROJECT_UPDATE_FROM_FILE
+#error "USE_PROJECT_UPDATE_FLEET needs USE_PROJECT_UPDATE_FROM_FILE"
+#endif
+
+#if USE_PROJECT_UPDATE_PARALLEL_CRC && !USE_PROJECT_UPDATE_FROM_FILE
+#error "USE_PROJECT_UPDATE_PARALLEL_CRC needs USE_PROJECT_UPDATE_FROM_FILE"
+#endif
+
+#define kCommandBlockLength "BLOCK LENGTH " LUMEN_EXPAND_AND_STRINGIFY(PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH) " A"
+#define kCommandResumeBlock "RESUME BLOCK "
+#define kCommandDeltaManifest "DELTA MANIFEST "
+#define kCommandCompression "COMPRESSION LZSS A"
+#define kCommandNewPackedBlock "NEW PACKED BLOCK A"
+#define kCommandMultiplex "MULTIPLEX A"
+#define kPackedHeaderLength 2
+// Blocks are packed at any negotiated length, up to the proposed one.
+#define kPackMaxBlockLength ((PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH > kProjectUpdateBlockLength) ? PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH : kProjectUpdateBlockLength)
+
+typedef enum send_step {
+  kSendNewBlockCmd,
+  kWaitingForOkMessageOfNewBlockCmd,
+  kWaitingForOkMessageOfBlock,
+} lumen_project_update_send_step_t;
+
+typedef struct {
+  const char *word;
+  lumen_project_update_response_t response;
+} lumen_project_update_response_pattern_t;
+
+// Every answer the display may send during an update, recognised together in a single pass.
+static const lumen_project_update_response_pattern_t responsePatterns[] = {
+  { kOKMessage, kOk },
+  { kNotOKMessage, kFail },
+#if USE_PROJECT_UPDATE_RESUME
+  { kReceivedBlocksMessage, kReceivedBlocks },
+#endif
+};
+
+#define kQuantityOfResponsePatterns (sizeof(responsePatterns) / sizeof(responsePatterns[0]))
+#define kResponseMatcherMaxStates 64
+#define kResponseMatcherRoot 0
+#define kResponseMatcherNoState 0xFF
+
+// Aho-Corasick automaton over responsePatterns: a trie with failure links,
+// children kept as sibling lists to stay small on MCUs.
+typedef struct {
+  char character;
+  uint8_t firstChild;
+  uint8_t nextSibling;
+  uint8_t failure;
+  lumen_project_update_response_t output;
+} lumen_project_update_matcher_state_t;
+
+static lumen_project_update_matcher_state_t matcherStates[kResponseMatcherMaxStates];
+static uint8_t quantityOfMatcherStates = 0;
+
+typedef struct {
+  uint32_t dataIndex;
+  uint32_t blockBufferLength;
+  u16_union_t crc;
+  lumen_timer_t sendBlockInterval;
+  bool sending;
+  uint32_t sendingLength;
+  uint32_t sendingLengthOfLastBlock;
+  bool finishedLastSend;
+  uint8_t *block;
+  uint8_t crcTrailer[kProjectUpdateCrcLength];
+  lumen_project_update_send_step_t sendStep;
+  uint32_t acknowledgedBlocks;
+  uint32_t skipLength;
+  uint32_t retries;
+#if USE_PROJECT_UPDATE_COMPRESSION
+  bool packed;
+#endif
+#if USE_PROJECT_UPDATE_RESUME && USE_PROJECT_UPDATE_DELTA
+  bool skippingUnchangedBlock;
+#endif
+} lumen_project_update_sender_t;
+
+// Everything an update dialogue keeps between two calls.
+// The library's own transfer runs on _primaryLink; fleet updates run one link per display.
+typedef struct {
+#if USE_PROJECT_UPDATE_FLEET
+  lumen_update_link_io_t io;
+#endif
+  lumen_project_update_sender_t sender;
+  uint8_t matcherState;
+  uint32_t elapsedTimeInMs;
+  bool isStarted;
+  bool resetPending;
+  lumen_timer_t startInterval;
+  lumen_timer_t restartInterval;
+  lumen_timer_t finishInterval;
+  bool finishedLastFileSend;
+  bool queryAsked;
+  lumen_timer_t queryInterval;
+  uint32_t sentLength;
+  uint8_t defaultBlockBuffer[kProjectUpdateBlockLength + kProjectUpdateCrcLength];
+  uint8_t *blockBuffer;
+  uint32_t blockBufferSize;
+  uint32_t blockLength;
+  bool blockLengthNegotiated;
+#if USE_PROJECT_UPDATE_RESUME || USE_PROJECT_UPDATE_DELTA
+  char queryMessage[32];
+#endif
+#if USE_PROJECT_UPDATE_RESUME
+  bool resumeNegotiated;
+  uint32_t resumeCandidateBlocks;
+  uint32_t resumeCandidateBlockLength;
+  uint32_t resumeCandidateHash;
+  bool readingReceivedBlocks;
+  uint32_t receivedBlocks;
+#endif
+#if USE_PROJECT_UPDATE_DELTA
+  bool deltaNegotiated;
+  bool deltaAccepted;
+  bool sendingManifest;
+  const uint8_t *deltaManifest;
+  uint32_t deltaManifestBlocks;
+  uint32_t imageCrc;
+  bool imageRejected;
+#endif
+#if USE_PROJECT_UPDATE_COMPRESSION
+  bool compressionNegotiated;
+  bool compressionAccepted;
+  uint8_t packedBlock[kPackedHeaderLength + kPackMaxBlockLength + kProjectUpdateCrcLength];
+  uint32_t packedBlockLength;
+#endif
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  bool multiplexNegotiated;
+#endif
+#if USE_PROJECT_UPDATE_PROGRESS
+  lumen_update_progress_t progress;
+#endif
+#if USE_CLOCK
+  uint32_t lastTickTime;
+#endif
+} lumen_update_link_t;
+
+#define LUMEN_UPDATE_LINK_INITIALIZER(link) \
+  { .sender = { .finishedLastSend = true }, \
+    .resetPending = true, \
+    .startInterval = { .deadline = kStartInterval }, \
+    .blockBuffer = (link).defaultBlockBuffer, \
+    .blockBufferSize = kProjectUpdateBlockLength + kProjectUpdateCrcLength, \
+    .blockLength = kProjectUpdateBlockLength }
+
+static lumen_update_link_t _primaryLink = LUMEN_UPDATE_LINK_INITIALIZER(_primaryLink);
+static lumen_update_link_t *_link = &_primaryLink;
+
+static uint32_t lumen_update_now() {
+#if USE_CLOCK
+  return lumen_now_us();
+#else
+  return _link->elapsedTimeInMs;
+#endif
+}
+
+#if USE_PROJECT_UPDATE_FLEET
+typedef enum {
+  kFleetLinkSending,
+  kFleetLinkFinishing,
+  kFleetLinkFinished,
+  kFleetLinkFailed
+} lumen_fleet_link_stage_t;
+
+static lumen_update_link_t _fleetLinks[PROJECT_UPDATE_FLEET_MAX_LINKS];
+static lumen_fleet_link_stage_t _fleetLinkStages[PROJECT_UPDATE_FLEET_MAX_LINKS];
+// Rearmed whenever the link makes progress: the link fails when it expires.
+static lumen_timer_t _fleetLinkTimeouts[PROJECT_UPDATE_FLEET_MAX_LINKS];
+static uint8_t _quantityOfFleetLinks = 0;
+#endif
+
+static uint8_t lumen_project_update_matcher_child(uint8_t state, char character) {
+  for (uint8_t child = matcherStates[state].firstChild; child != kResponseMatcherNoState; child = matcherStates[child].nextSibling) {
+    if (matcherStates[child].character == character) {
+      return child;
+    }
+  }
+  return kResponseMatcherNoState;
+}
+
+static void lumen_project_update_matcher_build() {
+  uint8_t queue[kResponseMatcherMaxStates];
+  uint8_t queueHead = 0;
+  uint8_t queueTail = 0;
+
+  matcherStates[kResponseMatcherRoot].firstChild = kResponseMatcherNoState;
+  matcherStates[kResponseMatcherRoot].nextSibling = kResponseMatcherNoState;
+  matcherStates[kResponseMatcherRoot].failure = kResponseMatcherRoot;
+  matcherStates[kResponseMatcherRoot].output = kNull;
+  quantityOfMatcherStates = 1;
+
+  for (uint8_t pattern = 0; pattern < kQuantityOfResponsePatterns; ++pattern) {
+    uint8_t state = kResponseMatcherRoot;
+
+    for (const char *character = responsePatterns[pattern].word; *character != '\0'; ++character) {
+      uint8_t child = lumen_project_update_matcher_child(state, *character);
+
+      if (child == kResponseMatcherNoState) {
+        child = quantityOfMatcherStates;
+        ++quantityOfMatcherStates;
+        matcherStates[child].character = *character;
+        matcherStates[child].firstChild = kResponseMatcherNoState;
+        matcherStates[child].nextSibling = matcherStates[state].firstChild;
+        matcherStates[child].output = kNull;
+        matcherStates[state].firstChild = child;
+      }
+      state = child;
+    }
+    matcherStates[state].output = responsePatterns[pattern].response;
+  }
+
+  // Breadth-first, so every failure target is complete before it is used.
+  for (uint8_t child = matcherStates[kResponseMatcherRoot].firstChild; child != kResponseMatcherNoState; child = matcherStates[child].nextSibling) {
+    matcherStates[child].failure = kResponseMatcherRoot;
+    queue[queueTail] = child;
+    ++queueTail;
+  }
+
+  while (queueHead < queueTail) {
+    uint8_t state = queue[queueHead];
+    ++queueHead;
+
+    for (uint8_t child = matcherStates[state].firstChild; child != kResponseMatcherNoState; child = matcherStates[child].nextSibling) {
+      uint8_t failure = matcherStates[state].failure;
+      uint8_t next = lumen_project_update_matcher_child(failure, matcherStates[child].character);
+
+      while ((next == kResponseMatcherNoState) && (failure != kResponseMatcherRoot)) {
+        failure = matcherStates[failure].failure;
+        next = lumen_project_update_matcher_child(failure, matcherStates[child].character);
+      }
+      matcherStates[child].failure = (next == kResponseMatcherNoState) ? kResponseMatcherRoot : next;
+
+      if (matcherStates[child].output == kNull) {
+        matcherStates[child].output = matcherStates[matcherStates[child].failure].output;
+      }
+      queue[queueTail] = child;
+      ++queueTail;
+    }
+  }
+}
+
+// Feeds one received character to the automaton.
+// Returns the response completed by this character, or kNull.
+static lumen_project_update_response_t lumen_project_update_match_response(char character) {
+  uint8_t next;
+
+  if (quantityOfMatcherStates == 0) {
+    lumen_project_update_matcher_build();
+  }
+
+  next = lumen_project_update_matcher_child(_link->matcherState, character);
+  while ((next == kResponseMatcherNoState) && (_link->matcherState != kResponseMatcherRoot)) {
+    _link->matcherState = matcherStates[_link->matcherState].failure;
+    next = lumen_project_update_matcher_child(_link->matcherState, character);
+  }
+  _link->matcherState = (next == kResponseMatcherNoState) ? kResponseMatcherRoot : next;
+
+  if (matcherStates[_link->matcherState].output != kNull) {
+    lumen_project_update_response_t response = matcherStates[_link->matcherState].output;
+    _link->matcherState = kResponseMatcherRoot;
+    return response;
+  }
+  return kNull;
+}
+
+static u16_union_t lumen_project_update_calculate_crc(uint8_t *data, uint32_t length) {
+
+  static u16_union_t crc;
+  static uint32_t pos;
+  static uint32_t i;
+  static uint32_t z = 0;
+  static uint32_t u = 0x0001;
+  static uint32_t o = 8;
+  static uint32_t p = 0xA001;
+
+  crc.value = 0xFFFF;
+
+  for (pos = z; pos < length; pos++) {
+    crc.value ^= (uint16_t)*data;
+    ++data;
+
+    for (i = o; z != i; --i) {
+      if (z != (u & crc.value)) {
+        crc.value >>= u;
+        crc.value ^= p;
+      } else {
+        crc.value >>= u;
+      }
+    }
+  }
+  return crc;
+}
+
+static void lumen_update_write_bytes(uint8_t *data, uint32_t length) {
+#if USE_PROJECT_UPDATE_FLEET
+  if (_link->io.write_bytes != NULL) {
+    _link->io.write_bytes(_link->io.context, data, length);
+    return;
+  }
+#endif
+  lumen_port_write_bytes(data, length);
+}
+
+static uint16_t lumen_update_read_byte() {
+#if USE_PROJECT_UPDATE_FLEET
+  if (_link->io.get_byte != NULL) {
+    return _link->io.get_byte(_link->io.context);
+  }
+#endif
+  return lumen_port_get_byte();
+}
+
+static bool lumen_update_use_block_buffer(lumen_update_link_t *link, uint8_t *buffer, uint32_t size) {
+  if (buffer == NULL) {
+    link->blockBuffer = link->defaultBlockBuffer;
+    link->blockBufferSize = sizeof(link->defaultBlockBuffer);
+    return true;
+  }
+  if (size < kProjectUpdateBlockLength + kProjectUpdateCrcLength) {
+    return false;
+  }
+  link->blockBuffer = buffer;
+  link->blockBufferSize = size;
+  return true;
+}
+
+bool lumen_project_and_firmware_update_set_block_buffer(uint8_t *buffer, uint32_t size) {
+  if (g_is_updating) {
+    return false;
+  }
+  return lumen_update_use_block_buffer(_link, buffer, size);
+}
+
+uint32_t lumen_project_and_firmware_update_block_length() {
+  return _link->blockLength;
+}
+
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+// Bytes parsed since the START_FLAG of the frame in progress.
+static uint32_t _multiplexFrameLength = 0;
+#endif
+
+// Reads the next byte for the update engine.
+// While multiplexed, variable frames sent by the display are parsed on the way and never reach the matcher.
+static uint16_t lumen_update_get_byte() {
+  uint16_t data = lumen_update_read_byte();
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  while (_updateMultiplexed && (_link == &_primaryLink) && (data != DATA_NULL) && (_started || (data == START_FLAG))) {
+    if (data == START_FLAG) {
+      _multiplexFrameLength = 0;
+    } else if (++_multiplexFrameLength > kDataLength) {
+      // No frame is that long: its END_FLAG was lost. Give the bytes back to the update
+      // answers, which the frame would otherwise swallow until the display's next frame.
+      _started = false;
+      break;
+    }
+    receivedData = data;
+    ParseFrameByte();
+    data = lumen_update_read_byte();
+  }
+#endif
+  return data;
+}
+
+// Sends a command and waits for its answer.
+// Returns kNull while waiting, kOk on "RECEIVED OK A", and kFail on "RECEIVED NOT OK A" or timeout.
+// With USE_PROJECT_UPDATE_RESUME, returns kReceivedBlocks on "RECEIVED BLOCKS <n> A", n in _link->receivedBlocks.
+static lumen_project_update_response_t lumen_update_query_bytes(uint8_t *data, uint32_t length) {
+  lumen_project_update_response_t response;
+
+  if (!_link->queryAsked) {
+    lumen_update_write_bytes(data, length);
+    lumen_timer_arm(&_link->queryInterval, lumen_update_now(), kSendBlockInterval);
+    _link->queryAsked = true;
+#if USE_PROJECT_UPDATE_RESUME
+    _link->readingReceivedBlocks = false;
+#endif
+    return kNull;
+  }
+
+  receivedData = lumen_update_get_byte();
+  while (receivedData != DATA_NULL) {
+#if USE_PROJECT_UPDATE_RESUME
+    if (_link->readingReceivedBlocks) {
+      if ((receivedData >= '0') && (receivedData <= '9')) {
+        // Saturates instead of wrapping: a count that large is refused by the minimum below anyway.
+        _link->receivedBlocks = (_link->receivedBlocks < 100000000UL) ? _link->receivedBlocks * 10 + (receivedData - '0') : 0xFFFFFFFFUL;
+        receivedData = lumen_update_get_byte();
+        continue;
+      }
+      // The number ends at the space before "A".
+      _link->readingReceivedBlocks = false;
+      _link->queryAsked = false;
+      lumen_timer_disarm(&_link->queryInterval);
+      return kReceivedBlocks;
+    }
+#endif
+    response = lumen_project_update_match_response((char)receivedData);
+#if USE_PROJECT_UPDATE_RESUME
+    if (response == kReceivedBlocks) {
+      _link->readingReceivedBlocks = true;
+      _link->receivedBlocks = 0;
+    }
+#endif
+    if (response == kOk) {
+      _link->queryAsked = false;
+      lumen_timer_disarm(&_link->queryInterval);
+      return kOk;
+    }
+    if (response == kFail) {
+      _link->queryAsked = false;
+      lumen_timer_disarm(&_link->queryInterval);
+      return kFail;
+    }
+    receivedData = lumen_update_get_byte();
+  }
+
+  if (lumen_timer_expired(&_link->queryInterval, lumen_update_now())) {
+    _link->queryAsked = false;
+    return kFail;
+  }
+  return kNull;
+}
+
+static lumen_project_update_response_t lumen_update_query(const char *msg) {
+  return lumen_update_query_bytes((uint8_t *)msg, (uint32_t)strlen(msg));
+}
+
+// Proposes PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH to the display.
+// Falls back to kProjectUpdateBlockLength when the display refuses, does not answer,
+// or the block buffer is too small for the proposed length.
+static bool lumen_update_negotiate_block_length() {
+  if ((PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH <= kProjectUpdateBlockLength)
+      || (_link->blockBufferSize < PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH + kProjectUpdateCrcLength)
+#if USE_PROJECT_UPDATE_DELTA
+      // Delta manifests describe 1024 bytes blocks.
+      || (_link->deltaManifestBlocks > 0)
+#endif
+  ) {
+    _link->blockLength = kProjectUpdateBlockLength;
+    return true;
+  }
+
+  switch (lumen_update_query(kCommandBlockLength)) {
+    case kOk:
+      _link->blockLength = PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH;
+      return true;
+    case kFail:
+      _link->blockLength = kProjectUpdateBlockLength;
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+#if USE_PROJECT_UPDATE_RESUME || USE_PROJECT_UPDATE_DELTA
+static uint32_t lumen_update_format_u32(char *text, uint32_t value) {
+  char digits[10];
+  uint32_t quantityOfDigits = 0;
+
+  do {
+    digits[quantityOfDigits] = '0' + (value % 10);
+    ++quantityOfDigits;
+    value /= 10;
+  } while (value > 0);
+
+  for (uint32_t i = 0; i < quantityOfDigits; ++i) {
+    text[i] = digits[quantityOfDigits - 1 - i];
+  }
+  return quantityOfDigits;
+}
+#endif
+
+uint32_t lumen_project_and_firmware_update_image_hash(const uint8_t *data, uint32_t length, uint32_t hash) {
+  for (uint32_t i = 0; i < length; ++i) {
+    hash ^= data[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+#if USE_PROJECT_UPDATE_DELTA
+uint32_t lumen_project_and_firmware_update_block_hashes(const uint8_t *image, uint32_t length, uint32_t *hashes) {
+  uint32_t quantityOfBlocks = length / kProjectUpdateBlockLength;
+
+  for (uint32_t block = 0; block < quantityOfBlocks; ++block) {
+    hashes[block] = lumen_project_and_firmware_update_image_hash(&image[block * kProjectUpdateBlockLength], kProjectUpdateBlockLength, LUMEN_IMAGE_HASH_SEED);
+  }
+  return quantityOfBlocks;
+}
+
+uint32_t lumen_project_and_firmware_update_build_delta_manifest(const uint32_t *old_hashes, uint32_t old_quantity_of_blocks,
+                                                                const uint8_t *new_image, uint32_t new_length, uint8_t *manifest) {
+  uint32_t quantityOfBlocks = (new_length + kProjectUpdateBlockLength - 1) / kProjectUpdateBlockLength;
+  uint32_t quantityOfChangedBlocks = 0;
+
+  memset(manifest, 0, LUMEN_DELTA_MANIFEST_SIZE(new_length));
+
+  for (uint32_t block = 0; block < quantityOfBlocks; ++block) {
+    uint32_t offset = block * kProjectUpdateBlockLength;
+    bool changed = true;
+
+    // A partial last block is always sent, since the display pads it like any other transfer.
+    if ((block < old_quantity_of_blocks) && (offset + kProjectUpdateBlockLength <= new_length)) {
+      changed = old_hashes[block] != lumen_project_and_firmware_update_image_hash(&new_image[offset], kProjectUpdateBlockLength, LUMEN_IMAGE_HASH_SEED);
+    }
+
+    if (changed) {
+      manifest[block / 8] |= (uint8_t)(1 << (block % 8));
+      ++quantityOfChangedBlocks;
+    }
+  }
+  return quantityOfChangedBlocks;
+}
+
+uint32_t lumen_project_and_firmware_update_build_delta_manifest_from_image(const uint8_t *old_image, uint32_t old_length,
+                                                                           const uint8_t *new_image, uint32_t new_length, uint8_t *manifest) {
+  uint32_t quantityOfBlocks = (new_length + kProjectUpdateBlockLength - 1) / kProjectUpdateBlockLength;
+  uint32_t quantityOfChangedBlocks = 0;
+
+  memset(manifest, 0, LUMEN_DELTA_MANIFEST_SIZE(new_length));
+
+  for (uint32_t block = 0; block < quantityOfBlocks; ++block) {
+    uint32_t offset = block * kProjectUpdateBlockLength;
+    bool changed = true;
+
+    if ((offset + kProjectUpdateBlockLength <= old_length) && (offset + kProjectUpdateBlockLength <= new_length)) {
+      changed = memcmp(&old_image[offset], &new_image[offset], kProjectUpdateBlockLength) != 0;
+    }
+
+    if (changed) {
+      manifest[block / 8] |= (uint8_t)(1 << (block % 8));
+      ++quantityOfChangedBlocks;
+    }
+  }
+  return quantityOfChangedBlocks;
+}
+
+// CRC-32 (IEEE 802.3, reflected), chained like zlib's crc32: start with 0.
+static uint32_t lumen_update_image_crc(const uint8_t *data, uint32_t length, uint32_t crc) {
+  crc = ~crc;
+  for (uint32_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320UL : (crc >> 1);
+    }
+  }
+  return ~crc;
+}
+
+bool lumen_project_and_firmware_update_image_rejected() {
+  return _link->imageRejected;
+}
+
+void lumen_project_and_firmware_update_set_delta_manifest(const uint8_t *manifest, uint32_t quantity_of_blocks) {
+  _link->deltaManifest = manifest;
+  _link->deltaManifestBlocks = (manifest != NULL) ? quantity_of_blocks : 0;
+}
+
+static bool lumen_update_delta_block_unchanged(uint32_t block) {
+  if (!_link->deltaAccepted || (block >= _link->deltaManifestBlocks)) {
+    return false;
+  }
+  return (_link->deltaManifest[block / 8] & (1 << (block % 8))) == 0;
+}
+
+// Sends "DELTA MANIFEST <blocks> A", then the manifest bitmap followed by its CRC.
+// The display keeps its current copy of every block whose bit is cleared.
+// Without a manifest, or if the display refuses either step, the whole image is sent.
+static bool lumen_update_negotiate_delta() {
+  uint32_t manifestLength = (_link->deltaManifestBlocks + 7) / 8;
 
-    _ackDataOut[_ackDataOutLength] = END_FLAG;
-    ++_ackDataOutLength;
+  if ((_link->deltaManifestBlocks == 0) || (manifestLength + kProjectUpdateCrcLength > _link->blockBufferSize)) {
+    _link->deltaAccepted = false;
+    return true;
+  }
 
-    lumen_write_bytes(_ackDataOut, _ackDataOutLength);
-#endif
+  if (!_link->sendingManifest) {
+    if (_link->queryMessage[0] == '\0') {
+      uint32_t length = sizeof(kCommandDeltaManifest) - 1;
+      memcpy(_link->queryMessage, kCommandDeltaManifest, length);
+      length += lumen_update_format_u32(&_link->queryMessage[length], _link->deltaManifestBlocks);
+      memcpy(&_link->queryMessage[length], " A", sizeof(" A"));
+    }
 
+    switch (lumen_update_query(_link->queryMessage)) {
+      case kOk:
+        {
+          u16_union_t crc = lumen_project_update_calculate_crc((uint8_t *)_link->deltaManifest, manifestLength);
+          memcpy(_link->blockBuffer, _link->deltaManifest, manifestLength);
+          _link->blockBuffer[manifestLength] = crc.byte.high;
+          _link->blockBuffer[manifestLength + 1] = crc.byte.low;
+          _link->sendingManifest = true;
+        }
+        return false;
+      case kFail:
+        _link->deltaAccepted = false;
+        _link->queryMessage[0] = '\0';
+        return true;
+      default:
+        return false;
+    }
   }
-#if USE_ACK
-  else if (_command == ACK_FLAG) {
-    _dataOutRetries[_address.byte.low] = 0;
+
+  switch (lumen_update_query_bytes(_link->blockBuffer, manifestLength + kProjectUpdateCrcLength)) {
+    case kOk:
+      _link->deltaAccepted = true;
+      break;
+    case kFail:
+      _link->deltaAccepted = false;
+      break;
+    default:
+      return false;
   }
-#endif
+
+  _link->sendingManifest = false;
+  _link->queryMessage[0] = '\0';
+  return true;
 }
+#endif
 
-uint32_t lumen_available() {
+#if USE_PROJECT_UPDATE_COMPRESSION
+/************************************************************
+ *
+ * Packed blocks are LZSS-compressed, one block at a time,
+ * so the display decodes each block on its own with no state
+ * kept between blocks.
+ *
+ * A flag byte precedes every 8 items, least significant bit
+ * first: 1 is a literal byte, 0 is a 2 bytes back-reference.
+ * Back-reference: offset - 1 in the low byte and in bits 7-6
+ * of the high byte (1 to 1024), length - 3 in bits 5-0 of the
+ * high byte (3 to 66). Back-references may overlap their output.
+ *
+ * Packet: [length high][length low][packed bytes][crc high][crc low],
+ * with the CRC over the length and the packed bytes.
+ *
+ ************************************************************/
+
+#define kPackMinMatch 3
+#define kPackMaxMatch 66
+#define kPackMaxOffset 1024
+#define kPackMaxChain 16
+#define kPackHashSize 256
+
+static uint16_t _packHead[kPackHashSize];
+static uint16_t _packPrevious[kPackMaxBlockLength];
+
+static uint8_t lumen_update_pack_hash(const uint8_t *data) {
+  return (uint8_t)((data[0] << 4) ^ (data[1] << 2) ^ data[2]);
+}
 
-#if USE_PROJECT_UPDATE
-  if (g_is_updating)
-    return 0;
-#endif
+static void lumen_update_pack_insert(const uint8_t *data, uint32_t position, uint32_t length) {
+  if (position + kPackMinMatch <= length) {
+    uint8_t hash = lumen_update_pack_hash(&data[position]);
+    _packPrevious[position] = _packHead[hash];
+    _packHead[hash] = (uint16_t)(position + 1);
+  }
+}
 
-  static bool _started;
-  static bool _escaped;
-#if USE_CRC
-  static bool _crcStarted;
-  static uint16_t _crcIndex;
-  static uint16_t _crcIndexDelayed;
-  static uint16_t _crcData[3];
-#endif
+// Returns the packed length, or 0 when the block does not fit in outSize bytes.
+static uint32_t lumen_update_pack(const uint8_t *data, uint32_t length, uint8_t *out, uint32_t outSize) {
+  uint32_t outIndex = 0;
+  uint32_t flagIndex = 0;
+  uint32_t flagBit = 8;
+  uint32_t position = 0;
 
-  receivedData = lumen_get_byte();
+  memset(_packHead, 0, sizeof(_packHead));
 
-  while (receivedData != DATA_NULL) {
-    if (receivedData == START_FLAG) {
+  while (position < length) {
+    uint32_t bestLength = 0;
+    uint32_t bestOffset = 0;
 
-#if USE_CRC
-      _crc.value = 0xFFFF;
-      _crcIndex = 0;
-      _crcStarted = false;
-      _crcIndexDelayed = 0;
-#endif
-      _started = true;
-      _escaped = false;
-      _dataIndex = 0;
-      _payloadIndex = kCommand;
+    if (flagBit == 8) {
+      if (outIndex >= outSize) {
+        return 0;
+      }
+      flagIndex = outIndex;
+      out[flagIndex] = 0;
+      ++outIndex;
+      flagBit = 0;
+    }
 
-    } else if (receivedData == END_FLAG) {
+    if (position + kPackMinMatch <= length) {
+      uint32_t maxLength = (length - position < kPackMaxMatch) ? length - position : kPackMaxMatch;
+      uint16_t candidate = _packHead[lumen_update_pack_hash(&data[position])];
 
-#if USE_CRC
-      _crc.value = 0xFFFF;
-      uint16_t _dataIndexOffseted = _dataIndex - 2;
+      for (uint32_t chain = 0; (candidate != 0) && (chain < kPackMaxChain); ++chain) {
+        uint32_t candidatePosition = candidate - 1;
+        uint32_t matchLength = 0;
 
-      for (uint16_t pos = 0; pos < _dataIndexOffseted; ++pos) {
-        calculate_crc(_dataIn[pos]);
+        if (position - candidatePosition > kPackMaxOffset) {
+          break;
+        }
+        while ((matchLength < maxLength) && (data[candidatePosition + matchLength] == data[position + matchLength])) {
+          ++matchLength;
+        }
+        if (matchLength > bestLength) {
+          bestLength = matchLength;
+          bestOffset = position - candidatePosition;
+          if (matchLength == maxLength) {
+            break;
+          }
+        }
+        candidate = _packPrevious[candidatePosition];
       }
+    }
 
-      if ((_dataIn[_dataIndex - 2] == (_crc.byte.high)) && (_dataIn[_dataIndex - 1] == (_crc.byte.low))) {
-        _dataIndex = _dataIndexOffseted;
-        Pack();
+    if (bestLength >= kPackMinMatch) {
+      if (outIndex + 2 > outSize) {
+        return 0;
       }
-      _crcStarted = false;
-#else
-      Pack();
+      out[outIndex] = (uint8_t)((bestOffset - 1) & 0xFF);
+      out[outIndex + 1] = (uint8_t)((((bestOffset - 1) >> 8) << 6) | (bestLength - kPackMinMatch));
+      outIndex += 2;
 
-#endif
-      _started = false;
-      _payloadIndex = kPayloadNull;
-    } else if (_started) {
-      if (_escaped) {
-        receivedData ^= XOR_FLAG;
-        _escaped = false;
-        ParsePayload();
-      } else if (receivedData == ESCAPE_FLAG) {
-        _escaped = true;
-      } else {
-        ParsePayload();
+      for (uint32_t i = 0; i < bestLength; ++i) {
+        lumen_update_pack_insert(data, position + i, length);
+      }
+      position += bestLength;
+    } else {
+      if (outIndex + 1 > outSize) {
+        return 0;
       }
+      out[flagIndex] |= (uint8_t)(1 << flagBit);
+      out[outIndex] = data[position];
+      ++outIndex;
+
+      lumen_update_pack_insert(data, position, length);
+      ++position;
     }
-    receivedData = lumen_get_byte();
+    ++flagBit;
   }
-  return quantityOfPacketsAvailable;
+  return outIndex;
 }
 
-lumen_packet_t *lumen_get_first_packet() {
+// Packs the current block into _link->packedBlock. Returns false when packing would not save bytes,
+// in which case the block is sent as is.
+static bool lumen_update_pack_block() {
+  uint32_t packedLength;
+  u16_union_t crc;
 
-#if USE_PROJECT_UPDATE
-  if (g_is_updating)
-    return NULL;
-#endif
+  if (!_link->compressionAccepted || (_link->blockLength > kPackMaxBlockLength)) {
+    return false;
+  }
 
-  for (uint8_t i = 0; i < QUANTITY_OF_PACKETS; ++i) {
-    if (occupiedSlots[i]) {
-      occupiedSlots[i] = false;
-      --quantityOfPacketsAvailable;
-      return &packets[i];
-    }
+  packedLength = lumen_update_pack(_link->sender.block, _link->blockLength, &_link->packedBlock[kPackedHeaderLength], _link->blockLength - kPackedHeaderLength - 1);
+  if (packedLength == 0) {
+    return false;
   }
-  return NULL;
-}
 
-bool lumen_request(lumen_packet_t *packet) {
+  _link->packedBlock[0] = (uint8_t)(packedLength >> 8);
+  _link->packedBlock[1] = (uint8_t)(packedLength & 0xFF);
+  crc = lumen_project_update_calculate_crc(_link->packedBlock, kPackedHeaderLength + packedLength);
+  _link->packedBlock[kPackedHeaderLength + packedLength] = crc.byte.high;
+  _link->packedBlock[kPackedHeaderLength + packedLength + 1] = crc.byte.low;
+  _link->packedBlockLength = kPackedHeaderLength + packedLength + kProjectUpdateCrcLength;
+  return true;
+}
 
-#if USE_PROJECT_UPDATE
-  if (g_is_updating)
-    return false;
+static bool lumen_update_negotiate_compression() {
+  switch (lumen_update_query(kCommandCompression)) {
+    case kOk:
+      _link->compressionAccepted = true;
+      return true;
+    case kFail:
+      _link->compressionAccepted = false;
+      return true;
+    default:
+      return false;
+  }
+}
 #endif
 
-  static uint32_t outDataIndex;
-  readingPacket = packet;
-  outDataIndex = 0;
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+static bool lumen_update_negotiate_multiplexing() {
+  if (_link != &_primaryLink) {
+    // Fleet links carry no variable traffic.
+    return true;
+  }
 
-  _dataOut[0][outDataIndex] = START_FLAG;
-  ++outDataIndex;
+  switch (lumen_update_query(kCommandMultiplex)) {
+    case kOk:
+      _updateMultiplexed = true;
+      return true;
+    case kFail:
+      _updateMultiplexed = false;
+      return true;
+    default:
+      return false;
+  }
+}
 
-  _dataOut[0][outDataIndex] = READ_FLAG;
-#if USE_CRC
-  _crc.value = 0xFFFF;
-  calculate_crc(_dataOut[0][outDataIndex]);
+bool lumen_project_and_firmware_update_is_multiplexed() {
+  return _updateMultiplexed;
+}
 #endif
-  ++outDataIndex;
 
-  writeTempData = readingPacket->address & 0xFF;
-#if USE_CRC
-  calculate_crc(writeTempData);
+static void lumen_update_write_block() {
+  LUMEN_TRACE2(update_block_sent, _link->sender.acknowledgedBlocks, _link->blockLength);
+
+#if USE_PROJECT_UPDATE_COMPRESSION
+  if (_link->sender.packed) {
+    lumen_update_write_bytes(_link->packedBlock, _link->packedBlockLength);
+    return;
+  }
 #endif
-  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
-    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[0][outDataIndex] = writeTempData ^ XOR_FLAG;
+  if (_link->sender.block == _link->blockBuffer) {
+    lumen_update_write_bytes(_link->blockBuffer, _link->blockLength + kProjectUpdateCrcLength);
   } else {
-    _dataOut[0][outDataIndex] = writeTempData;
+    lumen_update_write_bytes(_link->sender.block, _link->blockLength);
+    lumen_update_write_bytes(_link->sender.crcTrailer, kProjectUpdateCrcLength);
   }
-  ++outDataIndex;
+}
 
-  writeTempData = readingPacket->address >> 8;
-#if USE_CRC
-  calculate_crc(writeTempData);
-#endif
-  if (writeTempData == START_FLAG || writeTempData == END_FLAG || writeTempData == ESCAPE_FLAG) {
-    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[0][outDataIndex] = writeTempData ^ XOR_FLAG;
-  } else {
-    _dataOut[0][outDataIndex] = writeTempData;
+#if USE_PROJECT_UPDATE_RESUME
+static lumen_update_resume_point_t _resumePoint;
+static lumen_update_resume_callback_t _onResumePointChanged = NULL;
+
+void lumen_project_and_firmware_update_resume_from(const lumen_update_resume_point_t *resume_point) {
+  _link->resumeCandidateBlocks = resume_point->acknowledged_blocks;
+  _link->resumeCandidateBlockLength = resume_point->block_length;
+  _link->resumeCandidateHash = resume_point->image_hash;
+}
+
+void lumen_project_and_firmware_update_set_resume_callback(lumen_update_resume_callback_t callback) {
+  _onResumePointChanged = callback;
+}
+
+// Asks the display to continue after the blocks acknowledged in a previous, interrupted transfer.
+// The display answers with the quantity of blocks it still holds, which may be fewer (it lost power
+// before storing them) or more (their OK never arrived): both continue after the smaller count.
+// A display that only answers "RECEIVED OK A" continues after the host's count.
+// Restarts from block 0 when there is nothing to resume, the block length changed, the blocks
+// to resume are not at the start of data or differ from the ones hashed, or the display refuses.
+static bool lumen_update_negotiate_resume(const uint8_t *data, uint32_t length) {
+  uint32_t resumedBlocks;
+  bool resumable = (_link->resumeCandidateBlocks > 0) && (_link->resumeCandidateBlockLength == _link->blockLength);
+
+  if (resumable && (_link->queryMessage[0] == '\0')) {
+    uint32_t resumedLength = _link->resumeCandidateBlocks * _link->blockLength;
+
+    resumable = (data != NULL) && (resumedLength / _link->blockLength == _link->resumeCandidateBlocks) && (resumedLength <= length)
+                && (lumen_project_and_firmware_update_image_hash(data, resumedLength, LUMEN_IMAGE_HASH_SEED) == _link->resumeCandidateHash);
+  }
+  if (!resumable) {
+    _link->sender.acknowledgedBlocks = 0;
+    _link->sender.skipLength = 0;
+    _link->resumeCandidateBlocks = 0;
+    return true;
   }
-  ++outDataIndex;
 
-  _dataOut[0][outDataIndex] = 1;
-#if USE_CRC
-  calculate_crc(_dataOut[0][outDataIndex]);
-#endif
-  ++outDataIndex;
+  if (_link->queryMessage[0] == '\0') {
+    uint32_t messageLength = sizeof(kCommandResumeBlock) - 1;
+    memcpy(_link->queryMessage, kCommandResumeBlock, messageLength);
+    messageLength += lumen_update_format_u32(&_link->queryMessage[messageLength], _link->resumeCandidateBlocks);
+    memcpy(&_link->queryMessage[messageLength], " A", sizeof(" A"));
+  }
 
-#if USE_CRC
+  switch (lumen_update_query(_link->queryMessage)) {
+    case kOk:
+      resumedBlocks = _link->resumeCandidateBlocks;
+      break;
+    case kReceivedBlocks:
+      resumedBlocks = (_link->receivedBlocks < _link->resumeCandidateBlocks) ? _link->receivedBlocks : _link->resumeCandidateBlocks;
+      break;
+    case kFail:
+      resumedBlocks = 0;
+      break;
+    default:
+      return false;
+  }
+  _link->sender.acknowledgedBlocks = resumedBlocks;
+  _link->sender.skipLength = resumedBlocks * _link->blockLength;
 
-  if ((_crc.byte.high == (uint8_t)START_FLAG) || (_crc.byte.high == (uint8_t)END_FLAG)
-      || (_crc.byte.high == (uint8_t)ESCAPE_FLAG)) {
-    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[0][outDataIndex] = _crc.byte.high ^ XOR_FLAG;
-    ++outDataIndex;
-  } else {
-    _dataOut[0][outDataIndex] = _crc.byte.high;
-    ++outDataIndex;
+  _link->queryMessage[0] = '\0';
+  _link->resumeCandidateBlocks = 0;
+  return true;
+}
+
+#if USE_PROJECT_UPDATE_FROM_FILE
+#define kResumeFileSuffix ".resume"
+#define kResumeFileMagic 0x4C554D31UL
+
+static int _resumeFileDescriptor = -1;
+static char *_resumeFilePath = NULL;
+
+// The state file next to the image holds { magic, image_hash, block_length, acknowledged_blocks }.
+// The hash covers the acknowledged blocks only: the resume is refused if the file changed among them.
+static void lumen_update_open_resume_file(const char *path) {
+  uint32_t state[4];
+  lumen_update_resume_point_t resumePoint;
+
+  _resumeFilePath = (char *)malloc(strlen(path) + sizeof(kResumeFileSuffix));
+  if (_resumeFilePath == NULL) {
+    return;
+  }
+  strcpy(_resumeFilePath, path);
+  strcat(_resumeFilePath, kResumeFileSuffix);
+
+  resumePoint.image_hash = LUMEN_IMAGE_HASH_SEED;
+  resumePoint.block_length = 0;
+  resumePoint.acknowledged_blocks = 0;
+
+  _resumeFileDescriptor = open(_resumeFilePath, O_RDWR | O_CREAT, 0644);
+  if (_resumeFileDescriptor >= 0) {
+    if ((pread(_resumeFileDescriptor, state, sizeof(state), 0) == (ssize_t)sizeof(state))
+        && (state[0] == kResumeFileMagic)) {
+      resumePoint.image_hash = state[1];
+      resumePoint.block_length = state[2];
+      resumePoint.acknowledged_blocks = state[3];
+    }
   }
 
-  if ((_crc.byte.low == (uint8_t)START_FLAG) || (_crc.byte.low == (uint8_t)END_FLAG)
-      || (_crc.byte.low == (uint8_t)ESCAPE_FLAG)) {
-    _dataOut[0][outDataIndex] = ESCAPE_FLAG;
-    ++outDataIndex;
-    _dataOut[0][outDataIndex] = _crc.byte.low ^ XOR_FLAG;
-    ++outDataIndex;
-  } else {
-    _dataOut[0][outDataIndex] = _crc.byte.low;
-    ++outDataIndex;
+  lumen_project_and_firmware_update_resume_from(&resumePoint);
+}
+
+static void lumen_update_write_resume_file() {
+  uint32_t state[4] = { kResumeFileMagic, _resumePoint.image_hash, _resumePoint.block_length, _resumePoint.acknowledged_blocks };
+
+  if (_resumeFileDescriptor >= 0) {
+    if (pwrite(_resumeFileDescriptor, state, sizeof(state), 0) != (ssize_t)sizeof(state)) {
+      close(_resumeFileDescriptor);
+      _resumeFileDescriptor = -1;
+    }
   }
+}
 
+static void lumen_update_close_resume_file(bool completed) {
+  if (_resumeFileDescriptor >= 0) {
+    close(_resumeFileDescriptor);
+    _resumeFileDescriptor = -1;
+  }
+  if (_resumeFilePath != NULL) {
+    if (completed) {
+      unlink(_resumeFilePath);
+    }
+    free(_resumeFilePath);
+    _resumeFilePath = NULL;
+  }
+}
 #endif
 
-  _dataOut[0][outDataIndex] = END_FLAG;
-  ++outDataIndex;
+static void lumen_update_block_acknowledged() {
+  if (_link != &_primaryLink) {
+    return;
+  }
+  _resumePoint.block_length = _link->blockLength;
+  _resumePoint.acknowledged_blocks = _link->sender.acknowledgedBlocks;
+#if USE_PROJECT_UPDATE_FROM_FILE
+  lumen_update_write_resume_file();
+#endif
+  if (_onResumePointChanged != NULL) {
+    _onResumePointChanged(&_resumePoint);
+  }
+}
+#endif
 
-  lumen_write_bytes(_dataOut[0], outDataIndex);
+#if USE_PROJECT_UPDATE_PROGRESS
+static lumen_update_progress_callback_t _onProgress = NULL;
 
-  return true;
+void lumen_project_and_firmware_update_set_progress_callback(lumen_update_progress_callback_t callback) {
+  _onProgress = callback;
 }
 
-bool lumen_read(lumen_packet_t *packet) {
+static void lumen_update_read_progress(const lumen_update_link_t *link, lumen_update_progress_t *progress) {
+  uint32_t elapsedTimeInMs = link->progress.transmitting_time_in_ms + link->progress.waiting_time_in_ms;
 
-#if USE_PROJECT_UPDATE
-  if (g_is_updating)
-    return false;
+  *progress = link->progress;
+#if USE_PROJECT_UPDATE_FLEET
+  progress->link = (link == &_primaryLink) ? LUMEN_UPDATE_PRIMARY_LINK : (uint8_t)(link - _fleetLinks);
+#else
+  progress->link = LUMEN_UPDATE_PRIMARY_LINK;
 #endif
+  progress->acknowledged_blocks = link->sender.acknowledgedBlocks;
+  progress->retried_blocks = link->sender.retries;
+  progress->bytes_per_second = (elapsedTimeInMs > 0) ? (uint32_t)((uint64_t)progress->acknowledged_bytes * 1000 / elapsedTimeInMs) : 0;
+}
 
-  reading = true;
+static void lumen_update_progress_event() {
+  if (_onProgress != NULL) {
+    lumen_update_progress_t progress;
 
-  if (!lumen_request(packet)) {
-    return false;
+    lumen_update_read_progress(_link, &progress);
+    _onProgress(&progress);
   }
+}
 
-  uint32_t elapsedTickTimeOut = 0;
+// Ticked time counts as waiting while a block command or a block awaits the display's answer,
+// and as transmitting otherwise, from the moment the display accepts the update.
+static void lumen_update_count_time(lumen_update_link_t *link, uint32_t time_in_ms) {
+  if (!link->isStarted) {
+    return;
+  }
+  if (link->sender.sending && (link->sender.sendStep != kSendNewBlockCmd)) {
+    link->progress.waiting_time_in_ms += time_in_ms;
+  } else {
+    link->progress.transmitting_time_in_ms += time_in_ms;
+  }
+}
 
-  while (reading == true) {
-    lumen_available();
+void lumen_project_and_firmware_update_progress(lumen_update_progress_t *progress) {
+  lumen_update_read_progress(&_primaryLink, progress);
+}
+#endif
 
-    ++elapsedTickTimeOut;
+#if USE_PROJECT_UPDATE_FROM_FILE
+static uint8_t *_fileData = NULL;
+static uint32_t _fileLength = 0;
+static int _fileDescriptor = -1;
+static int _fileError = 0;
+static uint16_t *_fileBlockCrcs = NULL;
+static uint32_t _fileBlockCrcsBlockLength = 0;
+#if USE_PROJECT_UPDATE_FLEET
+// The library's own link and the fleet never send from each other's mapped file.
+static bool _fileMappedForFleet = false;
+#endif
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+// Tells the mapped file from another one without reading it: a file written again gets
+// a new modification time, and one replaced by a rename a new inode.
+typedef struct {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+} lumen_update_file_key_t;
+
+static lumen_update_file_key_t _fileKey;
+static lumen_update_file_key_t _fileBlockCrcsKey;
+// Set when the file was modified shortly before its CRCs were computed. A write in the
+// same timestamp tick would leave the key unchanged, so these CRCs are not reused.
+static bool _fileBlockCrcsRacy = false;
+static bool _fileBlockCrcsInUse = false;
+
+// CRC-16 (polynomial 0xA001, reflected), one entry per byte value.
+static const uint16_t _crcTable[256] = {
+  0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+  0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+  0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+  0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+  0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+  0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+  0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+  0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+  0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+  0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+  0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+  0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+  0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+  0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+  0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+  0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+  0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+  0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+  0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+  0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+  0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+  0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+  0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+  0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+  0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+  0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+  0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+  0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+  0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+  0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+  0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+  0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
 
-    if (elapsedTickTimeOut >= TICK_TIME_OUT) {
-      return false;
+typedef struct {
+  pthread_t thread;
+  uint32_t firstSlice;
+  uint32_t quantityOfSlices;
+  uint32_t sliceLength;
+} lumen_update_crc_worker_t;
+
+static bool lumen_update_same_file(const lumen_update_file_key_t *a, const lumen_update_file_key_t *b) {
+  return (a->device == b->device) && (a->inode == b->inode) && (a->size == b->size)
+         && (a->modified.tv_sec == b->modified.tv_sec) && (a->modified.tv_nsec == b->modified.tv_nsec);
+}
+
+static void *lumen_update_crc_worker(void *argument) {
+  lumen_update_crc_worker_t *worker = (lumen_update_crc_worker_t *)argument;
+
+  for (uint32_t block = worker->firstSlice; block < worker->firstSlice + worker->quantityOfSlices; ++block) {
+    const uint8_t *data = &_fileData[block * worker->sliceLength];
+    uint16_t crc = 0xFFFF;
+
+    for (uint32_t i = 0; i < worker->sliceLength; ++i) {
+      crc = (crc >> 8) ^ _crcTable[(crc ^ data[i]) & 0xFF];
     }
+    _fileBlockCrcs[block] = crc;
   }
-  return true;
+  return NULL;
 }
 
-#if USE_PROJECT_UPDATE
+// Splits quantityOfSlices slices of the mapped file between the workers.
+// A worker whose thread cannot be started runs on the calling thread instead.
+static void lumen_update_run_crc_workers(lumen_update_crc_worker_t *workers, void *(*work)(void *), uint32_t quantityOfSlices, uint32_t sliceLength) {
+  bool started[PROJECT_UPDATE_CRC_THREADS];
+
+  for (uint32_t i = 0; i < PROJECT_UPDATE_CRC_THREADS; ++i) {
+    workers[i].firstSlice = (uint32_t)((uint64_t)quantityOfSlices * i / PROJECT_UPDATE_CRC_THREADS);
+    workers[i].quantityOfSlices = (uint32_t)((uint64_t)quantityOfSlices * (i + 1) / PROJECT_UPDATE_CRC_THREADS) - workers[i].firstSlice;
+    workers[i].sliceLength = sliceLength;
+    started[i] = (workers[i].quantityOfSlices > 0) && (pthread_create(&workers[i].thread, NULL, work, &workers[i]) == 0);
+  }
 
-#define MESSAGE(x) lumen_write_bytes((uint8_t *)x, (uint32_t)strlen(x))
+  for (uint32_t i = 0; i < PROJECT_UPDATE_CRC_THREADS; ++i) {
+    if (started[i]) {
+      pthread_join(workers[i].thread, NULL);
+    } else if (workers[i].quantityOfSlices > 0) {
+      work(&workers[i]);
+    }
+  }
+}
+#endif
 
-#define kUpdateProject "UPDATE PROJECT A"
-#define kUpdateFirmware "UPDATE FIRMWARE A"
-#define kCommandFinished "FINISHED A"
-#define kCommandFinishedAndReset "FINISHED RESET A"
-#define kCommandNewDataBlock "NEW BLOCK A"
-#define kOKMessage "RECEIVED OK A"
-#define kNotOKMessage "RECEIVED NOT OK A"
+static bool lumen_update_map_file(const char *path) {
+  struct stat fileStat;
 
-#define kStartInterval 5
-#define kSendBlockInterval 1000
+  _fileDescriptor = open(path, O_RDONLY);
+  if (_fileDescriptor < 0) {
+    _fileError = errno;
+    return false;
+  }
 
-#define kProjectUpdateBlockLength 1024
-#define kProjectUpdateCrcLength 2
-#define kProjectUpdateCrcIndexHighByte kProjectUpdateBlockLength
-#define kProjectUpdateCrcIndexLowByte kProjectUpdateBlockLength + 1
+  if (fstat(_fileDescriptor, &fileStat) != 0) {
+    _fileError = errno;
+    close(_fileDescriptor);
+    _fileDescriptor = -1;
+    return false;
+  }
+  if ((fileStat.st_size <= 0) || ((uint64_t)fileStat.st_size > UINT32_MAX)) {
+    _fileError = (fileStat.st_size <= 0) ? ENODATA : EFBIG;
+    close(_fileDescriptor);
+    _fileDescriptor = -1;
+    return false;
+  }
 
-typedef enum send_step {
-  kSendNewBlockCmd,
-  kWaitingForOkMessageOfNewBlockCmd,
-  kWaitingForOkMessageOfBlock,
-} lumen_project_update_send_step_t;
+  void *mapping = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, _fileDescriptor, 0);
+  if (mapping == MAP_FAILED) {
+    _fileError = errno;
+    close(_fileDescriptor);
+    _fileDescriptor = -1;
+    return false;
+  }
+
+  madvise(mapping, (size_t)fileStat.st_size, MADV_SEQUENTIAL);
+  madvise(mapping, (size_t)fileStat.st_size, MADV_WILLNEED);
+
+  _fileData = (uint8_t *)mapping;
+  _fileLength = (uint32_t)fileStat.st_size;
+  _fileError = 0;
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+  _fileKey.device = fileStat.st_dev;
+  _fileKey.inode = fileStat.st_ino;
+  _fileKey.size = fileStat.st_size;
+  _fileKey.modified = fileStat.st_mtim;
+#endif
+  return true;
+}
 
-typedef struct {
-  const char *word;
-  uint32_t length;
-  uint32_t index;
-} lumen_project_update_word_packet_t;
+int lumen_project_and_firmware_update_file_error() {
+  return _fileError;
+}
 
-lumen_project_update_word_packet_t okMessageWordComparator = { .word = kOKMessage, .length = sizeof(kOKMessage) - 1, .index = 0 };
-lumen_project_update_word_packet_t notOkMessageWordComparator = { .word = kNotOKMessage, .length = sizeof(kNotOKMessage) - 1, .index = 0 };
+// A transfer keeps its file mapped until it finishes. Meanwhile another path, or the
+// file of the other kind of transfer, is refused with EBUSY.
+static bool lumen_update_is_mapped_file(const char *path, bool forFleet) {
+  struct stat pathStat;
+  struct stat fileStat;
 
-uint32_t elapsedTimeInMs = 0;
-bool isStarted = false;
+#if USE_PROJECT_UPDATE_FLEET
+  if (forFleet != _fileMappedForFleet) {
+    _fileError = EBUSY;
+    return false;
+  }
+#else
+  (void)forFleet;
+#endif
+  if ((stat(path, &pathStat) != 0) || (fstat(_fileDescriptor, &fileStat) != 0) || (pathStat.st_dev != fileStat.st_dev)
+      || (pathStat.st_ino != fileStat.st_ino)) {
+    _fileError = EBUSY;
+    return false;
+  }
+  _fileError = 0;
+  return true;
+}
 
-static bool lumen_project_update_word_checker(lumen_project_update_word_packet_t *word_packet, char character) {
-  if (word_packet->word[word_packet->index] == character) {
-    ++word_packet->index;
-    if (word_packet->length == word_packet->index) {
-      word_packet->index = 0;
-      return true;
-    }
-  } else {
-    word_packet->index = 0;
-    if (word_packet->word[word_packet->index] == character) {
-      ++word_packet->index;
-    }
+static void lumen_update_unmap_file() {
+  if (_fileData != NULL) {
+    munmap(_fileData, _fileLength);
+    _fileData = NULL;
+    _fileLength = 0;
   }
-  return false;
+  if (_fileDescriptor >= 0) {
+    close(_fileDescriptor);
+    _fileDescriptor = -1;
+  }
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+  // The CRCs stay cached for the next time this image is sent.
+  _fileBlockCrcsInUse = false;
+#else
+  free(_fileBlockCrcs);
+  _fileBlockCrcs = NULL;
+  _fileBlockCrcsBlockLength = 0;
+#endif
 }
 
-static u16_union_t lumen_project_update_calculate_crc(uint8_t *data, uint32_t length) {
+// Looks up the CRC of a block staged straight from the mapped file.
+// All full blocks of the file are computed at once, ahead of the first transmission,
+// so the transmitter only waits on the display from then on.
+static bool lumen_update_file_block_crc(const uint8_t *blockSource, u16_union_t *crc) {
+  if ((_fileData == NULL) || (blockSource < _fileData) || (blockSource >= _fileData + _fileLength)) {
+    return false;
+  }
 
-  static u16_union_t crc;
-  static uint32_t pos;
-  static uint32_t i;
-  static uint32_t z = 0;
-  static uint32_t u = 0x0001;
-  static uint32_t o = 8;
-  static uint32_t p = 0xA001;
+  uint32_t offset = (uint32_t)(blockSource - _fileData);
+  if ((offset % _link->blockLength) || (offset + _link->blockLength > _fileLength)) {
+    return false;
+  }
 
-  crc.value = 0xFFFF;
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+  if ((_fileBlockCrcs != NULL) && !_fileBlockCrcsInUse
+      && (_fileBlockCrcsRacy || !lumen_update_same_file(&_fileBlockCrcsKey, &_fileKey)
+          || (_fileBlockCrcsBlockLength != _link->blockLength))) {
+    // Cached for another file, another version of it or another block length.
+    free(_fileBlockCrcs);
+    _fileBlockCrcs = NULL;
+  }
+#endif
 
-  for (pos = z; pos < length; pos++) {
-    crc.value ^= (uint16_t)*data;
-    ++data;
+  if ((_fileBlockCrcs != NULL) && (_fileBlockCrcsBlockLength != _link->blockLength)) {
+    // Built for the block length of another fleet link: compute this one inline.
+    return false;
+  }
 
-    for (i = o; z != i; --i) {
-      if (z != (u & crc.value)) {
-        crc.value >>= u;
-        crc.value ^= p;
-      } else {
-        crc.value >>= u;
-      }
+  if (_fileBlockCrcs == NULL) {
+    uint32_t quantityOfBlocks = _fileLength / _link->blockLength;
+
+    _fileBlockCrcs = (uint16_t *)malloc(quantityOfBlocks * sizeof(uint16_t));
+    if (_fileBlockCrcs == NULL) {
+      return false;
+    }
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+    lumen_update_crc_worker_t workers[PROJECT_UPDATE_CRC_THREADS];
+    struct timespec now;
+
+    lumen_update_run_crc_workers(workers, lumen_update_crc_worker, quantityOfBlocks, _link->blockLength);
+    clock_gettime(CLOCK_REALTIME, &now);
+    _fileBlockCrcsKey = _fileKey;
+    _fileBlockCrcsRacy = (now.tv_sec - _fileKey.modified.tv_sec) < 2;
+#else
+    for (uint32_t block = 0; block < quantityOfBlocks; ++block) {
+      _fileBlockCrcs[block] = lumen_project_update_calculate_crc(&_fileData[block * _link->blockLength], _link->blockLength).value;
     }
+#endif
+    _fileBlockCrcsBlockLength = _link->blockLength;
   }
-  return crc;
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+  _fileBlockCrcsInUse = true;
+#endif
+
+  crc->value = _fileBlockCrcs[offset / _link->blockLength];
+  return true;
 }
+#endif
 
-static uint32_t restart_interval = 0;
-static bool sendFinishMessage = true;
+#if USE_PROJECT_UPDATE_RESUME || USE_PROJECT_UPDATE_DELTA
+// Folds bytes the display now holds, in image order, into the hash of the resume point
+// and, after a delta manifest, into the CRC of the image sent with the finish command.
+static void lumen_update_fold_acknowledged(const uint8_t *data, uint32_t length) {
+  if (data == NULL) {
+    return;
+  }
+#if USE_PROJECT_UPDATE_RESUME
+  if (_link == &_primaryLink) {
+    _resumePoint.image_hash = lumen_project_and_firmware_update_image_hash(data, length, _resumePoint.image_hash);
+  }
+#endif
+#if USE_PROJECT_UPDATE_DELTA
+  if (_link->deltaAccepted) {
+    _link->imageCrc = lumen_update_image_crc(data, length, _link->imageCrc);
+  }
+#endif
+}
+#endif
 
-static bool lumen_update_start(const char *msg) {
+static bool sendFinishMessage = true;
 
-  static bool lumenUpdateResetPending = true;
+static bool lumen_update_start(const char *msg, const uint8_t *data, uint32_t length) {
+#if !USE_PROJECT_UPDATE_RESUME
+  // Only the resume negotiation checks the image.
+  (void)data;
+  (void)length;
+#endif
 
-  if (isStarted) {
+  if (_link->isStarted) {
+    if (!_link->blockLengthNegotiated) {
+      _link->blockLengthNegotiated = lumen_update_negotiate_block_length();
+      if (!_link->blockLengthNegotiated) {
+        return false;
+      }
+    }
+#if USE_PROJECT_UPDATE_RESUME
+    if (!_link->resumeNegotiated) {
+      _link->resumeNegotiated = lumen_update_negotiate_resume(data, length);
+      if (!_link->resumeNegotiated) {
+        return false;
+      }
+    }
+#endif
+#if USE_PROJECT_UPDATE_DELTA
+    if (!_link->deltaNegotiated) {
+      _link->deltaNegotiated = lumen_update_negotiate_delta();
+      if (!_link->deltaNegotiated) {
+        return false;
+      }
+    }
+#endif
+#if USE_PROJECT_UPDATE_COMPRESSION
+    if (!_link->compressionNegotiated) {
+      _link->compressionNegotiated = lumen_update_negotiate_compression();
+      if (!_link->compressionNegotiated) {
+        return false;
+      }
+    }
+#endif
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+    if (!_link->multiplexNegotiated) {
+      _link->multiplexNegotiated = lumen_update_negotiate_multiplexing();
+      if (!_link->multiplexNegotiated) {
+        return false;
+      }
+    }
+#endif
     return true;
   }
 
-  static uint32_t startInterval = kStartInterval;
-  receivedData = lumen_get_byte();
+  receivedData = lumen_update_read_byte();
 
-  if (lumenUpdateResetPending) {
-    if (elapsedTimeInMs >= restart_interval) {
+  if (_link->resetPending) {
+    if (lumen_timer_expired(&_link->restartInterval, lumen_update_now())) {
       while (receivedData != DATA_NULL) {
-        receivedData = lumen_get_byte();
+        receivedData = lumen_update_read_byte();
       }
       sendFinishMessage = true;
-      lumenUpdateResetPending = false;
-      startInterval = elapsedTimeInMs + kStartInterval;
+      _link->resetPending = false;
+      lumen_timer_arm(&_link->startInterval, lumen_update_now(), kStartInterval);
     } else {
       return false;
     }
   }
 
   while (receivedData != DATA_NULL) {
-    if (lumen_project_update_word_checker(&okMessageWordComparator, (char)receivedData)) {
-      lumenUpdateResetPending = true;
-      isStarted = true;
+    if (lumen_project_update_match_response((char)receivedData) == kOk) {
+      _link->resetPending = true;
+      _link->isStarted = true;
+      _link->sender.acknowledgedBlocks = 0;
+      _link->sender.skipLength = 0;
+      _link->sender.retries = 0;
+      _link->blockLengthNegotiated = false;
+#if USE_PROJECT_UPDATE_PROGRESS
+      memset(&_link->progress, 0, sizeof(_link->progress));
+#endif
+#if USE_CLOCK
+      _link->lastTickTime = lumen_now_us();
+#endif
+#if USE_PROJECT_UPDATE_RESUME
+      _link->resumeNegotiated = false;
+      if (_link == &_primaryLink) {
+        _resumePoint.image_hash = LUMEN_IMAGE_HASH_SEED;
+      }
+#endif
+#if USE_PROJECT_UPDATE_RESUME && USE_PROJECT_UPDATE_DELTA
+      _link->sender.skippingUnchangedBlock = false;
+#endif
+#if USE_PROJECT_UPDATE_DELTA
+      _link->deltaNegotiated = false;
+      _link->imageCrc = 0;
+#endif
+#if USE_PROJECT_UPDATE_COMPRESSION
+      _link->compressionNegotiated = false;
+#endif
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+      _link->multiplexNegotiated = false;
+      if (_link == &_primaryLink) {
+        _updateMultiplexed = false;
+      }
+#endif
     }
-    receivedData = lumen_get_byte();
+    receivedData = lumen_update_read_byte();
   }
 
-  if (elapsedTimeInMs >= startInterval) {
+  if (lumen_timer_expired(&_link->startInterval, lumen_update_now())) {
     MESSAGE(msg);
-    startInterval = elapsedTimeInMs + kStartInterval;
+    lumen_timer_arm(&_link->startInterval, lumen_update_now(), kStartInterval);
   }
 
   return false;
 }
 
-bool g_finished_last_file_send = false;
-
 bool lumen_update_send_data(uint8_t *data, uint32_t length, const char *msgUpdate) {
   g_is_updating = true;
 
-  if (lumen_update_start(msgUpdate)) {
-    static uint32_t dataIndex = 0;
-    static uint32_t blockBufferLength = 0;
-    static uint8_t blockBuffer[kProjectUpdateBlockLength + kProjectUpdateCrcLength];
-    static u16_union_t crc;
-    static uint32_t sendBlockInterval = 0;
-    static bool sending = false;
-    static uint32_t sendingLength = 0;
-    static uint32_t sendingLengthOfLastBlock = 0;
-    static bool finishedLastSend = true;
+  if (lumen_update_start(msgUpdate, data, length)) {
     static bool res = false;
+    lumen_project_update_response_t response;
 
     res = false;
 
-    if (g_finished_last_file_send == true)
+    if (_link->finishedLastFileSend == true)
     {
-      g_finished_last_file_send = false;
-      dataIndex = 0;
-      blockBufferLength = 0;
-      sendBlockInterval = 0;
-      sending = false;
-      sendingLength = 0;
-      sendingLengthOfLastBlock = 0;
-      finishedLastSend = true;
+      _link->finishedLastFileSend = false;
+      _link->sender.dataIndex = 0;
+      _link->sender.blockBufferLength = 0;
+      lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), 0);
+      _link->sender.sending = false;
+      _link->sender.sendingLength = 0;
+      _link->sender.sendingLengthOfLastBlock = 0;
+      _link->sender.finishedLastSend = true;
       res = false;
     }
 
-    if (finishedLastSend) {
-      finishedLastSend = false;
-      sendingLength = length;
-      dataIndex = 0;
+    if (_link->sender.finishedLastSend) {
+      _link->sender.finishedLastSend = false;
+      _link->sender.sendingLength = length;
+      _link->sender.dataIndex = 0;
     }
 
-    static lumen_project_update_send_step_t sendStep;
-    if (!sending) {
-      if (blockBufferLength < kProjectUpdateBlockLength) {
-        if ((sendingLength + blockBufferLength) < kProjectUpdateBlockLength) {
-          memcpy(&blockBuffer[blockBufferLength], &data[dataIndex], sendingLength);
-          blockBufferLength += sendingLength;
-          sendingLength = 0;
+    if (!_link->sender.sending) {
+      while (true) {
+        if (_link->sender.skipLength > 0) {
+          uint32_t skippedLength = (_link->sender.skipLength < _link->sender.sendingLength) ? _link->sender.skipLength : _link->sender.sendingLength;
+#if USE_PROJECT_UPDATE_RESUME || USE_PROJECT_UPDATE_DELTA
+          lumen_update_fold_acknowledged((data != NULL) ? &data[_link->sender.dataIndex] : NULL, skippedLength);
+#endif
+          _link->sender.dataIndex += skippedLength;
+          _link->sender.sendingLength -= skippedLength;
+          _link->sender.skipLength -= skippedLength;
+        }
+#if USE_PROJECT_UPDATE_RESUME && USE_PROJECT_UPDATE_DELTA
+        // An unchanged block is reported once all of its bytes are hashed, which may take several calls.
+        if ((_link->sender.skipLength == 0) && _link->sender.skippingUnchangedBlock) {
+          _link->sender.skippingUnchangedBlock = false;
+          lumen_update_block_acknowledged();
+        }
+#endif
+#if USE_PROJECT_UPDATE_DELTA
+        // The display already holds unchanged blocks: consume them without sending.
+        if ((_link->sender.skipLength == 0) && (_link->sender.sendingLength > 0) && (_link->sender.blockBufferLength == 0)
+            && lumen_update_delta_block_unchanged(_link->sender.acknowledgedBlocks)) {
+          _link->sender.skipLength = _link->blockLength;
+          ++_link->sender.acknowledgedBlocks;
+#if USE_PROJECT_UPDATE_RESUME
+          _link->sender.skippingUnchangedBlock = true;
+#endif
+          continue;
+        }
+#endif
+        break;
+      }
+
+      if (_link->sender.blockBufferLength < _link->blockLength) {
+        if ((_link->sender.sendingLength + _link->sender.blockBufferLength) < _link->blockLength) {
+          if (data != NULL) {
+            memcpy(&_link->blockBuffer[_link->sender.blockBufferLength], &data[_link->sender.dataIndex], _link->sender.sendingLength);
+          }
+          _link->sender.blockBufferLength += _link->sender.sendingLength;
+          _link->sender.sendingLength = 0;
+        } else if (_link->sender.blockBufferLength == 0) {
+          // The whole block is in the caller's data, which stays valid until this call returns true:
+          // send it from there and only stage the CRC.
+          _link->sender.sendingLengthOfLastBlock = _link->blockLength;
+          _link->sender.block = &data[_link->sender.dataIndex];
+          _link->sender.dataIndex += _link->blockLength;
+          _link->sender.blockBufferLength = _link->blockLength;
         } else {
-          sendingLengthOfLastBlock = kProjectUpdateBlockLength - blockBufferLength;
-          memcpy(&blockBuffer[blockBufferLength], &data[dataIndex], sendingLengthOfLastBlock);
-          dataIndex += sendingLengthOfLastBlock;
-          blockBufferLength = kProjectUpdateBlockLength;
+          _link->sender.sendingLengthOfLastBlock = _link->blockLength - _link->sender.blockBufferLength;
+          _link->sender.block = _link->blockBuffer;
+          if (data == NULL) {
+            // Padding stage: zero the tail of the last block.
+            memset(&_link->blockBuffer[_link->sender.blockBufferLength], 0, _link->sender.sendingLengthOfLastBlock);
+          } else {
+            memcpy(&_link->blockBuffer[_link->sender.blockBufferLength], &data[_link->sender.dataIndex], _link->sender.sendingLengthOfLastBlock);
+          }
+          _link->sender.dataIndex += _link->sender.sendingLengthOfLastBlock;
+          _link->sender.blockBufferLength = _link->blockLength;
         }
       }
 
-      if (blockBufferLength >= kProjectUpdateBlockLength) {
-        crc.value = lumen_project_update_calculate_crc(blockBuffer, kProjectUpdateBlockLength).value;
+      if (_link->sender.blockBufferLength >= _link->blockLength) {
+        bool crcCached = false;
+#if USE_PROJECT_UPDATE_FROM_FILE
+        crcCached = lumen_update_file_block_crc(_link->sender.block, &_link->sender.crc);
+#endif
+        if (!crcCached) {
+          _link->sender.crc.value = lumen_project_update_calculate_crc(_link->sender.block, _link->blockLength).value;
+        }
+
+        _link->sender.crcTrailer[0] = _link->sender.crc.byte.high;
+        _link->sender.crcTrailer[1] = _link->sender.crc.byte.low;
+        if (_link->sender.block == _link->blockBuffer) {
+          _link->blockBuffer[_link->blockLength] = _link->sender.crc.byte.high;
+          _link->blockBuffer[_link->blockLength + 1] = _link->sender.crc.byte.low;
+        }
+#if USE_PROJECT_UPDATE_COMPRESSION
+        _link->sender.packed = lumen_update_pack_block();
+#endif
 
-        blockBuffer[kProjectUpdateCrcIndexHighByte] = crc.byte.high;
-        blockBuffer[kProjectUpdateCrcIndexLowByte] = crc.byte.low;
+        lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), kSendBlockInterval);
 
-        sendBlockInterval = kSendBlockInterval + elapsedTimeInMs;
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+        // Variable frames get their share of the link before each new block.
+        if (_link == &_primaryLink) {
+          lumen_update_multiplex_flush(_link->blockLength * PROJECT_UPDATE_MULTIPLEX_SHARE / 100);
+        }
+#endif
 
-        sendStep = kSendNewBlockCmd;
-        sending = true;
-        blockBufferLength = 0;
+        _link->sender.sendStep = kSendNewBlockCmd;
+        _link->sender.sending = true;
+        _link->sender.blockBufferLength = 0;
       }
     }
-    if (sending) {
-      switch (sendStep) {
-        case kSendNewBlockCmd:
-          {
-            MESSAGE(kCommandNewDataBlock);
-            sendBlockInterval = kSendBlockInterval + elapsedTimeInMs;
-            sendStep = kWaitingForOkMessageOfNewBlockCmd;
-          }
-          break;
+    if (_link->sender.sending) {
+      switch (_link->sender.sendStep) {
         case kWaitingForOkMessageOfNewBlockCmd:
           {
-            receivedData = lumen_get_byte();
+            receivedData = lumen_update_get_byte();
             while (receivedData != DATA_NULL) {
-              if (lumen_project_update_word_checker(&okMessageWordComparator, (char)receivedData)) {
-                lumen_write_bytes(blockBuffer, kProjectUpdateBlockLength + kProjectUpdateCrcLength);
-                sendStep = kWaitingForOkMessageOfBlock;
-                sendBlockInterval = kSendBlockInterval + elapsedTimeInMs;
+              response = lumen_project_update_match_response((char)receivedData);
+              if (response == kOk) {
+#if !USE_PROJECT_UPDATE_PIPELINING
+                lumen_update_write_block();
+#endif
+                _link->sender.sendStep = kWaitingForOkMessageOfBlock;
+                lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), kSendBlockInterval);
                 break;
               }
-              if (lumen_project_update_word_checker(&notOkMessageWordComparator, (char)receivedData)) {
-                sendStep = kSendNewBlockCmd;
-                sendBlockInterval = kSendBlockInterval + elapsedTimeInMs;
+              if (response == kFail) {
+                _link->sender.sendStep = kSendNewBlockCmd;
+                lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), kSendBlockInterval);
+                ++_link->sender.retries;
+                LUMEN_TRACE1(update_block_retry, _link->sender.acknowledgedBlocks);
+#if USE_PROJECT_UPDATE_PROGRESS
+                ++_link->progress.not_ok_count;
+                lumen_update_progress_event();
+#endif
                 break;
               }
-              receivedData = lumen_get_byte();
+              receivedData = lumen_update_get_byte();
             }
           }
           break;
         case kWaitingForOkMessageOfBlock:
           {
-            receivedData = lumen_get_byte();
+            receivedData = lumen_update_get_byte();
             while (receivedData != DATA_NULL) {
-              if (lumen_project_update_word_checker(&okMessageWordComparator, (char)receivedData)) {
-                sending = false;
-                sendBlockInterval = kSendBlockInterval + elapsedTimeInMs;
-                sendingLength -= sendingLengthOfLastBlock;
-                sendingLengthOfLastBlock = 0;
+              response = lumen_project_update_match_response((char)receivedData);
+              if (response == kOk) {
+                _link->sender.sending = false;
+                // The next block is staged by the next call: let the loop make it right away.
+                lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), 0);
+                _link->sender.sendingLength -= _link->sender.sendingLengthOfLastBlock;
+                _link->sender.sendingLengthOfLastBlock = 0;
+                LUMEN_TRACE2(update_block_acked, _link->sender.acknowledgedBlocks, _link->blockLength);
+                ++_link->sender.acknowledgedBlocks;
+#if USE_PROJECT_UPDATE_RESUME || USE_PROJECT_UPDATE_DELTA
+                lumen_update_fold_acknowledged(_link->sender.block, _link->blockLength);
+#endif
+#if USE_PROJECT_UPDATE_RESUME
+                lumen_update_block_acknowledged();
+#endif
+#if USE_PROJECT_UPDATE_PROGRESS
+                _link->progress.acknowledged_bytes += _link->blockLength;
+                lumen_update_progress_event();
+#endif
                 break;
               }
-              if (lumen_project_update_word_checker(&notOkMessageWordComparator, (char)receivedData)) {
-                sendStep = kSendNewBlockCmd;
-                sendBlockInterval = kSendBlockInterval + elapsedTimeInMs;
+              if (response == kFail) {
+                _link->sender.sendStep = kSendNewBlockCmd;
+                lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), kSendBlockInterval);
+                ++_link->sender.retries;
+                LUMEN_TRACE1(update_block_retry, _link->sender.acknowledgedBlocks);
+#if USE_PROJECT_UPDATE_PROGRESS
+                ++_link->progress.not_ok_count;
+                lumen_update_progress_event();
+#endif
                 break;
               }
-              receivedData = lumen_get_byte();
+              receivedData = lumen_update_get_byte();
             }
           }
           break;
@@ -1138,15 +3574,36 @@ bool lumen_update_send_data(uint8_t *data, uint32_t length, const char *msgUpdat
           break;
       }
 
-      if (elapsedTimeInMs >= sendBlockInterval) {
-        sendStep = kSendNewBlockCmd;
-        sendBlockInterval = elapsedTimeInMs + kSendBlockInterval;
+      if (_link->sender.sending && lumen_timer_expired(&_link->sender.sendBlockInterval, lumen_update_now())) {
+        _link->sender.sendStep = kSendNewBlockCmd;
+        lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), kSendBlockInterval);
+        ++_link->sender.retries;
+        LUMEN_TRACE1(update_block_retry, _link->sender.acknowledgedBlocks);
+#if USE_PROJECT_UPDATE_PROGRESS
+        lumen_update_progress_event();
+#endif
+      }
+
+      // A new block, or one refused or timed out above, is announced in the same call,
+      // so the loop never has to wait for a deadline to send it.
+      if (_link->sender.sendStep == kSendNewBlockCmd) {
+#if USE_PROJECT_UPDATE_COMPRESSION
+        if (_link->sender.packed) {
+          MESSAGE(kCommandNewPackedBlock);
+        } else
+#endif
+        MESSAGE(kCommandNewDataBlock);
+#if USE_PROJECT_UPDATE_PIPELINING
+        lumen_update_write_block();
+#endif
+        lumen_timer_arm(&_link->sender.sendBlockInterval, lumen_update_now(), kSendBlockInterval);
+        _link->sender.sendStep = kWaitingForOkMessageOfNewBlockCmd;
       }
     }
 
-    if ((sendingLength == 0) && (!sending)) {
+    if ((_link->sender.sendingLength == 0) && (!_link->sender.sending)) {
       res = true;
-      finishedLastSend = true;
+      _link->sender.finishedLastSend = true;
     }
 
     return res;
@@ -1154,15 +3611,12 @@ bool lumen_update_send_data(uint8_t *data, uint32_t length, const char *msgUpdat
   return false;
 }
 
-uint32_t sended_padding_bytes = 0;
-#define padding_array_size 4
-uint8_t padding_array[padding_array_size] = { 0, 0, 0, 0 };
 bool update_send_res = false;
 
 bool lumen_firmware_update_send_data(uint8_t *data, uint32_t length) {
   update_send_res = lumen_update_send_data(data, length, kUpdateFirmware);
   if (update_send_res == true) {
-    sended_padding_bytes += length;
+    _link->sentLength += length;
   }
   return update_send_res;
 }
@@ -1170,58 +3624,206 @@ bool lumen_firmware_update_send_data(uint8_t *data, uint32_t length) {
 bool lumen_project_update_send_data(uint8_t *data, uint32_t length) {
   update_send_res = lumen_update_send_data(data, length, kUpdateProject);
   if (update_send_res == true) {
-    sended_padding_bytes += length;
+    _link->sentLength += length;
   }
   return update_send_res;
 }
 
+#if USE_PROJECT_UPDATE_FROM_FILE
+static bool lumen_update_from_file(const char *path, const char *msgUpdate) {
+  if (_fileData == NULL) {
+    if (!lumen_update_map_file(path)) {
+      return false;
+    }
+#if USE_PROJECT_UPDATE_FLEET
+    _fileMappedForFleet = false;
+#endif
+#if USE_PROJECT_UPDATE_RESUME
+    lumen_update_open_resume_file(path);
+#endif
+  } else if (!lumen_update_is_mapped_file(path, false)) {
+    return false;
+  }
+
+  if (!lumen_update_send_data(_fileData, _fileLength, msgUpdate)) {
+    return false;
+  }
+
+  _link->sentLength += _fileLength;
+#if USE_PROJECT_UPDATE_RESUME
+  lumen_update_close_resume_file(true);
+#endif
+  lumen_update_unmap_file();
+  return true;
+}
+
+bool lumen_project_update_from_file(const char *path) {
+  return lumen_update_from_file(path, kUpdateProject);
+}
+
+bool lumen_firmware_update_from_file(const char *path) {
+  return lumen_update_from_file(path, kUpdateFirmware);
+}
+#endif
+
+#if USE_PROJECT_UPDATE_RESUME
+void lumen_project_and_firmware_update_abort() {
+  g_is_updating = false;
+  _link->isStarted = false;
+  _link->queryAsked = false;
+  _link->readingReceivedBlocks = false;
+  _link->matcherState = kResponseMatcherRoot;
+  _link->sentLength = 0;
+  _link->sender.sending = false;
+  _link->finishedLastFileSend = true;
+  // The next transfer drains whatever the display still sends, then starts over.
+  _link->resetPending = true;
+  lumen_timer_arm(&_link->restartInterval, lumen_update_now(), 0);
+#if USE_PROJECT_UPDATE_DELTA
+  lumen_project_and_firmware_update_set_delta_manifest(NULL, 0);
+#endif
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  if (_link == &_primaryLink) {
+    // Queued frames still go out, and the writes among them wait for their ACK.
+    lumen_update_multiplex_flush(_multiplexQueueLength);
+    _updateMultiplexed = false;
+  }
+#endif
+#if USE_PROJECT_UPDATE_FROM_FILE
+#if USE_PROJECT_UPDATE_FLEET
+  // A file mapped for the fleet stays mapped for it.
+  if ((_fileData != NULL) && !_fileMappedForFleet) {
+#else
+  if (_fileData != NULL) {
+#endif
+    // Keeps the .resume file: the next lumen_*_update_from_file reads it back.
+    lumen_update_close_resume_file(false);
+    lumen_update_unmap_file();
+  }
+#endif
+}
+#endif
+
+#if USE_CLOCK
+// Milliseconds since the previous tick of the link, read from the clock. The remainder carries over.
+static uint32_t lumen_update_measure_tick(lumen_update_link_t *link) {
+  uint32_t elapsedTimeInMs = (lumen_now_us() - link->lastTickTime) / kTimeUnitsPerMs;
+
+  link->lastTickTime += elapsedTimeInMs * kTimeUnitsPerMs;
+  return elapsedTimeInMs;
+}
+#endif
+
 void lumen_project_and_firmware_update_tick(uint32_t time_in_ms) {
-  elapsedTimeInMs += time_in_ms;
+#if USE_CLOCK
+  time_in_ms = lumen_update_measure_tick(_link);
+#endif
+  _link->elapsedTimeInMs += time_in_ms;
+#if USE_PROJECT_UPDATE_PROGRESS
+  lumen_update_count_time(_link, time_in_ms);
+#endif
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  // Variable frames go out on every tick, except while a block waits for its answer: the display
+  // only reads them after storing the block, and their ACKs would come too late.
+  if (_updateMultiplexed && !_link->sender.sending) {
+    lumen_update_multiplex_flush(_link->blockLength * PROJECT_UPDATE_MULTIPLEX_SHARE / 100);
+  }
+#endif
 }
 
-static bool add_padding() {
-  uint32_t send_padding_size = sended_padding_bytes % kProjectUpdateBlockLength;
-  while (send_padding_size) {
-    if (send_padding_size > padding_array_size) {
-      update_send_res = lumen_update_send_data(padding_array, padding_array_size, " ");
-      if (update_send_res == true) {
-        send_padding_size -= padding_array_size;
-      }
-    } else {
-      update_send_res = lumen_update_send_data(padding_array, padding_array_size, " ");
-      if (update_send_res == true) {
-        send_padding_size = 0;
-        sended_padding_bytes = 0;
-      }
+// Sends the zeros that complete the last, partial block, as a single block.
+// lumen_update_send_data stages the tail with one memset when it is given no data.
+// Returns true once the padding is acknowledged, or when there is nothing to pad.
+static bool lumen_update_send_padding() {
+  uint32_t send_padding_size = _link->sentLength % _link->blockLength;
+
+  if (send_padding_size) {
+    update_send_res = lumen_update_send_data(NULL, _link->blockLength - send_padding_size, " ");
+    if (!update_send_res) {
+      return false;
     }
   }
-  return update_send_res;
+  _link->sentLength = 0;
+  return true;
 }
 
 bool lumen_finish(const char *msg) {
-  static uint32_t finishInterval = 0;
+  // The padded last block goes through the same non-blocking dialogue as the others,
+  // so the finish command waits, tick after tick, until the display acknowledges it.
+  if (!lumen_update_send_padding()) {
+    return false;
+  }
 
-  if (elapsedTimeInMs >= finishInterval) {
+  if (lumen_timer_expired(&_link->finishInterval, lumen_update_now())) {
 
-    add_padding();
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+    // Frames queued so far go out before the finish command. Until the display answers it,
+    // variable frames keep being queued, flushed and routed as between blocks.
+    if (_link == &_primaryLink) {
+      lumen_update_multiplex_flush(_multiplexQueueLength);
+    }
+#endif
 
+#if USE_PROJECT_UPDATE_DELTA
+    if (_link->deltaAccepted) {
+      // "FINISHED [RESET] CRC <crc> A": the display refuses the image if its CRC differs,
+      // as it would when a block was wrongly left unchanged by the manifest.
+      uint32_t length = (uint32_t)strlen(msg) - 1;
+      memcpy(_link->queryMessage, msg, length);
+      memcpy(&_link->queryMessage[length], kCommandFinishedCrc, sizeof(kCommandFinishedCrc) - 1);
+      length += sizeof(kCommandFinishedCrc) - 1;
+      length += lumen_update_format_u32(&_link->queryMessage[length], _link->imageCrc);
+      memcpy(&_link->queryMessage[length], " A", sizeof(" A"));
+      msg = _link->queryMessage;
+    }
+    _link->imageRejected = false;
+#endif
     MESSAGE(msg);
+#if USE_PROJECT_UPDATE_DELTA
+    // Left empty for the next negotiation, which formats its query there.
+    _link->queryMessage[0] = '\0';
+#endif
 
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+    g_is_updating = (_link == &_primaryLink) && _updateMultiplexed;
+#else
     g_is_updating = false;
-    isStarted = false;
-    g_finished_last_file_send = true;
-    restart_interval = elapsedTimeInMs + 200;
-    finishInterval = elapsedTimeInMs + 100;
+#endif
+    _link->isStarted = false;
+#if USE_PROJECT_UPDATE_DELTA
+    lumen_project_and_firmware_update_set_delta_manifest(NULL, 0);
+#endif
+    _link->finishedLastFileSend = true;
+    lumen_timer_arm(&_link->restartInterval, lumen_update_now(), 200);
+    lumen_timer_arm(&_link->finishInterval, lumen_update_now(), 100);
 
   } else {
-    receivedData = lumen_get_byte();
-    while (receivedData != DATA_NULL) {
-      if (lumen_project_update_word_checker(&okMessageWordComparator, (char)receivedData)) {
-        return true;
+    bool answered = false;
+
+    receivedData = lumen_update_get_byte();
+    while (!answered && (receivedData != DATA_NULL)) {
+      lumen_project_update_response_t response = lumen_project_update_match_response((char)receivedData);
+
+      answered = (response == kOk);
+#if USE_PROJECT_UPDATE_DELTA
+      if ((response == kFail) && _link->deltaAccepted) {
+        _link->imageRejected = true;
+        answered = true;
+      }
+#endif
+      if (!answered) {
+        receivedData = lumen_update_get_byte();
       }
-      receivedData = lumen_get_byte();
     }
-   }
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+    if (answered && (_link == &_primaryLink) && _updateMultiplexed) {
+      lumen_update_multiplex_flush(_multiplexQueueLength);
+      _updateMultiplexed = false;
+      g_is_updating = false;
+    }
+#endif
+    return answered;
+  }
   return false;
 }
 
@@ -1232,6 +3834,182 @@ bool lumen_project_and_firmware_update_finish() {
 bool lumen_project_and_firmware_update_finish_and_reset() {
   return lumen_finish(kCommandFinishedAndReset);
 }
+
+#if USE_PROJECT_UPDATE_FLEET
+static void lumen_update_disarm_link(lumen_update_link_t *link) {
+  lumen_timer_disarm(&link->sender.sendBlockInterval);
+  lumen_timer_disarm(&link->startInterval);
+  lumen_timer_disarm(&link->restartInterval);
+  lumen_timer_disarm(&link->finishInterval);
+  lumen_timer_disarm(&link->queryInterval);
+}
+
+static void lumen_fleet_update_arm_timeout(uint8_t index) {
+#if USE_CLOCK
+  uint32_t now = lumen_now_us();
+#else
+  uint32_t now = _fleetLinks[index].elapsedTimeInMs;
+#endif
+
+  lumen_timer_arm(&_fleetLinkTimeouts[index], now, PROJECT_UPDATE_FLEET_LINK_TIMEOUT_IN_MS);
+}
+
+// Starts the dialogue of the link over, keeping its I/O and block buffer.
+static void lumen_fleet_update_reset_link(uint8_t index) {
+  lumen_update_link_t *link = &_fleetLinks[index];
+  lumen_update_link_t initialLink = LUMEN_UPDATE_LINK_INITIALIZER(*link);
+
+  lumen_update_disarm_link(link);
+  initialLink.io = link->io;
+  initialLink.blockBuffer = link->blockBuffer;
+  initialLink.blockBufferSize = link->blockBufferSize;
+#if USE_CLOCK
+  initialLink.lastTickTime = lumen_now_us();
+#endif
+  *link = initialLink;
+  _fleetLinkStages[index] = kFleetLinkSending;
+  lumen_fleet_update_arm_timeout(index);
+}
+
+bool lumen_fleet_update_add_link(const lumen_update_link_io_t *io, uint8_t *blockBuffer, uint32_t blockBufferSize) {
+  if ((_quantityOfFleetLinks >= PROJECT_UPDATE_FLEET_MAX_LINKS) || (io->write_bytes == NULL) || (io->get_byte == NULL)) {
+    return false;
+  }
+
+  lumen_update_link_t *link = &_fleetLinks[_quantityOfFleetLinks];
+
+  if (!lumen_update_use_block_buffer(link, blockBuffer, blockBufferSize)) {
+    return false;
+  }
+  link->io = *io;
+  lumen_fleet_update_reset_link(_quantityOfFleetLinks);
+  ++_quantityOfFleetLinks;
+  return true;
+}
+
+// Also abandons the fleet transfer in progress, if any.
+void lumen_fleet_update_clear_links() {
+  for (uint8_t link = 0; link < _quantityOfFleetLinks; ++link) {
+    lumen_update_disarm_link(&_fleetLinks[link]);
+    lumen_timer_disarm(&_fleetLinkTimeouts[link]);
+  }
+  _quantityOfFleetLinks = 0;
+  if ((_fileData != NULL) && _fileMappedForFleet) {
+    lumen_update_unmap_file();
+  }
+}
+
+void lumen_fleet_update_tick(uint32_t time_in_ms) {
+  for (uint8_t link = 0; link < _quantityOfFleetLinks; ++link) {
+#if USE_CLOCK
+    time_in_ms = lumen_update_measure_tick(&_fleetLinks[link]);
+#endif
+    _fleetLinks[link].elapsedTimeInMs += time_in_ms;
+#if USE_PROJECT_UPDATE_PROGRESS
+    lumen_update_count_time(&_fleetLinks[link], time_in_ms);
+#endif
+  }
+}
+
+bool lumen_fleet_update_link_status(uint8_t link, lumen_fleet_link_status_t *status) {
+  if (link >= _quantityOfFleetLinks) {
+    return false;
+  }
+  status->acknowledged_blocks = _fleetLinks[link].sender.acknowledgedBlocks;
+  status->retries = _fleetLinks[link].sender.retries;
+  status->finished = _fleetLinkStages[link] == kFleetLinkFinished;
+  status->failed = _fleetLinkStages[link] == kFleetLinkFailed;
+  return true;
+}
+
+#if USE_PROJECT_UPDATE_PROGRESS
+bool lumen_fleet_update_link_progress(uint8_t link, lumen_update_progress_t *progress) {
+  if (link >= _quantityOfFleetLinks) {
+    return false;
+  }
+  lumen_update_read_progress(&_fleetLinks[link], progress);
+  return true;
+}
+#endif
+
+// Steps every link once over the same mapped image and its shared CRC table.
+// Each link has its own dialogue, timeouts and retries, and fails after
+// PROJECT_UPDATE_FLEET_LINK_TIMEOUT_IN_MS without progress, so a slow or dead display
+// only delays itself. The image is unmapped when every link has finished or failed.
+static bool lumen_fleet_update_from_file(const char *path, const char *msgUpdate, const char *msgFinish) {
+  bool wasUpdating = g_is_updating;
+  bool finished = true;
+
+  if (_fileData == NULL) {
+    if (!lumen_update_map_file(path)) {
+      return false;
+    }
+    _fileMappedForFleet = true;
+    // Also drops what a link that failed last time left behind.
+    for (uint8_t link = 0; link < _quantityOfFleetLinks; ++link) {
+      lumen_fleet_update_reset_link(link);
+    }
+  } else if (!lumen_update_is_mapped_file(path, true)) {
+    return false;
+  }
+
+  for (uint8_t link = 0; link < _quantityOfFleetLinks; ++link) {
+    _link = &_fleetLinks[link];
+    lumen_fleet_link_stage_t stage = _fleetLinkStages[link];
+    bool wasStarted = _link->isStarted;
+    uint32_t acknowledgedBlocks = _link->sender.acknowledgedBlocks;
+
+    switch (stage) {
+      case kFleetLinkSending:
+        if (lumen_update_send_data(_fileData, _fileLength, msgUpdate)) {
+          _link->sentLength += _fileLength;
+          _fleetLinkStages[link] = kFleetLinkFinishing;
+        }
+        break;
+      case kFleetLinkFinishing:
+        if (lumen_finish(msgFinish)) {
+          _fleetLinkStages[link] = kFleetLinkFinished;
+        }
+        break;
+      default:
+        break;
+    }
+
+    if ((_fleetLinkStages[link] == kFleetLinkFinished) || (_fleetLinkStages[link] == kFleetLinkFailed)) {
+      lumen_timer_disarm(&_fleetLinkTimeouts[link]);
+      continue;
+    }
+    if ((_fleetLinkStages[link] != stage) || (_link->isStarted != wasStarted) || (_link->sender.acknowledgedBlocks != acknowledgedBlocks)) {
+      lumen_fleet_update_arm_timeout(link);
+    } else if (lumen_timer_expired(&_fleetLinkTimeouts[link], lumen_update_now())) {
+      // The display may still wait for blocks: the next fleet transfer starts it over.
+      lumen_update_disarm_link(_link);
+      lumen_timer_disarm(&_fleetLinkTimeouts[link]);
+      _fleetLinkStages[link] = kFleetLinkFailed;
+      continue;
+    }
+    finished = false;
+  }
+
+  // The fleet never blocks the variable functions of the library's own link.
+  _link = &_primaryLink;
+  g_is_updating = wasUpdating;
+
+  if (!finished) {
+    return false;
+  }
+
+  lumen_update_unmap_file();
+  return true;
+}
+
+bool lumen_fleet_project_update_from_file(const char *path, bool reset) {
+  return lumen_fleet_update_from_file(path, kUpdateProject, reset ? kCommandFinishedAndReset : kCommandFinished);
+}
+
+bool lumen_fleet_firmware_update_from_file(const char *path, bool reset) {
+  return lumen_fleet_update_from_file(path, kUpdateFirmware, reset ? kCommandFinishedAndReset : kCommandFinished);
 }
+#endif
 
 #endif
@@ -15,6 +15,7 @@ extern "C" {
 #include "LumenProtocolConfiguration.h"
 
 #define DATA_NULL 0xFFFF
+#define LUMEN_INVALID_WRITE_HANDLE 0
 
   typedef union {
     bool _bool;
@@ -50,24 +51,242 @@ extern "C" {
     lumen_data_t data;
   } lumen_packet_t;
 
+  // Return 0 when the write is refused: update running, every retry slot waiting or multiplex queue full.
   uint32_t lumen_write(uint16_t address, uint8_t *data, uint32_t length);
   uint32_t lumen_write_variable_list(uint16_t address, uint16_t index, uint8_t *data, uint32_t length);
   uint32_t lumen_write_packet(lumen_packet_t *packet);
   uint32_t lumen_available();
+  uint32_t lumen_poll(uint32_t max_bytes, uint32_t max_frames);
   bool lumen_read(lumen_packet_t *packet);
   bool lumen_request(lumen_packet_t *packet);
+  // The packet returned may be overwritten by the next lumen_available, lumen_poll or lumen_read.
   lumen_packet_t *lumen_get_first_packet();
+  // Copies the first unread packet out of the queue. Returns false when there is none.
+  bool lumen_pop(lumen_packet_t *packet);
+  // Same packet as lumen_get_first_packet, but its slot is kept untouched until lumen_release_packet.
+  // Borrowed slots do not receive new packets, so release them promptly.
+  lumen_packet_t *lumen_borrow_first_packet();
+  bool lumen_release_packet(lumen_packet_t *packet);
 
 #if USE_ACK
+  // Identifies one acknowledged write: the retry slot in the low byte, the slot generation in the high byte.
+  typedef uint16_t lumen_write_handle_t;
+  typedef void (*lumen_ack_callback_t)(lumen_write_handle_t handle);
+
   void lumen_ack_trigger(uint32_t time_in_ms);
+  void lumen_ack_set_callbacks(lumen_ack_callback_t on_acked, lumen_ack_callback_t on_failed);
+  lumen_write_handle_t lumen_ack_last_write_handle();
+  bool lumen_ack_is_pending(lumen_write_handle_t handle);
+  uint8_t lumen_ack_in_flight();
+  uint8_t lumen_ack_free_slots();
+#endif
+
+#if USE_RX_RING
+  // Safe to call from an ISR or another thread, one producer at a time.
+  // Returns the bytes stored; the rest did not fit and are counted by lumen_rx_dropped.
+  uint32_t lumen_rx_push(const uint8_t *data, uint32_t length);
+  uint32_t lumen_rx_dropped();
+#endif
+
+#if USE_TX_QUEUE
+  // Safe to call from any number of threads at once. Returns false when the queue is full.
+  bool lumen_tx_enqueue(const lumen_packet_t *packet);
+  // Writes up to max_packets queued packets (0 for all), from the thread that runs the library.
+  uint32_t lumen_tx_drain(uint32_t max_packets);
+  uint32_t lumen_tx_dropped();
+#endif
+
+#if USE_CLOCK && (USE_ACK || USE_PROJECT_UPDATE)
+// Returned by lumen_next_deadline_us when no timer is armed.
+#define LUMEN_NO_DEADLINE 0xFFFFFFFF
+
+  uint32_t lumen_next_deadline_us();
+#endif
+
+// Capture log format, also needed to read logs in builds without USE_CAPTURE.
+#define LUMEN_CAPTURE_TX 0
+#define LUMEN_CAPTURE_RX 1
+// A record is its lumen_now_us time (4 bytes), data length (2 bytes) and direction (1 byte),
+// little endian, followed by the data.
+#define LUMEN_CAPTURE_RECORD_HEADER_SIZE 7
+// A log is this header, "LUMC", version and flags, followed by records.
+#define LUMEN_CAPTURE_LOG_HEADER_SIZE 8
+#define LUMEN_CAPTURE_LOG_VERSION 1
+#define LUMEN_CAPTURE_LOG_CRC 0x01
+#define LUMEN_CAPTURE_LOG_ACK 0x02
+
+#if USE_CAPTURE
+// Longest record data: a quarter of the ring, kept within the 2 bytes of the record length.
+#define LUMEN_CAPTURE_MAX_RECORD_DATA ((CAPTURE_RING_SIZE / 4 < 0xFFFF) ? CAPTURE_RING_SIZE / 4 : 0xFFFF)
+// lumen_capture_read always has room for one record in a buffer of this size.
+#define LUMEN_CAPTURE_MAX_RECORD_SIZE (LUMEN_CAPTURE_RECORD_HEADER_SIZE + LUMEN_CAPTURE_MAX_RECORD_DATA)
+
+  uint32_t lumen_capture_log_header(uint8_t *buffer);
+  uint32_t lumen_capture_read(uint8_t *buffer, uint32_t size);
+  uint32_t lumen_capture_dropped();
+#endif
+
+#if USE_STATISTICS
+  typedef struct {
+    uint32_t frames_sent;             // frames written, retries and ACKs included
+    uint32_t bytes_sent;              // bytes of those frames, as sent on the link
+    uint32_t escapes_sent;            // escape sequences in those bytes
+    uint32_t frames_received;         // frames with a valid CRC
+    uint32_t bytes_received;          // bytes read while parsing frames, noise included
+    uint32_t escapes_received;
+    uint32_t crc_errors;              // frames discarded because of their CRC
+    uint32_t packets_dropped;         // received values lost because every packet slot was taken
+    uint32_t writes_refused;          // writes refused because every retry slot or the multiplex queue was full
+    uint32_t retries;                 // frames sent again because their ACK did not arrive in time
+    uint32_t ack_timeouts;            // writes given up after their last retry
+    uint32_t stale_acks;              // ACKs dropped because their write was already resolved
+    uint32_t max_packets_available;   // deepest the received packet queue has been
+    uint32_t max_writes_in_flight;    // most writes waiting for their ACK at once
+    uint32_t max_multiplex_queue;     // most bytes queued between update blocks
+    uint16_t sent_expansion_permille;      // bytes_sent per 1000 bytes before escaping
+    uint16_t received_expansion_permille;  // bytes_received per 1000 bytes after unescaping
+  } lumen_stats_t;
+
+  void lumen_get_stats(lumen_stats_t *stats);
+  void lumen_reset_stats();
+#endif
+
+#if USE_LATENCY_HISTOGRAMS
+#define LUMEN_LATENCY_BUCKETS ((33 - LATENCY_HISTOGRAM_PRECISION) << LATENCY_HISTOGRAM_PRECISION)
+
+  typedef enum {
+    kLatencyRequest,  // request frame sent to the answer parsed
+    kLatencyAck,      // first send of a write to its ACK, retries included
+    kQuantityOfLatencies
+  } lumen_latency_t;
+
+  typedef struct {
+    uint32_t counts[LUMEN_LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;
+  } lumen_latency_histogram_t;
+
+  void lumen_latency_snapshot(lumen_latency_t latency, lumen_latency_histogram_t *histogram);
+  void lumen_latency_reset(lumen_latency_t latency);
+  // Value under which `per_ten_thousand` of the samples fall: 5000 for p50, 9990 for p99.9.
+  uint32_t lumen_latency_percentile(const lumen_latency_histogram_t *histogram, uint32_t per_ten_thousand);
+  // Writes both histograms as Prometheus summaries. Returns the length written, 0 if size is too small.
+  uint32_t lumen_latency_export(char *buffer, uint32_t size);
 #endif
 
 #if USE_PROJECT_UPDATE
   bool lumen_project_update_send_data(uint8_t *data, uint32_t length);
   bool lumen_firmware_update_send_data(uint8_t *data, uint32_t length);
   void lumen_project_and_firmware_update_tick(uint32_t time_in_ms);
+  // Pad the last block and send the finish command. Keep ticking and calling them until they return true.
   bool lumen_project_and_firmware_update_finish();
   bool lumen_project_and_firmware_update_finish_and_reset();
+  bool lumen_project_and_firmware_update_set_block_buffer(uint8_t *buffer, uint32_t size);
+  uint32_t lumen_project_and_firmware_update_block_length();
+#if USE_PROJECT_UPDATE_FROM_FILE
+  // Return true once the whole file is sent. While they return false, a non-zero
+  // lumen_project_and_firmware_update_file_error means the file could not be opened or mapped.
+  bool lumen_project_update_from_file(const char *path);
+  bool lumen_firmware_update_from_file(const char *path);
+  // errno of the last file that could not be opened or mapped, 0 once a file is mapped.
+  int lumen_project_and_firmware_update_file_error();
+#endif
+
+#define LUMEN_IMAGE_HASH_SEED 2166136261UL
+
+  uint32_t lumen_project_and_firmware_update_image_hash(const uint8_t *data, uint32_t length, uint32_t hash);
+
+#if USE_PROJECT_UPDATE_RESUME
+  typedef struct {
+    uint32_t image_hash;  // lumen_project_and_firmware_update_image_hash of the acknowledged blocks
+    uint32_t block_length;
+    uint32_t acknowledged_blocks;
+  } lumen_update_resume_point_t;
+
+  typedef void (*lumen_update_resume_callback_t)(const lumen_update_resume_point_t *resume_point);
+
+  // Before the next transfer of the same image. The display answers "RESUME BLOCK <n> A" with
+  // "RECEIVED BLOCKS <m> A", the blocks it still holds, and the transfer continues after the
+  // smaller of n and m. A display that answers "RECEIVED OK A" instead is trusted to hold n blocks.
+  // The first data passed to the next transfer must hold the n blocks and match image_hash,
+  // otherwise the transfer starts from block 0 without asking the display.
+  void lumen_project_and_firmware_update_resume_from(const lumen_update_resume_point_t *resume_point);
+  void lumen_project_and_firmware_update_set_resume_callback(lumen_update_resume_callback_t callback);
+  // Abandons the transfer in progress without finishing it, as a host that restarts would.
+  // The next transfer starts with the update command again.
+  void lumen_project_and_firmware_update_abort();
+#endif
+
+#if USE_PROJECT_UPDATE_DELTA
+// Bytes needed by a delta manifest of an image with `length` bytes (one bit per 1024 bytes block).
+#define LUMEN_DELTA_MANIFEST_SIZE(length) ((((length) + 1023) / 1024 + 7) / 8)
+
+  uint32_t lumen_project_and_firmware_update_block_hashes(const uint8_t *image, uint32_t length, uint32_t *hashes);
+  uint32_t lumen_project_and_firmware_update_build_delta_manifest(const uint32_t *old_hashes, uint32_t old_quantity_of_blocks,
+                                                                  const uint8_t *new_image, uint32_t new_length, uint8_t *manifest);
+  // Compares the blocks themselves, when the image the display holds is still at hand.
+  uint32_t lumen_project_and_firmware_update_build_delta_manifest_from_image(const uint8_t *old_image, uint32_t old_length,
+                                                                             const uint8_t *new_image, uint32_t new_length, uint8_t *manifest);
+  void lumen_project_and_firmware_update_set_delta_manifest(const uint8_t *manifest, uint32_t quantity_of_blocks);
+  // After a delta transfer finished: true if the display refused the image, whose CRC differed
+  // from the one sent with the finish command, and kept the previous one. Send the whole image again.
+  bool lumen_project_and_firmware_update_image_rejected();
+#endif
+
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  bool lumen_project_and_firmware_update_is_multiplexed();
+#endif
+
+#if USE_PROJECT_UPDATE_PROGRESS
+// Value of lumen_update_progress_t.link for the library's own transfer; fleet links report their index.
+#define LUMEN_UPDATE_PRIMARY_LINK 0xFF
+
+  typedef struct {
+    uint8_t link;
+    uint32_t acknowledged_blocks;  // position in the image, including blocks resumed or unchanged
+    uint32_t acknowledged_bytes;   // bytes sent and acknowledged in this transfer
+    uint32_t retried_blocks;
+    uint32_t not_ok_count;
+    uint32_t bytes_per_second;
+    uint32_t transmitting_time_in_ms;
+    uint32_t waiting_time_in_ms;
+  } lumen_update_progress_t;
+
+  typedef void (*lumen_update_progress_callback_t)(const lumen_update_progress_t *progress);
+
+  void lumen_project_and_firmware_update_progress(lumen_update_progress_t *progress);
+  void lumen_project_and_firmware_update_set_progress_callback(lumen_update_progress_callback_t callback);
+#endif
+
+#if USE_PROJECT_UPDATE_FLEET
+  // Byte I/O of one display link. get_byte returns DATA_NULL when nothing was received.
+  typedef struct {
+    void (*write_bytes)(void *context, uint8_t *data, uint32_t length);
+    uint16_t (*get_byte)(void *context);
+    void *context;
+  } lumen_update_link_io_t;
+
+  typedef struct {
+    uint32_t acknowledged_blocks;
+    uint32_t retries;
+    bool finished;
+    // Made no progress for PROJECT_UPDATE_FLEET_LINK_TIMEOUT_IN_MS and was given up.
+    bool failed;
+  } lumen_fleet_link_status_t;
+
+  // A NULL blockBuffer keeps the link's own, which holds 1024 bytes blocks.
+  bool lumen_fleet_update_add_link(const lumen_update_link_io_t *io, uint8_t *blockBuffer, uint32_t blockBufferSize);
+  void lumen_fleet_update_clear_links();
+  void lumen_fleet_update_tick(uint32_t time_in_ms);
+  bool lumen_fleet_update_link_status(uint8_t link, lumen_fleet_link_status_t *status);
+  bool lumen_fleet_project_update_from_file(const char *path, bool reset);
+  bool lumen_fleet_firmware_update_from_file(const char *path, bool reset);
+#if USE_PROJECT_UPDATE_PROGRESS
+  bool lumen_fleet_update_link_progress(uint8_t link, lumen_update_progress_t *progress);
+#endif
+#endif
 #endif
 
 #if defined(__cplusplus)
@@ -19,6 +19,132 @@
 #define QUANTITY_OF_DATABUFFER_FOR_RETRY 1
 #endif
 
+/************************************************************
+ *
+ * USE_CLOCK
+ *
+ * Times every retry and timeout against a monotonic clock
+ * you provide as uint32_t lumen_now_us() (micros() on
+ * Arduino), instead of the time passed to lumen_ack_trigger
+ * and the update tick functions, which then only read the
+ * clock. Deadlines keep working when the clock wraps around.
+ * lumen_next_deadline_us returns how long the loop may sleep
+ * before the library has something to do.
+ *
+ ************************************************************/
+
+#define USE_CLOCK false
+
+/************************************************************
+ *
+ * USE_RX_RING
+ *
+ * Received bytes are pushed with lumen_rx_push, from the
+ * UART interrupt, a DMA callback or a reader thread, into a
+ * lock-free ring of RX_RING_SIZE bytes (a power of two). The
+ * library parses them from there, and lumen_get_byte is no
+ * longer called. The ring indices are 32-bit atomics: use it
+ * on 32-bit MCUs and on Linux. Bytes that do not fit are
+ * counted by lumen_rx_dropped.
+ *
+ ************************************************************/
+
+#define USE_RX_RING false
+#if USE_RX_RING
+#define RX_RING_SIZE 256
+#endif
+
+/************************************************************
+ *
+ * USE_TX_QUEUE
+ *
+ * Lets several threads send values without a lock: each one
+ * puts packets in a lock-free queue of TX_QUEUE_SIZE packets
+ * (a power of two) with lumen_tx_enqueue, and the thread that
+ * runs the library encodes and sends them with lumen_tx_drain.
+ * The other write functions stay single-threaded.
+ *
+ ************************************************************/
+
+#define USE_TX_QUEUE false
+#if USE_TX_QUEUE
+#define TX_QUEUE_SIZE 64
+#endif
+
+/************************************************************
+ *
+ * USE_CAPTURE (needs USE_CLOCK)
+ *
+ * Records every chunk passed to lumen_write_bytes and every
+ * burst read from lumen_get_byte, with its lumen_now_us time,
+ * in a lock-free ring of CAPTURE_RING_SIZE bytes. Take whole
+ * records out with lumen_capture_read, from the main loop or
+ * another thread, and append them to a file that starts with
+ * lumen_capture_log_header: tools/capture_replay plays it
+ * back. Records that do not fit are counted by
+ * lumen_capture_dropped; the link never waits for the reader.
+ *
+ ************************************************************/
+
+#define USE_CAPTURE false
+#if USE_CAPTURE
+#define CAPTURE_RING_SIZE 8192
+#endif
+
+/************************************************************
+ *
+ * USE_STATISTICS
+ *
+ * Counts frames and bytes in both directions, escapes, CRC
+ * errors, received packets dropped because every slot was
+ * taken, refused writes, retries, ACK timeouts and the
+ * deepest queues seen, for lumen_get_stats. Each counter is a
+ * uint32_t incremented where the event happens, cheap enough
+ * to leave on. Set STATISTICS_ATOMIC when lumen_get_stats is
+ * called from another thread than the library's.
+ *
+ ************************************************************/
+
+#define USE_STATISTICS false
+#if USE_STATISTICS
+#define STATISTICS_ATOMIC false
+#endif
+
+/************************************************************
+ *
+ * USE_LATENCY_HISTOGRAMS (needs USE_CLOCK)
+ *
+ * Measures request to answer times (lumen_request and
+ * lumen_read) and write to ACK times (USE_ACK) inside the
+ * library, when the frames are sent and parsed, into
+ * fixed-size histograms with logarithmic buckets. Each power
+ * of two is split in 2^LATENCY_HISTOGRAM_PRECISION buckets:
+ * 3 keeps values within 12.5% in 960 bytes per histogram.
+ * lumen_latency_export writes them in the Prometheus text
+ * format.
+ *
+ ************************************************************/
+
+#define USE_LATENCY_HISTOGRAMS false
+#if USE_LATENCY_HISTOGRAMS
+#define LATENCY_HISTOGRAM_PRECISION 3
+#endif
+
+/************************************************************
+ *
+ * USE_TRACEPOINTS (Linux hosts)
+ *
+ * Places USDT probes of provider "lumen" on the frame and
+ * update hot paths, for bpftrace or perf to attach to a
+ * running program. A probe that nothing is attached to costs
+ * a single nop. Needs <sys/sdt.h> (systemtap-sdt-dev on
+ * Debian, systemtap-sdt-devel on Fedora). When false, the
+ * probes compile to nothing.
+ *
+ ************************************************************/
+
+#define USE_TRACEPOINTS false
+
 /************************************************************ 
  * 
  * Attention! USE_PROJECT_UPDATE
@@ -33,11 +159,185 @@
  * The other functions will resume working normally
  * after the execution of the function:
  * - lumen_project_update_finish
+ *
+ * See USE_PROJECT_UPDATE_MULTIPLEXING to keep them working.
  * 
  ************************************************************/
 
 #define USE_PROJECT_UPDATE true 
 
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_PIPELINING
+ *
+ * Sends each block right after the "NEW BLOCK A" command,
+ * without waiting for the command to be acknowledged.
+ * This removes one round trip per block.
+ *
+ * The display must buffer the block bytes while it answers
+ * the command. If either answer is "RECEIVED NOT OK A" or
+ * times out, the command and the block are sent again.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH
+ *
+ * Block length (a multiple of 1024, up to 65536) proposed
+ * to the display at the start of each transfer.
+ * If the display refuses it, 1024 bytes blocks are used.
+ *
+ * Blocks longer than 1024 bytes need a buffer of at least
+ * PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH + 2 bytes, set with
+ * lumen_project_and_firmware_update_set_block_buffer.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_FROM_FILE (Linux and other POSIX hosts)
+ *
+ * Enables lumen_project_update_from_file and
+ * lumen_firmware_update_from_file, which memory-map the
+ * image and send it without chunking code on the caller side.
+ * Call them with the same path until they return true.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_RESUME
+ *
+ * Keeps the count of blocks acknowledged by the display.
+ * Save the point reported by the resume callback and pass it
+ * to lumen_project_and_firmware_update_resume_from before
+ * sending the same image again. The display is then asked to
+ * continue after those blocks ("RESUME BLOCK <n> A"). It answers
+ * with the blocks it still holds ("RECEIVED BLOCKS <m> A") and
+ * the transfer continues after the smaller of n and m; if it
+ * refuses, the transfer restarts from the first block.
+ *
+ * With USE_PROJECT_UPDATE_FROM_FILE, the point is kept in
+ * a "<image path>.resume" file automatically.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_DELTA
+ *
+ * Sends only the 1024 bytes blocks that changed since the
+ * image currently on the display. Keep the block hashes of
+ * the deployed image, build a manifest for the new one with
+ * lumen_project_and_firmware_update_build_delta_manifest and
+ * set it before sending the new image as usual.
+ * If the display refuses the manifest, the whole image is sent.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_COMPRESSION
+ *
+ * Asks the display to accept LZSS-compressed blocks
+ * ("COMPRESSION LZSS A"), at the negotiated block length.
+ * Each block is compressed on its own, so the display needs
+ * no decoder state besides the block. Blocks that do not
+ * shrink are sent as is. Costs about 3 bytes of RAM per byte
+ * of PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH (at least 1024),
+ * plus 512: 3.5 KB at 1024, 12.5 KB at 4096.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_MULTIPLEXING
+ *
+ * Asks the display to keep handling variable frames during
+ * an update ("MULTIPLEX A"). If it accepts, lumen_write,
+ * lumen_request, lumen_available and the ACK functions keep
+ * working until the display answers the finish command:
+ * outgoing frames are queued and sent before each block and
+ * on each tick when no block awaits its answer, up to
+ * PROJECT_UPDATE_MULTIPLEX_SHARE percent of the block length
+ * at a time; writes fail while the queue is full. With
+ * USE_ACK, a queued write waits for its ACK from the moment
+ * it is sent.
+ * lumen_read still needs the update to be finished.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_FLEET (needs USE_PROJECT_UPDATE_FROM_FILE)
+ *
+ * Sends one image file to up to PROJECT_UPDATE_FLEET_MAX_LINKS
+ * displays at once. Register each link's byte I/O, and the
+ * block buffer it needs beyond 1024 bytes blocks, with
+ * lumen_fleet_update_add_link, then call
+ * lumen_fleet_project_update_from_file from your event loop
+ * until it returns true. The file is mapped and its block
+ * CRCs computed once for all links; every link keeps its own
+ * progress, timeouts and retries. A link that makes no
+ * progress for PROJECT_UPDATE_FLEET_LINK_TIMEOUT_IN_MS fails,
+ * so the call returns true once every link has finished or
+ * failed: read each outcome with lumen_fleet_update_link_status.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_PARALLEL_CRC (needs USE_PROJECT_UPDATE_FROM_FILE)
+ *
+ * Computes the block CRCs of a mapped image with a lookup
+ * table on PROJECT_UPDATE_CRC_THREADS threads, before the
+ * first block is sent. The CRCs of the last image are kept,
+ * keyed by the device, inode, size and modification time of
+ * the file and the block length, so sending the same file
+ * again skips the computation without reading it. CRCs of a
+ * file modified less than 2 s before they were computed are
+ * not reused. Link with -pthread.
+ *
+ ************************************************************/
+
+/************************************************************
+ *
+ * USE_PROJECT_UPDATE_PROGRESS
+ *
+ * Keeps acknowledged bytes, retries, NOT OK answers,
+ * throughput and the time spent transmitting versus waiting
+ * for the display, per link. Read them with
+ * lumen_project_and_firmware_update_progress, or get them
+ * after every acknowledged or retried block with
+ * lumen_project_and_firmware_update_set_progress_callback.
+ *
+ ************************************************************/
+
+#if USE_PROJECT_UPDATE
+#define USE_PROJECT_UPDATE_PIPELINING false
+#define PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH 1024
+#define USE_PROJECT_UPDATE_FROM_FILE false
+#define USE_PROJECT_UPDATE_RESUME false
+#define USE_PROJECT_UPDATE_DELTA false
+#define USE_PROJECT_UPDATE_COMPRESSION false
+#define USE_PROJECT_UPDATE_MULTIPLEXING false
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+#define PROJECT_UPDATE_MULTIPLEX_SHARE 10
+#define PROJECT_UPDATE_MULTIPLEX_QUEUE_SIZE 512
+#endif
+#define USE_PROJECT_UPDATE_FLEET false
+#if USE_PROJECT_UPDATE_FLEET
+#define PROJECT_UPDATE_FLEET_MAX_LINKS 32
+#define PROJECT_UPDATE_FLEET_LINK_TIMEOUT_IN_MS 10000
+#endif
+#define USE_PROJECT_UPDATE_PARALLEL_CRC false
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+#define PROJECT_UPDATE_CRC_THREADS 4
+#endif
+#define USE_PROJECT_UPDATE_PROGRESS false
+#endif
+
 // DO NOT MODIFY THESE 👇
 #define START_FLAG 0x12
 #define END_FLAG 0x13
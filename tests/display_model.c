@@ -0,0 +1,747 @@
+// In-process Smart Display for the tests, see display_model.h.
+//
+// Answers never get lost or reordered among themselves: they carry no block
+// number, so the host cannot tell a late "RECEIVED OK A" from the one it waits
+// for. Faults are injected where a real link recovers from them: commands and
+// blocks dropped or corrupted on their way in, answers delayed, and frames the
+// display sends on its own overtaking delayed answers.
+
+#include "display_model.h"
+
+#include "LumenProtocolConfiguration.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_VALUE_SIZE 64
+#define MAX_CHUNK_SIZE (2 * (MAX_VALUE_SIZE + 8))
+#define QUEUE_SIZE 256
+#define MAX_LINE_SIZE 64
+#define MAX_BLOCK_LENGTH 65536
+#define DEFAULT_BLOCK_LENGTH 1024
+#define CRC_LENGTH 2
+#define PACKED_HEADER_LENGTH 2
+// A block left incomplete this long is given up, so the host's next attempt is heard.
+#define BLOCK_TIMEOUT_IN_MS 500
+
+typedef struct {
+  uint32_t dueTimeInMs;
+  uint32_t length;
+  uint8_t data[MAX_CHUNK_SIZE];
+} chunk_t;
+
+typedef struct {
+  chunk_t chunks[QUEUE_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t lastDueTimeInMs;
+} queue_t;
+
+typedef struct {
+  uint8_t length;
+  uint8_t data[MAX_VALUE_SIZE];
+} variable_t;
+
+typedef enum {
+  kReceivingText,
+  kReceivingFrame,
+  kReceivingBlock,
+  kReceivingPackedBlock,
+  kReceivingManifest
+} receive_state_t;
+
+static display_model_config_t _config;
+static display_model_statistics_t _statistics;
+static uint32_t _random = 1;
+static uint32_t _nowInMs = 0;
+static uint32_t _lastByteTimeInMs = 0;
+static uint32_t _nextEmitTimeInMs = 0;
+
+// Answers to the host, in order, and frames the display sends on its own.
+static queue_t _answers;
+static queue_t _emitted;
+static queue_t *_sendingQueue = NULL;
+static uint32_t _sendingIndex = 0;
+
+static variable_t _variables[65536];
+
+static receive_state_t _receiveState = kReceivingText;
+static bool _escaped = false;
+static uint8_t _frame[MAX_CHUNK_SIZE];
+static uint32_t _frameLength = 0;
+static bool _frameOverflow = false;
+static char _line[MAX_LINE_SIZE + 1];
+static uint32_t _lineLength = 0;
+
+static uint8_t _image[DISPLAY_MODEL_MAX_IMAGE_SIZE];
+static uint32_t _imageLength = 0;
+// What an interrupted update left in _image, which RESUME BLOCK may continue.
+static uint32_t _partialLength = 0;
+static uint8_t _finishedImage[DISPLAY_MODEL_MAX_IMAGE_SIZE];
+static uint32_t _finishedImageLength = 0;
+static uint32_t _blockLength = DEFAULT_BLOCK_LENGTH;
+static uint8_t _block[PACKED_HEADER_LENGTH + MAX_BLOCK_LENGTH + CRC_LENGTH];
+static uint32_t _blockIndex = 0;
+static uint8_t _unpacked[MAX_BLOCK_LENGTH];
+static bool _compression = false;
+// Delta transfers rebuild the image from the last finished one, block by block.
+static uint8_t _manifest[8192];
+static uint32_t _manifestBlocks = 0;
+static bool _delta = false;
+static uint32_t _deltaPosition = 0;
+// Answer to the last FINISHED with a CRC, repeated if the host sends it again.
+static bool _imageRejected = false;
+
+// xorshift32: the same faults for the same seed on every platform.
+static uint32_t random_next() {
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+  return _random;
+}
+
+static bool chance(uint32_t percent) {
+  return (percent > 0) && ((random_next() % 100) < percent);
+}
+
+static uint16_t calculate_crc(const uint8_t *data, uint32_t length) {
+  uint16_t crc = 0xFFFF;
+
+  for (uint32_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+// CRC-32 (IEEE 802.3, reflected) of the whole image, checked by "FINISHED CRC <n> A".
+static uint32_t calculate_image_crc(const uint8_t *data, uint32_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (uint32_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+    }
+  }
+  return ~crc;
+}
+
+static void image_append(const uint8_t *data, uint32_t length) {
+  if (_imageLength + length <= sizeof(_image)) {
+    memcpy(&_image[_imageLength], data, length);
+    _imageLength += length;
+  }
+}
+
+// Output.
+
+static void queue_push(queue_t *queue, const uint8_t *data, uint32_t length, uint32_t delayInMs) {
+  chunk_t *chunk;
+
+  if (((queue->tail + 1) % QUEUE_SIZE) == queue->head) {
+    return;
+  }
+  chunk = &queue->chunks[queue->tail];
+  memcpy(chunk->data, data, length);
+  chunk->length = length;
+  // A later chunk never leaves before an earlier one of the same queue.
+  chunk->dueTimeInMs = _nowInMs + delayInMs;
+  if ((int32_t)(chunk->dueTimeInMs - queue->lastDueTimeInMs) < 0) {
+    chunk->dueTimeInMs = queue->lastDueTimeInMs;
+  }
+  queue->lastDueTimeInMs = chunk->dueTimeInMs;
+  queue->tail = (queue->tail + 1) % QUEUE_SIZE;
+}
+
+static bool queue_due(const queue_t *queue) {
+  return (queue->head != queue->tail) && ((int32_t)(_nowInMs - queue->chunks[queue->head].dueTimeInMs) >= 0);
+}
+
+static void say(const char *message, uint32_t jitterInMs) {
+  uint32_t delayInMs = _config.answer_latency_ms;
+
+  if (jitterInMs > 0) {
+    delayInMs += random_next() % (jitterInMs + 1);
+  }
+  queue_push(&_answers, (const uint8_t *)message, (uint32_t)strlen(message), delayInMs);
+}
+
+static uint32_t frame_put(uint8_t *out, uint32_t index, uint8_t data) {
+  if (data == START_FLAG || data == END_FLAG || data == ESCAPE_FLAG) {
+    out[index++] = ESCAPE_FLAG;
+    out[index++] = data ^ XOR_FLAG;
+  } else {
+    out[index++] = data;
+  }
+  return index;
+}
+
+// Frames command, address and payload, escaped and, with USE_CRC, followed by their CRC.
+static uint32_t frame_build(uint8_t *out, uint8_t command, uint16_t address, const uint8_t *payload, uint32_t length) {
+  uint8_t raw[MAX_VALUE_SIZE + 8];
+  uint32_t rawLength = 0;
+  uint32_t outLength = 0;
+
+  raw[rawLength++] = command;
+  raw[rawLength++] = address & 0xFF;
+  raw[rawLength++] = address >> 8;
+  if (length > 0) {
+    memcpy(&raw[rawLength], payload, length);
+    rawLength += length;
+  }
+
+  out[outLength++] = START_FLAG;
+  out[outLength++] = command;
+  for (uint32_t i = 1; i < rawLength; ++i) {
+    outLength = frame_put(out, outLength, raw[i]);
+  }
+#if USE_CRC
+  uint16_t crc = calculate_crc(raw, rawLength);
+  outLength = frame_put(out, outLength, crc >> 8);
+  outLength = frame_put(out, outLength, crc & 0xFF);
+#endif
+  out[outLength++] = END_FLAG;
+  return outLength;
+}
+
+static void answer_frame(uint8_t command, uint16_t address, const uint8_t *payload, uint32_t length) {
+  uint8_t out[MAX_CHUNK_SIZE];
+
+  queue_push(&_answers, out, frame_build(out, command, address, payload, length), _config.answer_latency_ms);
+}
+
+static void emit_frames() {
+  uint8_t out[MAX_CHUNK_SIZE];
+
+  while ((_config.emit_period_ms > 0) && ((int32_t)(_nowInMs - _nextEmitTimeInMs) >= 0)
+         && ((_config.emit_count == 0) || (_statistics.frames_emitted < _config.emit_count))) {
+    uint32_t value = _statistics.frames_emitted;
+    uint8_t payload[sizeof(value) + 2];
+    uint32_t length = sizeof(value);
+    uint32_t frameLength;
+
+    memcpy(payload, &value, sizeof(value));
+#if USE_ACK
+    // Ids 1 to 16 never need escaping.
+    payload[length++] = (uint8_t)((_statistics.frames_emitted % 16) + 1);
+    payload[length++] = 0;
+#endif
+    frameLength = frame_build(out, READ_FLAG, _config.emit_address, payload, length);
+    if (_statistics.frames_emitted < _config.truncated_emits) {
+      --frameLength;
+    }
+    queue_push(&_emitted, out, frameLength, 0);
+    ++_statistics.frames_emitted;
+    _nextEmitTimeInMs += _config.emit_period_ms;
+  }
+}
+
+// Variable frames.
+
+static void handle_frame() {
+  uint32_t length = _frameLength;
+
+  ++_statistics.frames_in;
+#if USE_CRC
+  if (length < 3 + CRC_LENGTH) {
+    return;
+  }
+  uint16_t crc = calculate_crc(_frame, length - CRC_LENGTH);
+  if (_frame[length - 2] != (crc >> 8) || _frame[length - 1] != (crc & 0xFF)) {
+    return;
+  }
+  length -= CRC_LENGTH;
+#endif
+  if (length < 3) {
+    return;
+  }
+
+  uint8_t command = _frame[0];
+  uint16_t address = _frame[1] | (_frame[2] << 8);
+  uint8_t *payload = &_frame[3];
+  uint32_t payloadLength = length - 3;
+
+  if (command == WRITE_FLAG) {
+    uint16_t id = 0;
+
+#if USE_ACK
+    if (payloadLength < 2) {
+      return;
+    }
+    payloadLength -= 2;
+    // Slot, then its generation: the ACK echoes both.
+    id = payload[payloadLength] | (payload[payloadLength + 1] << 8);
+#endif
+    if (payloadLength > MAX_VALUE_SIZE) {
+      payloadLength = MAX_VALUE_SIZE;
+    }
+    memcpy(_variables[address].data, payload, payloadLength);
+    _variables[address].length = (uint8_t)payloadLength;
+    ++_statistics.writes;
+#if USE_ACK
+    uint8_t out[MAX_CHUNK_SIZE];
+    queue_push(&_answers, out, frame_build(out, ACK_FLAG, id, NULL, 0), _config.answer_latency_ms + _config.ack_latency_ms);
+#else
+    (void)id;
+#endif
+  } else if (command == READ_FLAG) {
+    variable_t *variable = &_variables[address];
+    uint8_t zero[4] = { 0 };
+
+    if (variable->length > 0) {
+      answer_frame(READ_FLAG, address, variable->data, variable->length);
+    } else {
+      answer_frame(READ_FLAG, address, zero, sizeof(zero));
+    }
+  }
+}
+
+// Update dialogue.
+
+static bool line_ends_with(const char *text) {
+  uint32_t length = (uint32_t)strlen(text);
+  return (_lineLength >= length) && (memcmp(&_line[_lineLength - length], text, length) == 0);
+}
+
+// Matches "<prefix><number> A" at the start of the line.
+static bool line_number_command(const char *prefix, uint32_t *number) {
+  uint32_t length = (uint32_t)strlen(prefix);
+
+  if (!line_ends_with(" A") || (_lineLength <= length) || (strncmp(_line, prefix, length) != 0)) {
+    return false;
+  }
+  *number = (uint32_t)strtoul(&_line[length], NULL, 10);
+  return true;
+}
+
+// "FINISHED [RESET] A", or "FINISHED [RESET] CRC <n> A" after a delta manifest.
+static bool line_finish_command(bool *checked, uint32_t *crc) {
+  *checked = line_number_command("FINISHED CRC ", crc) || line_number_command("FINISHED RESET CRC ", crc);
+  return *checked || line_ends_with("FINISHED A") || line_ends_with("FINISHED RESET A");
+}
+
+static bool block_crc_matches(const uint8_t *data, uint32_t length) {
+  uint16_t crc = calculate_crc(data, length);
+  return (data[length] == (crc >> 8)) && (data[length + 1] == (crc & 0xFF));
+}
+
+// Copies the unchanged blocks before the next changed one from the last finished image.
+static void delta_advance() {
+  if (!_delta) {
+    return;
+  }
+  while ((_deltaPosition < _manifestBlocks) && !(_manifest[_deltaPosition / 8] & (1 << (_deltaPosition % 8)))) {
+    uint32_t offset = _deltaPosition * _blockLength;
+    uint32_t length = _blockLength;
+
+    if (offset >= _finishedImageLength) {
+      length = 0;
+    } else if (offset + length > _finishedImageLength) {
+      length = _finishedImageLength - offset;
+    }
+    image_append(&_finishedImage[offset], length);
+    ++_deltaPosition;
+    ++_statistics.blocks_kept;
+  }
+}
+
+static void receive_manifest_byte(uint8_t data) {
+  uint32_t manifestLength = (_manifestBlocks + 7) / 8;
+
+  _block[_blockIndex++] = data;
+  if (_blockIndex < manifestLength + CRC_LENGTH) {
+    return;
+  }
+  _receiveState = kReceivingText;
+
+  if (block_crc_matches(_block, manifestLength)) {
+    memcpy(_manifest, _block, manifestLength);
+    _delta = true;
+    _deltaPosition = 0;
+    _imageLength = 0;
+    ++_statistics.manifests;
+    say("RECEIVED OK A", 0);
+  } else {
+    say("RECEIVED NOT OK A", 0);
+  }
+}
+
+// Same format as the encoder of LumenProtocol.c. Returns the unpacked length, 0 if the data is malformed.
+static uint32_t unpack_block(const uint8_t *in, uint32_t length, uint8_t *out, uint32_t capacity) {
+  uint32_t i = 0;
+  uint32_t o = 0;
+
+  while (i < length) {
+    uint8_t flags = in[i++];
+    for (uint8_t bit = 0; (bit < 8) && (i < length); ++bit) {
+      if (flags & (1 << bit)) {
+        if (o >= capacity) {
+          return 0;
+        }
+        out[o++] = in[i++];
+      } else {
+        if (i + 1 >= length) {
+          return 0;
+        }
+        uint32_t offset = (in[i] | ((in[i + 1] >> 6) << 8)) + 1;
+        uint32_t count = (in[i + 1] & 0x3F) + 3;
+        i += 2;
+        if ((offset > o) || (o + count > capacity)) {
+          return 0;
+        }
+        for (uint32_t k = 0; k < count; ++k, ++o) {
+          out[o] = out[o - offset];
+        }
+      }
+    }
+  }
+  return o;
+}
+
+// Applies the configured loss and corruption to a complete block; false if it was lost.
+static bool inject_block_faults() {
+  if (chance(_config.loss_percent)) {
+    ++_statistics.lost;
+    return false;
+  }
+  if (chance(_config.corruption_percent)) {
+    _block[random_next() % _blockIndex] ^= (uint8_t)(1 << (random_next() % 8));
+    ++_statistics.corrupted;
+  }
+  return true;
+}
+
+static void answer_block(const uint8_t *data, bool ok) {
+  if (ok) {
+    delta_advance();
+    image_append(data, _blockLength);
+    ++_deltaPosition;
+    ++_statistics.blocks_ok;
+    say("RECEIVED OK A", _config.block_answer_jitter_ms);
+  } else {
+    ++_statistics.blocks_not_ok;
+    say("RECEIVED NOT OK A", _config.block_answer_jitter_ms);
+  }
+}
+
+static void receive_block_byte(uint8_t data) {
+  _block[_blockIndex++] = data;
+
+  if (_blockIndex < _blockLength + CRC_LENGTH) {
+    return;
+  }
+  _receiveState = kReceivingText;
+
+  if (inject_block_faults()) {
+    answer_block(_block, block_crc_matches(_block, _blockLength));
+  }
+}
+
+// [length high][length low][packed bytes][crc high][crc low], the CRC over the length and the packed bytes.
+static void receive_packed_block_byte(uint8_t data) {
+  uint32_t packedLength;
+
+  _block[_blockIndex++] = data;
+  if (_blockIndex < PACKED_HEADER_LENGTH) {
+    return;
+  }
+  packedLength = (_block[0] << 8) | _block[1];
+  if (packedLength > _blockLength) {
+    // Not a block the host could have packed.
+    _receiveState = kReceivingText;
+    answer_block(_block, false);
+    return;
+  }
+  if (_blockIndex < PACKED_HEADER_LENGTH + packedLength + CRC_LENGTH) {
+    return;
+  }
+  _receiveState = kReceivingText;
+
+  if (inject_block_faults()) {
+    bool ok = block_crc_matches(_block, PACKED_HEADER_LENGTH + packedLength)
+              && (unpack_block(&_block[PACKED_HEADER_LENGTH], packedLength, _unpacked, _blockLength) == _blockLength);
+    if (ok) {
+      ++_statistics.packed_blocks;
+    }
+    answer_block(_unpacked, ok);
+  }
+}
+
+static void handle_line() {
+  uint32_t number;
+  bool checked;
+  bool handled = true;
+
+  if (line_ends_with("UPDATE PROJECT A") || line_ends_with("UPDATE FIRMWARE A") || line_ends_with("NEW BLOCK A")
+      || line_ends_with("NEW PACKED BLOCK A") || line_finish_command(&checked, &number) || line_number_command("BLOCK LENGTH ", &number)) {
+    ++_statistics.commands;
+    if (chance(_config.loss_percent)) {
+      ++_statistics.lost;
+      _lineLength = 0;
+      return;
+    }
+  }
+
+  if (line_ends_with("UPDATE PROJECT A") || line_ends_with("UPDATE FIRMWARE A")) {
+    _imageRejected = false;
+    if (_imageLength > 0) {
+      _partialLength = _imageLength;
+    }
+    _imageLength = 0;
+    _blockLength = DEFAULT_BLOCK_LENGTH;
+    _delta = false;
+    _deltaPosition = 0;
+    _compression = false;
+    ++_statistics.updates;
+    say("RECEIVED OK A", 0);
+  } else if (line_ends_with("NEW PACKED BLOCK A")) {
+    if (_compression) {
+      _receiveState = kReceivingPackedBlock;
+      _blockIndex = 0;
+      say("RECEIVED OK A", _config.block_answer_jitter_ms);
+    } else {
+      say("RECEIVED NOT OK A", _config.block_answer_jitter_ms);
+    }
+  } else if (line_ends_with("NEW BLOCK A")) {
+    _receiveState = kReceivingBlock;
+    _blockIndex = 0;
+    say("RECEIVED OK A", _config.block_answer_jitter_ms);
+  } else if (line_finish_command(&checked, &number)) {
+    delta_advance();
+    // A repeated FINISHED (the host missed our OK) must not replace the image with an empty one.
+    if (_imageLength > 0) {
+      _imageRejected = checked && (calculate_image_crc(_image, _imageLength) != number);
+      if (_imageRejected) {
+        // The previous image stays: the next delta is built against it again.
+        ++_statistics.images_rejected;
+      } else {
+        memcpy(_finishedImage, _image, _imageLength);
+        _finishedImageLength = _imageLength;
+        ++_statistics.finished;
+      }
+      _imageLength = 0;
+      _partialLength = 0;
+      _delta = false;
+    }
+    const char *answer = _imageRejected ? "RECEIVED NOT OK A" : "RECEIVED OK A";
+    queue_push(&_answers, (const uint8_t *)answer, (uint32_t)strlen(answer), _config.answer_latency_ms + _config.finish_latency_ms);
+  } else if (line_number_command("RESUME BLOCK ", &number)) {
+    if (_config.unanswered & DISPLAY_MODEL_RESUME) {
+      // Unknown to an older display: no answer at all.
+    } else if (_config.refused & DISPLAY_MODEL_RESUME) {
+      say("RECEIVED NOT OK A", 0);
+    } else {
+      char answer[32];
+      uint32_t heldBlocks = _partialLength / _blockLength;
+      uint32_t resumedBlocks = (number < heldBlocks) ? number : heldBlocks;
+
+      _imageLength = resumedBlocks * _blockLength;
+      _deltaPosition = resumedBlocks;
+      ++_statistics.resumes;
+      _statistics.resumed_blocks = resumedBlocks;
+      snprintf(answer, sizeof(answer), "RECEIVED BLOCKS %u A", heldBlocks);
+      say(answer, 0);
+    }
+    _partialLength = 0;
+  } else if (line_number_command("DELTA MANIFEST ", &number)) {
+    if (_config.unanswered & DISPLAY_MODEL_DELTA) {
+      // Unknown to an older display: no answer at all.
+    } else if ((_config.refused & DISPLAY_MODEL_DELTA) || (_finishedImageLength == 0) || ((number + 7) / 8 > sizeof(_manifest))) {
+      say("RECEIVED NOT OK A", 0);
+    } else {
+      _manifestBlocks = number;
+      _receiveState = kReceivingManifest;
+      _blockIndex = 0;
+      say("RECEIVED OK A", 0);
+    }
+  } else if (line_ends_with("MULTIPLEX A")) {
+    // Variable frames are handled between blocks either way; accepting only tells the host so.
+    if (_config.unanswered & DISPLAY_MODEL_MULTIPLEX) {
+      // Unknown to an older display: no answer at all.
+    } else if (_config.refused & DISPLAY_MODEL_MULTIPLEX) {
+      say("RECEIVED NOT OK A", 0);
+    } else {
+      ++_statistics.multiplexes;
+      say("RECEIVED OK A", 0);
+    }
+  } else if (line_ends_with("COMPRESSION LZSS A")) {
+    if (_config.unanswered & DISPLAY_MODEL_COMPRESSION) {
+      // Unknown to an older display: no answer at all.
+    } else if (_config.refused & DISPLAY_MODEL_COMPRESSION) {
+      say("RECEIVED NOT OK A", 0);
+    } else {
+      _compression = true;
+      say("RECEIVED OK A", 0);
+    }
+  } else if (line_number_command("BLOCK LENGTH ", &number)) {
+    if ((number > 0) && (number <= _config.max_block_length) && (number % DEFAULT_BLOCK_LENGTH == 0)) {
+      _blockLength = number;
+      say("RECEIVED OK A", 0);
+    } else {
+      say("RECEIVED NOT OK A", 0);
+    }
+  } else {
+    handled = false;
+  }
+
+  _statistics.block_length = _blockLength;
+  if (handled || (_lineLength == MAX_LINE_SIZE)) {
+    _lineLength = 0;
+  }
+}
+
+static void receive_byte(uint8_t data) {
+  if ((_receiveState != kReceivingText) && ((_nowInMs - _lastByteTimeInMs) > BLOCK_TIMEOUT_IN_MS)) {
+    if ((_receiveState == kReceivingBlock) || (_receiveState == kReceivingPackedBlock)) {
+      ++_statistics.blocks_given_up;
+    }
+    _receiveState = kReceivingText;
+    _lineLength = 0;
+  }
+  _lastByteTimeInMs = _nowInMs;
+
+  switch (_receiveState) {
+    case kReceivingBlock:
+      receive_block_byte(data);
+      break;
+    case kReceivingPackedBlock:
+      receive_packed_block_byte(data);
+      break;
+    case kReceivingManifest:
+      receive_manifest_byte(data);
+      break;
+    case kReceivingFrame:
+      if (data == START_FLAG) {
+        _frameLength = 0;
+        _frameOverflow = false;
+        _escaped = false;
+      } else if (data == END_FLAG) {
+        _receiveState = kReceivingText;
+        if (!_frameOverflow) {
+          handle_frame();
+        }
+      } else if (data == ESCAPE_FLAG) {
+        _escaped = true;
+      } else {
+        if (_escaped) {
+          data ^= XOR_FLAG;
+          _escaped = false;
+        }
+        if (_frameLength < sizeof(_frame)) {
+          _frame[_frameLength++] = data;
+        } else {
+          _frameOverflow = true;
+        }
+      }
+      break;
+    default:
+      if (data == START_FLAG) {
+        _receiveState = kReceivingFrame;
+        _frameLength = 0;
+        _frameOverflow = false;
+        _escaped = false;
+      } else {
+        _line[_lineLength++] = (char)data;
+        _line[_lineLength] = '\0';
+        handle_line();
+      }
+      break;
+  }
+}
+
+// Interface.
+
+void display_model_reset(const display_model_config_t *config) {
+  static const display_model_config_t noFaults = { .max_block_length = DEFAULT_BLOCK_LENGTH, .answer_latency_ms = 1, .seed = 1 };
+
+  _config = (config != NULL) ? *config : noFaults;
+  if (_config.answer_latency_ms == 0) {
+    _config.answer_latency_ms = 1;
+  }
+  _random = (_config.seed != 0) ? _config.seed : 1;
+
+  memset(&_statistics, 0, sizeof(_statistics));
+  memset(&_answers, 0, sizeof(_answers));
+  memset(&_emitted, 0, sizeof(_emitted));
+  memset(_variables, 0, sizeof(_variables));
+  _sendingQueue = NULL;
+  _sendingIndex = 0;
+  _receiveState = kReceivingText;
+  _lineLength = 0;
+  _imageLength = 0;
+  _partialLength = 0;
+  _finishedImageLength = 0;
+  _blockLength = DEFAULT_BLOCK_LENGTH;
+  _statistics.block_length = _blockLength;
+  _manifestBlocks = 0;
+  _delta = false;
+  _deltaPosition = 0;
+  _imageRejected = false;
+  _compression = false;
+  _nextEmitTimeInMs = _nowInMs + _config.emit_period_ms;
+  _answers.lastDueTimeInMs = _nowInMs;
+  _emitted.lastDueTimeInMs = _nowInMs;
+}
+
+void display_model_set_time(uint32_t now_in_ms) {
+  _nowInMs = now_in_ms;
+  emit_frames();
+}
+
+void display_model_receive(const uint8_t *data, uint32_t length) {
+  for (uint32_t i = 0; i < length; ++i) {
+    receive_byte(data[i]);
+  }
+}
+
+void display_model_drop_blocks(uint32_t quantity_of_blocks) {
+  if (_imageLength > quantity_of_blocks * _blockLength) {
+    _imageLength = quantity_of_blocks * _blockLength;
+  }
+}
+
+// Whole chunks go out one at a time, the frames sent on its own first when both are due.
+uint16_t display_model_get_byte() {
+  if (_sendingQueue == NULL) {
+    if (queue_due(&_emitted)) {
+      _sendingQueue = &_emitted;
+    } else if (queue_due(&_answers)) {
+      _sendingQueue = &_answers;
+    } else {
+      return DISPLAY_MODEL_NO_BYTE;
+    }
+    _sendingIndex = 0;
+  }
+
+  chunk_t *chunk = &_sendingQueue->chunks[_sendingQueue->head];
+  uint8_t data = chunk->data[_sendingIndex++];
+
+  if (_sendingIndex == chunk->length) {
+    _sendingQueue->head = (_sendingQueue->head + 1) % QUEUE_SIZE;
+    _sendingQueue = NULL;
+  }
+  return data;
+}
+
+const uint8_t *display_model_image(uint32_t *length) {
+  *length = _finishedImageLength;
+  return _finishedImage;
+}
+
+const display_model_statistics_t *display_model_statistics() {
+  return &_statistics;
+}
+
+const uint8_t *display_model_manifest(uint32_t *quantity_of_blocks) {
+  *quantity_of_blocks = _manifestBlocks;
+  return _manifest;
+}
+
+const uint8_t *display_model_variable(uint16_t address, uint32_t *length) {
+  *length = _variables[address].length;
+  return (_variables[address].length > 0) ? _variables[address].data : NULL;
+}
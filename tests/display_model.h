@@ -0,0 +1,77 @@
+// In-process Smart Display for the tests: answers variable frames and the
+// project/firmware update dialogue like tools/display_simulator, on the
+// simulated time of the test, with faults injected from a seeded generator.
+
+#ifndef DISPLAY_MODEL_H_
+#define DISPLAY_MODEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Returned by display_model_get_byte when nothing is due, same value as DATA_NULL.
+#define DISPLAY_MODEL_NO_BYTE 0xFFFF
+#define DISPLAY_MODEL_MAX_IMAGE_SIZE (512 * 1024)
+
+// Update extensions, for display_model_config_t.refused and .unanswered.
+#define DISPLAY_MODEL_DELTA 0x01
+#define DISPLAY_MODEL_COMPRESSION 0x02
+#define DISPLAY_MODEL_RESUME 0x04
+#define DISPLAY_MODEL_MULTIPLEX 0x08
+
+typedef struct {
+  uint32_t max_block_length;        // largest BLOCK LENGTH accepted, 1024 to 65536
+  uint32_t loss_percent;            // commands and blocks dropped without an answer
+  uint32_t corruption_percent;      // blocks with a flipped bit, answered NOT OK
+  uint32_t answer_latency_ms;       // delay of every answer, at least 1
+  uint32_t block_answer_jitter_ms;  // extra delay, up to this, of the answers to NEW BLOCK and to blocks
+  uint32_t ack_latency_ms;          // extra delay of every ACK, and of the answers queued after it
+  uint32_t finish_latency_ms;       // extra delay of the answer to FINISHED, while the image is stored
+  uint32_t emit_period_ms;          // 0, or how often the display sends emit_address on its own
+  uint16_t emit_address;
+  uint32_t emit_count;              // 0, or how many frames the display sends on its own in all
+  uint32_t truncated_emits;         // the first frames it sends on its own lose their END_FLAG
+  uint32_t refused;                 // extensions answered "RECEIVED NOT OK A"
+  uint32_t unanswered;              // extensions ignored, like an older display does
+  uint32_t seed;
+} display_model_config_t;
+
+typedef struct {
+  uint32_t commands;
+  uint32_t updates;
+  uint32_t blocks_ok;
+  uint32_t blocks_not_ok;
+  uint32_t blocks_given_up;   // blocks left incomplete, then abandoned
+  uint32_t lost;              // commands and blocks dropped
+  uint32_t corrupted;
+  uint32_t finished;          // updates completed by FINISHED
+  uint32_t frames_in;
+  uint32_t frames_emitted;
+  uint32_t writes;
+  uint32_t block_length;      // block length of the current or last update
+  uint32_t manifests;         // delta manifests accepted
+  uint32_t blocks_kept;       // unchanged blocks taken from the previous image
+  uint32_t packed_blocks;     // LZSS blocks unpacked and accepted
+  uint32_t resumes;           // RESUME BLOCK answered with the blocks kept
+  uint32_t resumed_blocks;    // blocks the last resumed update continued after
+  uint32_t multiplexes;       // MULTIPLEX A accepted
+  uint32_t images_rejected;   // FINISHED CRC answered NOT OK, the previous image kept
+} display_model_statistics_t;
+
+// Forgets everything, finished images included, and applies config (NULL for no faults).
+void display_model_reset(const display_model_config_t *config);
+void display_model_set_time(uint32_t now_in_ms);
+void display_model_receive(const uint8_t *data, uint32_t length);
+// Keeps only the first quantity_of_blocks blocks of the update in progress, as a display
+// that lost power before storing the others would.
+void display_model_drop_blocks(uint32_t quantity_of_blocks);
+uint16_t display_model_get_byte();
+
+// Image kept by the last FINISHED, padding included.
+const uint8_t *display_model_image(uint32_t *length);
+const display_model_statistics_t *display_model_statistics();
+// Bitmap of the last delta manifest accepted, one bit per changed block.
+const uint8_t *display_model_manifest(uint32_t *quantity_of_blocks);
+// Value of a variable written by the host, NULL if never written.
+const uint8_t *display_model_variable(uint16_t address, uint32_t *length);
+
+#endif /* DISPLAY_MODEL_H_ */
@@ -0,0 +1,76 @@
+#!/bin/sh
+# Builds and runs the behaviour checks once per configuration below.
+# A configuration is a list of NAME=VALUE overrides of LumenProtocolConfiguration.h.
+
+set -e
+cd "$(dirname "$0")"
+
+SOURCE=../src/c
+BUILD=build
+failed=0
+
+# configure <directory> [NAME=VALUE ...]
+configure() {
+  directory=$1
+  shift
+  mkdir -p "$directory"
+  cp "$SOURCE/LumenProtocol.c" "$SOURCE/LumenProtocol.h" "$directory"
+  cp "$SOURCE/LumenProtocolConfiguration.h" "$directory/LumenProtocolConfiguration.h"
+  for override in "$@"; do
+    sed -i "s/^#define ${override%%=*} .*/#define ${override%%=*} ${override#*=}/" "$directory/LumenProtocolConfiguration.h"
+  done
+}
+
+# run_update_tests <name> [NAME=VALUE ...]
+run_update_tests() {
+  name=$1
+  shift
+  directory="$BUILD/$name"
+  configure "$directory" "$@"
+
+  ${CC:-cc} -O1 -g -c "$directory/LumenProtocol.c" -o "$directory/LumenProtocol.o"
+  ${CC:-cc} -O1 -g -Wall -Wextra -I"$directory" update_tests.c display_model.c "$directory/LumenProtocol.o" \
+    -lpthread -o "$directory/update_tests"
+
+  echo "== $name"
+  "$directory/update_tests" || failed=1
+}
+
+# run_stress_test <source> [NAME=VALUE ...]
+# Built with ThreadSanitizer, which makes the test fail on any data race it sees.
+run_stress_test() {
+  name=$(basename "$1" .c)
+  source=$1
+  shift
+  directory="$BUILD/$name"
+  configure "$directory" "$@"
+
+  ${CC:-cc} -O1 -g -fsanitize=thread -c "$directory/LumenProtocol.c" -o "$directory/LumenProtocol.o"
+  ${CC:-cc} -O1 -g -fsanitize=thread -Wall -Wextra -I"$directory" "$source" "$directory/LumenProtocol.o" \
+    -lpthread -o "$directory/$name"
+
+  echo "== $name"
+  "$directory/$name" || failed=1
+}
+
+run_update_tests default
+run_update_tests crc_ack USE_CRC=true USE_ACK=true
+run_update_tests pipelining USE_PROJECT_UPDATE_PIPELINING=true
+run_update_tests pipelining_4096 USE_PROJECT_UPDATE_PIPELINING=true PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH=4096
+run_update_tests clock USE_CLOCK=true USE_PROJECT_UPDATE_PIPELINING=true
+run_update_tests resume USE_PROJECT_UPDATE_RESUME=true
+run_update_tests resume_4096 USE_PROJECT_UPDATE_RESUME=true USE_PROJECT_UPDATE_PIPELINING=true PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH=4096
+run_update_tests resume_delta USE_PROJECT_UPDATE_RESUME=true USE_PROJECT_UPDATE_DELTA=true
+run_update_tests delta USE_PROJECT_UPDATE_DELTA=true
+run_update_tests delta_crc_ack USE_CRC=true USE_ACK=true USE_PROJECT_UPDATE_DELTA=true PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH=4096
+run_update_tests multiplexing USE_PROJECT_UPDATE_MULTIPLEXING=true
+run_update_tests multiplexing_crc_ack USE_PROJECT_UPDATE_MULTIPLEXING=true USE_CRC=true USE_ACK=true
+run_update_tests compression USE_PROJECT_UPDATE_COMPRESSION=true
+run_update_tests compression_4096 USE_PROJECT_UPDATE_COMPRESSION=true USE_PROJECT_UPDATE_PIPELINING=true PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH=4096
+run_update_tests parallel_crc USE_PROJECT_UPDATE_FROM_FILE=true USE_PROJECT_UPDATE_PARALLEL_CRC=true
+run_update_tests fleet USE_PROJECT_UPDATE_FROM_FILE=true USE_PROJECT_UPDATE_FLEET=true PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH=4096
+
+run_stress_test rx_ring_stress.c USE_RX_RING=true USE_CRC=true
+run_stress_test tx_queue_stress.c USE_TX_QUEUE=true TX_QUEUE_SIZE=16
+
+exit $failed
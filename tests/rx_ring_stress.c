@@ -0,0 +1,125 @@
+// Stress check of USE_RX_RING, meant to run under ThreadSanitizer (see run_tests.sh):
+// a reader thread pushes kQuantityOfFrames frames into the ring in chunks of random
+// size while the library thread parses them with lumen_poll. Every frame must arrive
+// once, in order, with a valid CRC, and ThreadSanitizer must report no race.
+
+#include "LumenProtocol.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define kQuantityOfFrames 200000
+#define kMaxChunkLength 40
+
+static uint8_t _stream[kQuantityOfFrames * 20];
+static uint32_t _streamLength = 0;
+static int _producerDone = 0;
+
+void lumen_write_bytes(uint8_t *data, uint32_t length) {
+  (void)data;
+  (void)length;
+}
+
+static void put_escaped(uint8_t data) {
+  if (data == START_FLAG || data == END_FLAG || data == ESCAPE_FLAG) {
+    _stream[_streamLength++] = ESCAPE_FLAG;
+    _stream[_streamLength++] = data ^ XOR_FLAG;
+  } else {
+    _stream[_streamLength++] = data;
+  }
+}
+
+#if USE_CRC
+static uint16_t calculate_crc(const uint8_t *data, uint32_t length) {
+  uint16_t crc = 0xFFFF;
+
+  for (uint32_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+  }
+  return crc;
+}
+#endif
+
+// Frame k is a READ_FLAG frame of a 32-bit value k, as the display sends it.
+static void build_stream() {
+  for (uint32_t k = 0; k < kQuantityOfFrames; ++k) {
+    uint8_t raw[] = { READ_FLAG, k & 0xFF, (k >> 8) & 0x03, k & 0xFF, (k >> 8) & 0xFF, (k >> 16) & 0xFF, 0 };
+
+    _stream[_streamLength++] = START_FLAG;
+    _stream[_streamLength++] = READ_FLAG;
+    for (uint32_t i = 1; i < sizeof(raw); ++i) {
+      put_escaped(raw[i]);
+    }
+#if USE_CRC
+    uint16_t crc = calculate_crc(raw, sizeof(raw));
+    put_escaped(crc >> 8);
+    put_escaped(crc & 0xFF);
+#endif
+    _stream[_streamLength++] = END_FLAG;
+  }
+}
+
+// A full ring stores part of a chunk: the rest is pushed again, as a UART driver would.
+static void *producer(void *argument) {
+  unsigned int seed = 1;
+  uint32_t index = 0;
+
+  (void)argument;
+  while (index < _streamLength) {
+    uint32_t length = 1 + rand_r(&seed) % kMaxChunkLength;
+    uint32_t pushed;
+
+    if (length > _streamLength - index) {
+      length = _streamLength - index;
+    }
+    pushed = lumen_rx_push(&_stream[index], length);
+    if (pushed == 0) {
+      sched_yield();
+    }
+    index += pushed;
+  }
+  __atomic_store_n(&_producerDone, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int main() {
+  pthread_t thread;
+  uint32_t received = 0;
+  uint32_t outOfOrder = 0;
+  uint32_t expected = 0;
+  lumen_packet_t *packet;
+
+  build_stream();
+  if (pthread_create(&thread, NULL, producer, NULL) != 0) {
+    fprintf(stderr, "cannot start the producer thread\n");
+    return 1;
+  }
+
+  for (;;) {
+    bool done = __atomic_load_n(&_producerDone, __ATOMIC_ACQUIRE);
+
+    // Few bytes per call, so the packet queue never overflows between two reads.
+    if (lumen_poll(64, 0) == 0) {
+      sched_yield();
+    }
+    while ((packet = lumen_get_first_packet()) != NULL) {
+      if ((packet->data._u32 & 0xFFFFFF) != expected) {
+        ++outOfOrder;
+      }
+      expected = (packet->data._u32 & 0xFFFFFF) + 1;
+      ++received;
+    }
+    if (done && (lumen_poll(0, 0) == 0)) {
+      break;
+    }
+  }
+  pthread_join(thread, NULL);
+
+  printf("frames %u of %u, out of order %u\n", received, kQuantityOfFrames, outOfOrder);
+  return ((received == kQuantityOfFrames) && (outOfOrder == 0)) ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+// Stress check of USE_TX_QUEUE, meant to run under ThreadSanitizer (see run_tests.sh):
+// kQuantityOfProducers threads enqueue kValuesPerProducer values each, retrying while
+// the queue is full, and the library thread drains them. The values of every producer
+// must be written once, in order, and ThreadSanitizer must report no race.
+
+#include "LumenProtocol.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#define kQuantityOfProducers 4
+#define kValuesPerProducer 20000
+
+// Next value expected from each producer, whose id is the address it writes.
+static uint32_t _nextValues[kQuantityOfProducers];
+static uint32_t _framesWritten = 0;
+static uint32_t _badFrames = 0;
+static int _producersDone = 0;
+
+uint16_t lumen_get_byte() {
+  return DATA_NULL;
+}
+
+// Called from the draining thread only: unescapes the frame and checks its value.
+void lumen_write_bytes(uint8_t *data, uint32_t length) {
+  uint8_t raw[64];
+  uint32_t rawLength = 0;
+  bool escaped = false;
+  uint16_t address;
+  uint32_t value;
+
+  for (uint32_t i = 1; (i + 1 < length) && (rawLength < sizeof(raw)); ++i) {
+    if (escaped) {
+      raw[rawLength++] = data[i] ^ XOR_FLAG;
+      escaped = false;
+    } else if (data[i] == ESCAPE_FLAG) {
+      escaped = true;
+    } else {
+      raw[rawLength++] = data[i];
+    }
+  }
+
+  ++_framesWritten;
+  if (rawLength < 3 + sizeof(value)) {
+    ++_badFrames;
+    return;
+  }
+  address = raw[1] | (raw[2] << 8);
+  memcpy(&value, &raw[3], sizeof(value));
+  if ((address >= kQuantityOfProducers) || (value != _nextValues[address])) {
+    ++_badFrames;
+    return;
+  }
+  ++_nextValues[address];
+}
+
+static void *producer(void *argument) {
+  uint16_t id = (uint16_t)(uintptr_t)argument;
+
+  for (uint32_t value = 0; value < kValuesPerProducer;) {
+    lumen_packet_t packet = { .address = id, .type = kU32, .data._u32 = value };
+
+    if (lumen_tx_enqueue(&packet)) {
+      ++value;
+    } else {
+      sched_yield();
+    }
+  }
+  __atomic_fetch_add(&_producersDone, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int main() {
+  pthread_t threads[kQuantityOfProducers];
+  bool complete = true;
+
+  for (uintptr_t i = 0; i < kQuantityOfProducers; ++i) {
+    if (pthread_create(&threads[i], NULL, producer, (void *)i) != 0) {
+      fprintf(stderr, "cannot start producer %u\n", (unsigned)i);
+      return 1;
+    }
+  }
+
+  for (;;) {
+    int done = __atomic_load_n(&_producersDone, __ATOMIC_ACQUIRE);
+
+    lumen_tx_drain(8);
+    sched_yield();
+    if ((done == kQuantityOfProducers) && (lumen_tx_drain(0) == 0)) {
+      break;
+    }
+  }
+  for (uint32_t i = 0; i < kQuantityOfProducers; ++i) {
+    pthread_join(threads[i], NULL);
+    complete = complete && (_nextValues[i] == kValuesPerProducer);
+  }
+
+  printf("frames %u of %u, bad %u\n", _framesWritten, kQuantityOfProducers * kValuesPerProducer, _badFrames);
+  return (complete && (_badFrames == 0) && (_framesWritten == kQuantityOfProducers * kValuesPerProducer)) ? 0 : 1;
+}
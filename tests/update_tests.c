@@ -0,0 +1,1002 @@
+// Behaviour checks of project/firmware updates against the in-process display
+// model, for the features enabled in LumenProtocolConfiguration.h. Every step
+// of the loop is one simulated millisecond, so the results do not depend on
+// the machine. See run_tests.sh for the configurations.
+
+#include "LumenProtocol.h"
+#include "display_model.h"
+
+#include <stdio.h>
+#if USE_PROJECT_UPDATE_FROM_FILE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define kTransferTimeLimitInMs (30 * 60 * 1000)
+
+static uint32_t _nowInMs = 0;
+static uint32_t _failures = 0;
+static uint8_t _imageBuffer[256 * 1024];
+static uint8_t _blockBuffer[PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH + 2];
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+      ++_failures; \
+    } \
+  } while (0)
+
+// While set, everything the host sends is lost on its way to the display.
+static bool _linkDown = false;
+
+void lumen_write_bytes(uint8_t *data, uint32_t length) {
+  if (!_linkDown) {
+    display_model_receive(data, length);
+  }
+}
+
+uint16_t lumen_get_byte() {
+  return display_model_get_byte();
+}
+
+#if USE_CLOCK
+uint32_t lumen_now_us() {
+  return _nowInMs * 1000;
+}
+#endif
+
+static void step() {
+  ++_nowInMs;
+  display_model_set_time(_nowInMs);
+  lumen_project_and_firmware_update_tick(1);
+}
+
+// Random bytes with runs of flag bytes and zeros, so escaping and CRCs are exercised.
+static void make_image(uint8_t *image, uint32_t length, uint32_t seed) {
+  uint32_t random = seed * 2654435761UL + 1;
+
+  for (uint32_t i = 0; i < length; ++i) {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    switch ((i / 256) % 4) {
+      case 1:
+        image[i] = START_FLAG + (random % 2);
+        break;
+      case 3:
+        image[i] = 0;
+        break;
+      default:
+        image[i] = (uint8_t)random;
+        break;
+    }
+  }
+}
+
+// Sends the image start to finish. Returns false if it takes longer than kTransferTimeLimitInMs.
+static bool send_image(uint8_t *image, uint32_t length) {
+  uint32_t startTime = _nowInMs;
+
+  while (!lumen_project_update_send_data(image, length)) {
+    if (_nowInMs - startTime > kTransferTimeLimitInMs) {
+      return false;
+    }
+    step();
+  }
+  while (!lumen_project_and_firmware_update_finish()) {
+    if (_nowInMs - startTime > kTransferTimeLimitInMs) {
+      return false;
+    }
+    step();
+  }
+  return true;
+}
+
+// The display must hold the image byte for byte, followed by the zeros of the last block.
+static bool display_has_image(const uint8_t *image, uint32_t length) {
+  uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+  uint32_t paddedLength = (length + blockLength - 1) / blockLength * blockLength;
+  uint32_t receivedLength;
+  const uint8_t *received = display_model_image(&receivedLength);
+
+  if ((receivedLength != paddedLength) || (memcmp(received, image, length) != 0)) {
+    return false;
+  }
+  for (uint32_t i = length; i < paddedLength; ++i) {
+    if (received[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_transfer() {
+  static const uint32_t lengths[] = { 1024, 40 * 1024 + 300, 100 * 1024 };
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+  for (uint32_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+    display_model_reset(&config);
+    make_image(_imageBuffer, lengths[i], i + 1);
+
+    CHECK(send_image(_imageBuffer, lengths[i]));
+    CHECK(display_has_image(_imageBuffer, lengths[i]));
+    CHECK(display_model_statistics()->block_length == PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH);
+    CHECK(display_model_statistics()->blocks_not_ok == 0);
+  }
+}
+
+// Commands and blocks are dropped or corrupted on their way to the display, the answers
+// to the pipelined command/block pairs are delayed, and the display's own frames
+// overtake them. Every image must still arrive intact.
+static void test_transfer_with_loss_and_reordering() {
+  const uint32_t length = 64 * 1024 + 777;
+  uint32_t lost = 0;
+  uint32_t refused = 0;
+
+  for (uint32_t seed = 1; seed <= 8; ++seed) {
+    display_model_config_t config = {
+      .max_block_length = 65536,
+      .loss_percent = 10,
+      .corruption_percent = 10,
+      .answer_latency_ms = 2,
+      .block_answer_jitter_ms = 200,
+      .emit_period_ms = 7,
+      .emit_address = 100,
+      .seed = seed
+    };
+
+    display_model_reset(&config);
+    make_image(_imageBuffer, length, seed);
+
+    CHECK(send_image(_imageBuffer, length));
+    CHECK(display_has_image(_imageBuffer, length));
+    lost += display_model_statistics()->lost;
+    refused += display_model_statistics()->blocks_not_ok;
+  }
+
+  // Otherwise the faults above were never injected.
+  CHECK(lost > 0);
+  CHECK(refused > 0);
+}
+
+#if USE_ACK
+#define kAckTestAddress 300
+
+static lumen_write_handle_t _ackedHandles[4];
+static uint32_t _quantityOfAcked = 0;
+static lumen_write_handle_t _failedHandle = LUMEN_INVALID_WRITE_HANDLE;
+
+static void record_acked_write(lumen_write_handle_t handle) {
+  if (_quantityOfAcked < sizeof(_ackedHandles) / sizeof(_ackedHandles[0])) {
+    _ackedHandles[_quantityOfAcked] = handle;
+  }
+  ++_quantityOfAcked;
+}
+
+static void record_failed_write(lumen_write_handle_t handle) {
+  _failedHandle = handle;
+}
+
+// The display answers every write 700 ms late, after the first retry, so the first write
+// gets two ACKs. The second one arrives once the next write, which never reaches the
+// display, holds the same slot: it must not be taken for that write's ACK.
+static void test_late_ack() {
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 1, .ack_latency_ms = 700, .seed = 1 };
+  uint32_t first = 1;
+  uint32_t second = 2;
+  lumen_write_handle_t firstHandle;
+  lumen_write_handle_t secondHandle = LUMEN_INVALID_WRITE_HANDLE;
+
+  display_model_reset(&config);
+  _quantityOfAcked = 0;
+  _failedHandle = LUMEN_INVALID_WRITE_HANDLE;
+  lumen_ack_set_callbacks(record_acked_write, record_failed_write);
+
+  CHECK(lumen_write(kAckTestAddress, (uint8_t *)&first, sizeof(first)) > 0);
+  firstHandle = lumen_ack_last_write_handle();
+  for (uint32_t i = 0; i < (QUANTITY_OF_RETRIES + 3) * ELAPSED_TIME_TO_RETRY; ++i) {
+    step();
+    lumen_ack_trigger(1);
+    lumen_available();
+    if ((_quantityOfAcked == 1) && (secondHandle == LUMEN_INVALID_WRITE_HANDLE)) {
+      _linkDown = true;
+      CHECK(lumen_write(kAckTestAddress, (uint8_t *)&second, sizeof(second)) > 0);
+      secondHandle = lumen_ack_last_write_handle();
+      // The same slot, a new generation.
+      CHECK((secondHandle & 0xFF) == (firstHandle & 0xFF));
+      CHECK(secondHandle != firstHandle);
+    }
+  }
+  _linkDown = false;
+  lumen_ack_set_callbacks(NULL, NULL);
+
+  CHECK(display_model_statistics()->writes == 2);
+  CHECK(_quantityOfAcked == 1);
+  CHECK(_ackedHandles[0] == firstHandle);
+  CHECK(_failedHandle == secondHandle);
+  CHECK(!lumen_ack_is_pending(secondHandle));
+}
+
+// With every retry slot waiting for its ACK, writes are refused: lumen_write_packet returns 0
+// and lumen_ack_last_write_handle no longer names the last write that went out.
+static void test_refused_write() {
+  lumen_packet_t packet = { .address = kAckTestAddress, .type = kU32, .data._u32 = 1 };
+
+  display_model_reset(NULL);
+  _linkDown = true;
+  _failedHandle = LUMEN_INVALID_WRITE_HANDLE;
+  lumen_ack_set_callbacks(NULL, record_failed_write);
+
+  while (lumen_ack_free_slots() > 0) {
+    CHECK(lumen_write_packet(&packet) == 1);
+  }
+  CHECK(lumen_ack_last_write_handle() != LUMEN_INVALID_WRITE_HANDLE);
+  CHECK(lumen_write_packet(&packet) == 0);
+  CHECK(lumen_ack_last_write_handle() == LUMEN_INVALID_WRITE_HANDLE);
+
+  // Let every write give up, so the next tests start with free slots.
+  for (uint32_t i = 0; i < (QUANTITY_OF_RETRIES + 2) * ELAPSED_TIME_TO_RETRY; ++i) {
+    step();
+    lumen_ack_trigger(1);
+  }
+  _linkDown = false;
+  lumen_ack_set_callbacks(NULL, NULL);
+  CHECK(lumen_ack_in_flight() == 0);
+  CHECK(_failedHandle != LUMEN_INVALID_WRITE_HANDLE);
+}
+#endif
+
+#if USE_PROJECT_UPDATE_FROM_FILE
+#define kFileImageLength (40 * 1024 + 300)
+
+// Rewrites the file in place, keeping its inode. A NULL modified keeps the current time.
+static bool write_file(const char *path, const uint8_t *image, uint32_t length, const struct timespec *modified) {
+  int file = open(path, O_WRONLY | O_TRUNC);
+  bool written;
+
+  if (file < 0) {
+    return false;
+  }
+  written = write(file, image, length) == (ssize_t)length;
+  if (written && (modified != NULL)) {
+    struct timespec times[2] = { *modified, *modified };
+    written = futimens(file, times) == 0;
+  }
+  close(file);
+  return written;
+}
+#endif
+
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+static bool send_file(const char *path) {
+  uint32_t startTime = _nowInMs;
+
+  while (!lumen_project_update_from_file(path)) {
+    if ((lumen_project_and_firmware_update_file_error() != 0) || (_nowInMs - startTime > kTransferTimeLimitInMs)) {
+      return false;
+    }
+    step();
+  }
+  while (!lumen_project_and_firmware_update_finish()) {
+    if (_nowInMs - startTime > kTransferTimeLimitInMs) {
+      return false;
+    }
+    step();
+  }
+  return true;
+}
+
+static bool send_file_and_check(const char *path, uint32_t seed) {
+  display_model_reset(NULL);
+  make_image(_imageBuffer, kFileImageLength, seed);
+  return send_file(path) && display_has_image(_imageBuffer, kFileImageLength) && (display_model_statistics()->blocks_not_ok == 0);
+}
+
+// The block CRCs of a file are reused while its device, inode, size and modification time
+// stay the same. Other bytes of the same size must get their own CRCs, also when they are
+// written in the same timestamp tick as the version the CRCs were computed for.
+static void test_file_crc_cache() {
+  char path[] = "/tmp/lumen_update_tests_XXXXXX";
+  int file = mkstemp(path);
+  struct timespec modified = { .tv_sec = 1500000000, .tv_nsec = 0 };
+  struct stat fileStat;
+
+  CHECK(file >= 0);
+  close(file);
+
+  make_image(_imageBuffer, kFileImageLength, 1);
+  CHECK(write_file(path, _imageBuffer, kFileImageLength, &modified));
+  CHECK(send_file_and_check(path, 1));
+  // Unchanged: the cached CRCs are used.
+  CHECK(send_file_and_check(path, 1));
+
+  modified.tv_sec += 60;
+  make_image(_imageBuffer, kFileImageLength, 2);
+  CHECK(write_file(path, _imageBuffer, kFileImageLength, &modified));
+  CHECK(send_file_and_check(path, 2));
+
+  make_image(_imageBuffer, kFileImageLength, 3);
+  CHECK(write_file(path, _imageBuffer, kFileImageLength, NULL));
+  CHECK(send_file_and_check(path, 3));
+  // Rewritten with the very same modification time as the version just sent.
+  CHECK(stat(path, &fileStat) == 0);
+  make_image(_imageBuffer, kFileImageLength, 4);
+  CHECK(write_file(path, _imageBuffer, kFileImageLength, &fileStat.st_mtim));
+  CHECK(send_file_and_check(path, 4));
+
+  unlink(path);
+}
+#endif
+
+#if USE_PROJECT_UPDATE_FLEET
+static uint8_t _fleetBlockBuffer[PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH + 2];
+
+static void model_link_write_bytes(void *context, uint8_t *data, uint32_t length) {
+  (void)context;
+  display_model_receive(data, length);
+}
+
+static uint16_t model_link_get_byte(void *context) {
+  (void)context;
+  return display_model_get_byte();
+}
+
+// A display that is switched off: every frame is lost and nothing ever comes back.
+static void dead_link_write_bytes(void *context, uint8_t *data, uint32_t length) {
+  (void)context;
+  (void)data;
+  (void)length;
+}
+
+static uint16_t dead_link_get_byte(void *context) {
+  (void)context;
+  return DATA_NULL;
+}
+
+static void fleet_step() {
+  ++_nowInMs;
+  display_model_set_time(_nowInMs);
+  lumen_fleet_update_tick(1);
+}
+
+// One display gets the file on a link with a buffer for the proposed block length, the
+// other never answers. The fleet transfer returns once that link has given up, and the
+// mapped file is refused to the library's own link and to another fleet file meanwhile.
+static void test_fleet_with_dead_link() {
+  char path[] = "/tmp/lumen_update_tests_XXXXXX";
+  int file = mkstemp(path);
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+  lumen_update_link_io_t modelLink = { model_link_write_bytes, model_link_get_byte, NULL };
+  lumen_update_link_io_t deadLink = { dead_link_write_bytes, dead_link_get_byte, NULL };
+  lumen_fleet_link_status_t status;
+  uint32_t startTime = _nowInMs;
+  uint32_t blockLength;
+  uint32_t receivedLength;
+  const uint8_t *received;
+  bool finished = false;
+
+  CHECK(file >= 0);
+  close(file);
+  display_model_reset(&config);
+  make_image(_imageBuffer, kFileImageLength, 1);
+  CHECK(write_file(path, _imageBuffer, kFileImageLength, NULL));
+
+  CHECK(lumen_fleet_update_add_link(&modelLink, _fleetBlockBuffer, sizeof(_fleetBlockBuffer)));
+  CHECK(lumen_fleet_update_add_link(&deadLink, NULL, 0));
+
+  CHECK(!lumen_fleet_project_update_from_file(path, false));
+  CHECK(!lumen_project_update_from_file(path));
+  CHECK(lumen_project_and_firmware_update_file_error() == EBUSY);
+  CHECK(!lumen_fleet_project_update_from_file(path, false));
+  CHECK(lumen_project_and_firmware_update_file_error() == 0);
+  CHECK(!lumen_fleet_project_update_from_file("/dev/null", false));
+  CHECK(lumen_project_and_firmware_update_file_error() == EBUSY);
+
+  while (!finished && (_nowInMs - startTime <= kTransferTimeLimitInMs)) {
+    fleet_step();
+    finished = lumen_fleet_project_update_from_file(path, false);
+  }
+  CHECK(finished);
+  CHECK(_nowInMs - startTime >= PROJECT_UPDATE_FLEET_LINK_TIMEOUT_IN_MS);
+
+  CHECK(lumen_fleet_update_link_status(0, &status));
+  CHECK(status.finished && !status.failed);
+  CHECK(lumen_fleet_update_link_status(1, &status));
+  CHECK(status.failed && !status.finished && (status.acknowledged_blocks == 0));
+
+  blockLength = display_model_statistics()->block_length;
+  received = display_model_image(&receivedLength);
+  CHECK(blockLength == PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH);
+  CHECK(receivedLength == (kFileImageLength + blockLength - 1) / blockLength * blockLength);
+  CHECK(memcmp(received, _imageBuffer, kFileImageLength) == 0);
+
+  lumen_fleet_update_clear_links();
+  unlink(path);
+}
+#endif
+
+#if USE_PROJECT_UPDATE_DELTA
+#define kDeltaImageLength (40 * 1024 + 300)
+#define kDeltaImageBlocks ((kDeltaImageLength + 1023) / 1024)
+
+static uint8_t _previousImage[kDeltaImageLength];
+static uint32_t _previousHashes[kDeltaImageBlocks];
+static uint8_t _manifest[LUMEN_DELTA_MANIFEST_SIZE(kDeltaImageLength)];
+
+// Sends a first image, then builds the manifest of a copy where blocks 3 and 17
+// and the partial last block changed. Returns the quantity of changed blocks.
+static uint32_t prepare_delta(uint32_t seed) {
+  uint32_t quantityOfHashes;
+
+  make_image(_previousImage, kDeltaImageLength, seed);
+  CHECK(send_image(_previousImage, kDeltaImageLength));
+  CHECK(display_has_image(_previousImage, kDeltaImageLength));
+
+  memcpy(_imageBuffer, _previousImage, kDeltaImageLength);
+  _imageBuffer[3 * 1024 + 5] ^= 0xFF;
+  _imageBuffer[17 * 1024] ^= 0x01;
+  _imageBuffer[kDeltaImageLength - 1] ^= 0x80;
+
+  quantityOfHashes = lumen_project_and_firmware_update_block_hashes(_previousImage, kDeltaImageLength, _previousHashes);
+  CHECK(quantityOfHashes == kDeltaImageLength / 1024);
+  return lumen_project_and_firmware_update_build_delta_manifest(_previousHashes, quantityOfHashes, _imageBuffer, kDeltaImageLength, _manifest);
+}
+
+static void test_delta() {
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+  uint32_t manifestBlocks;
+  const uint8_t *manifest;
+
+  display_model_reset(&config);
+  CHECK(prepare_delta(1) == 3);
+  CHECK(_manifest[0] == 0x08);
+  CHECK(_manifest[2] == 0x02);
+  CHECK(_manifest[5] == 0x01);
+
+  uint32_t blocksBefore = display_model_statistics()->blocks_ok;
+  lumen_project_and_firmware_update_set_delta_manifest(_manifest, kDeltaImageBlocks);
+  CHECK(send_image(_imageBuffer, kDeltaImageLength));
+  CHECK(display_has_image(_imageBuffer, kDeltaImageLength));
+
+  // The display checked the manifest CRC and holds the same bitmap.
+  manifest = display_model_manifest(&manifestBlocks);
+  CHECK(display_model_statistics()->manifests == 1);
+  CHECK(manifestBlocks == kDeltaImageBlocks);
+  CHECK(memcmp(manifest, _manifest, sizeof(_manifest)) == 0);
+  // Only the changed blocks went over the link.
+  CHECK(display_model_statistics()->blocks_ok - blocksBefore == 3);
+  CHECK(display_model_statistics()->blocks_kept == kDeltaImageBlocks - 3);
+  CHECK(!lumen_project_and_firmware_update_image_rejected());
+}
+
+// Comparing the blocks themselves finds the same changes as comparing their hashes.
+static void test_delta_manifest_from_image() {
+  uint8_t manifest[sizeof(_manifest)];
+
+  display_model_reset(NULL);
+  CHECK(prepare_delta(4) == 3);
+  CHECK(lumen_project_and_firmware_update_build_delta_manifest_from_image(_previousImage, kDeltaImageLength, _imageBuffer,
+                                                                           kDeltaImageLength, manifest) == 3);
+  CHECK(memcmp(manifest, _manifest, sizeof(_manifest)) == 0);
+}
+
+// A changed block left out of the manifest, as a hash collision would: the CRC sent with
+// FINISHED differs from the display's, which keeps its previous image.
+static void test_delta_image_rejected() {
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+  display_model_reset(&config);
+  prepare_delta(5);
+  _manifest[0] &= (uint8_t)~0x08;
+  lumen_project_and_firmware_update_set_delta_manifest(_manifest, kDeltaImageBlocks);
+  CHECK(send_image(_imageBuffer, kDeltaImageLength));
+  CHECK(lumen_project_and_firmware_update_image_rejected());
+  CHECK(display_model_statistics()->images_rejected == 1);
+  // Padded to the block length of its own transfer, which may differ from the delta's.
+  uint32_t keptLength;
+  const uint8_t *kept = display_model_image(&keptLength);
+  CHECK((keptLength >= kDeltaImageLength) && (memcmp(kept, _previousImage, kDeltaImageLength) == 0));
+
+  // Sent again whole, the image is accepted.
+  CHECK(send_image(_imageBuffer, kDeltaImageLength));
+  CHECK(!lumen_project_and_firmware_update_image_rejected());
+  CHECK(display_has_image(_imageBuffer, kDeltaImageLength));
+}
+
+// A display that refuses the manifest, or does not know the command, gets the whole image.
+static void test_delta_fallback() {
+  for (uint32_t unanswered = 0; unanswered <= 1; ++unanswered) {
+    display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+    if (unanswered) {
+      config.unanswered = DISPLAY_MODEL_DELTA;
+    } else {
+      config.refused = DISPLAY_MODEL_DELTA;
+    }
+    display_model_reset(&config);
+    prepare_delta(2);
+
+    uint32_t blocksBefore = display_model_statistics()->blocks_ok;
+    lumen_project_and_firmware_update_set_delta_manifest(_manifest, kDeltaImageBlocks);
+    CHECK(send_image(_imageBuffer, kDeltaImageLength));
+    CHECK(display_has_image(_imageBuffer, kDeltaImageLength));
+    CHECK(display_model_statistics()->manifests == 0);
+    CHECK(display_model_statistics()->blocks_ok - blocksBefore == kDeltaImageBlocks);
+  }
+}
+
+// The manifest describes one transfer: the next one, without a new manifest, sends every block.
+static void test_delta_manifest_cleared_by_finish() {
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+  display_model_reset(&config);
+  prepare_delta(3);
+  lumen_project_and_firmware_update_set_delta_manifest(_manifest, kDeltaImageBlocks);
+  CHECK(send_image(_imageBuffer, kDeltaImageLength));
+
+  uint32_t blocksBefore = display_model_statistics()->blocks_ok;
+  _imageBuffer[0] ^= 0xFF;
+  CHECK(send_image(_imageBuffer, kDeltaImageLength));
+  CHECK(display_has_image(_imageBuffer, kDeltaImageLength));
+  CHECK(display_model_statistics()->manifests == 1);
+  uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+  CHECK(display_model_statistics()->blocks_ok - blocksBefore == (kDeltaImageLength + blockLength - 1) / blockLength);
+}
+#endif
+
+#if USE_PROJECT_UPDATE_RESUME
+#define kResumeImageLength (40 * 1024 + 300)
+
+static lumen_update_resume_point_t _resumePoint;
+
+static void save_resume_point(const lumen_update_resume_point_t *resume_point) {
+  _resumePoint = *resume_point;
+}
+
+// Sends the image until half of its blocks are acknowledged, then abandons the transfer
+// as a host that restarts would. Returns the blocks acknowledged.
+static uint32_t interrupt_transfer(uint32_t seed) {
+  uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+  uint32_t startTime = _nowInMs;
+
+  make_image(_imageBuffer, kResumeImageLength, seed);
+  memset(&_resumePoint, 0, sizeof(_resumePoint));
+  while (_resumePoint.acknowledged_blocks * blockLength < kResumeImageLength / 2) {
+    if (lumen_project_update_send_data(_imageBuffer, kResumeImageLength) || (_nowInMs - startTime > kTransferTimeLimitInMs)) {
+      break;
+    }
+    step();
+    blockLength = lumen_project_and_firmware_update_block_length();
+  }
+  lumen_project_and_firmware_update_abort();
+  return _resumePoint.acknowledged_blocks;
+}
+
+// The display keeps every block: the transfer continues after the blocks the host saw acknowledged.
+static void test_resume() {
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+  display_model_reset(&config);
+  uint32_t acknowledged = interrupt_transfer(1);
+  CHECK(acknowledged > 0);
+
+  uint32_t blocksBefore = display_model_statistics()->blocks_ok;
+  lumen_project_and_firmware_update_resume_from(&_resumePoint);
+  CHECK(send_image(_imageBuffer, kResumeImageLength));
+  CHECK(display_has_image(_imageBuffer, kResumeImageLength));
+  uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+  CHECK(display_model_statistics()->resumes == 1);
+  CHECK(display_model_statistics()->resumed_blocks == acknowledged);
+  CHECK(display_model_statistics()->blocks_ok - blocksBefore == (kResumeImageLength + blockLength - 1) / blockLength - acknowledged);
+}
+
+// The display lost blocks the host saw acknowledged: it reports fewer, and the transfer continues after those.
+static void test_resume_from_fewer_blocks() {
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+  display_model_reset(&config);
+  uint32_t acknowledged = interrupt_transfer(2);
+  CHECK(acknowledged > 1);
+  display_model_drop_blocks(acknowledged / 2);
+
+  lumen_project_and_firmware_update_resume_from(&_resumePoint);
+  CHECK(send_image(_imageBuffer, kResumeImageLength));
+  CHECK(display_has_image(_imageBuffer, kResumeImageLength));
+  CHECK(display_model_statistics()->resumed_blocks == acknowledged / 2);
+}
+
+// The resume point names another image: the host does not ask the display to resume it.
+static void test_resume_other_image() {
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+  display_model_reset(&config);
+  uint32_t acknowledged = interrupt_transfer(5);
+  CHECK(acknowledged > 0);
+  CHECK(_resumePoint.image_hash == lumen_project_and_firmware_update_image_hash(_imageBuffer, acknowledged * _resumePoint.block_length, LUMEN_IMAGE_HASH_SEED));
+
+  uint32_t blocksBefore = display_model_statistics()->blocks_ok;
+  lumen_project_and_firmware_update_resume_from(&_resumePoint);
+  make_image(_imageBuffer, kResumeImageLength, 6);
+  CHECK(send_image(_imageBuffer, kResumeImageLength));
+  CHECK(display_has_image(_imageBuffer, kResumeImageLength));
+  uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+  CHECK(display_model_statistics()->resumes == 0);
+  CHECK(display_model_statistics()->blocks_ok - blocksBefore == (kResumeImageLength + blockLength - 1) / blockLength);
+}
+
+// A display that refuses to resume, or does not know the command, gets the whole image.
+static void test_resume_fallback() {
+  for (uint32_t unanswered = 0; unanswered <= 1; ++unanswered) {
+    display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+    if (unanswered) {
+      config.unanswered = DISPLAY_MODEL_RESUME;
+    } else {
+      config.refused = DISPLAY_MODEL_RESUME;
+    }
+    display_model_reset(&config);
+    interrupt_transfer(3 + unanswered);
+
+    uint32_t blocksBefore = display_model_statistics()->blocks_ok;
+    lumen_project_and_firmware_update_resume_from(&_resumePoint);
+    CHECK(send_image(_imageBuffer, kResumeImageLength));
+    CHECK(display_has_image(_imageBuffer, kResumeImageLength));
+    uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+    CHECK(display_model_statistics()->resumes == 0);
+    CHECK(display_model_statistics()->blocks_ok - blocksBefore == (kResumeImageLength + blockLength - 1) / blockLength);
+  }
+}
+#endif
+
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+#define kWriteAddress 200
+#define kWritePeriodInMs 10
+
+static uint32_t _writesSent = 0;
+static uint32_t _lastValueWritten = 0;
+static uint32_t _framesRead = 0;
+#if USE_ACK
+static uint32_t _writesFailed = 0;
+
+static void count_failed_write(lumen_write_handle_t handle) {
+  (void)handle;
+  ++_writesFailed;
+}
+#endif
+
+// What an application does while multiplexed: writes a variable every kWritePeriodInMs
+// and reads the frames the display sends on its own.
+static void use_variables() {
+#if USE_ACK
+  lumen_ack_trigger(1);
+#endif
+  if (!lumen_project_and_firmware_update_is_multiplexed()) {
+    return;
+  }
+  if (_nowInMs % kWritePeriodInMs == 0) {
+    uint32_t value = _writesSent + 1;
+    // Refused while the queue is full, or with USE_ACK while every slot waits for its ACK.
+    if (lumen_write(kWriteAddress, (uint8_t *)&value, sizeof(value)) > 0) {
+      ++_writesSent;
+      _lastValueWritten = value;
+    }
+  }
+  lumen_available();
+  while (lumen_get_first_packet() != NULL) {
+    ++_framesRead;
+  }
+}
+
+static bool send_image_using_variables(uint8_t *image, uint32_t length) {
+  uint32_t startTime = _nowInMs;
+
+  while (!lumen_project_update_send_data(image, length)) {
+    if (_nowInMs - startTime > kTransferTimeLimitInMs) {
+      return false;
+    }
+    step();
+    use_variables();
+  }
+  while (!lumen_project_and_firmware_update_finish()) {
+    if (_nowInMs - startTime > kTransferTimeLimitInMs) {
+      return false;
+    }
+    step();
+    use_variables();
+  }
+  return true;
+}
+
+// Variable frames go both ways between slow blocks. Every write reaches the display once:
+// a write left in the queue longer than ELAPSED_TIME_TO_RETRY is not sent again.
+static void test_multiplexing() {
+  const uint32_t length = 40 * 1024 + 300;
+  display_model_config_t config = {
+    .max_block_length = 65536,
+    .answer_latency_ms = 2,
+    .block_answer_jitter_ms = 600,
+    .emit_period_ms = 7,
+    .emit_address = 100,
+    .seed = 1
+  };
+  uint32_t valueLength;
+  const uint8_t *value;
+
+  display_model_reset(&config);
+  make_image(_imageBuffer, length, 1);
+  _writesSent = 0;
+  _framesRead = 0;
+#if USE_ACK
+  _writesFailed = 0;
+  lumen_ack_set_callbacks(NULL, count_failed_write);
+#endif
+
+  CHECK(send_image_using_variables(_imageBuffer, length));
+  CHECK(display_has_image(_imageBuffer, length));
+  CHECK(display_model_statistics()->multiplexes == 1);
+  CHECK(_writesSent > 0);
+  CHECK(_framesRead > 0);
+  CHECK(display_model_statistics()->writes == _writesSent);
+  value = display_model_variable(kWriteAddress, &valueLength);
+  CHECK((value != NULL) && (valueLength == 4) && (memcmp(value, &_lastValueWritten, 4) == 0));
+#if USE_ACK
+  CHECK(_writesFailed == 0);
+  lumen_ack_set_callbacks(NULL, NULL);
+#endif
+}
+
+// The only frame the display sends on its own, in the middle of the transfer, loses its
+// END_FLAG: the update answers after it must still reach the update.
+static void test_multiplexing_truncated_frame() {
+  const uint32_t length = 40 * 1024 + 300;
+  display_model_config_t config = {
+    .max_block_length = 65536,
+    .answer_latency_ms = 2,
+    .emit_period_ms = 400,
+    .emit_address = 100,
+    .emit_count = 1,
+    .truncated_emits = 1,
+    .seed = 1
+  };
+
+  display_model_reset(&config);
+  make_image(_imageBuffer, length, 2);
+
+  CHECK(send_image(_imageBuffer, length));
+  CHECK(display_has_image(_imageBuffer, length));
+  CHECK(display_model_statistics()->multiplexes == 1);
+  CHECK(display_model_statistics()->frames_emitted == 1);
+}
+
+// A slow answer to FINISHED: the frames the display sends meanwhile still reach the application.
+static void test_multiplexing_finish() {
+  const uint32_t length = 40 * 1024 + 300;
+  display_model_config_t config = {
+    .max_block_length = 65536,
+    .answer_latency_ms = 2,
+    .finish_latency_ms = 60,
+    .emit_period_ms = 3,
+    .emit_address = 100,
+    .seed = 1
+  };
+  uint32_t startTime = _nowInMs;
+
+  display_model_reset(&config);
+  make_image(_imageBuffer, length, 3);
+  _framesRead = 0;
+
+  while (!lumen_project_update_send_data(_imageBuffer, length) && (_nowInMs - startTime < kTransferTimeLimitInMs)) {
+    step();
+    use_variables();
+  }
+  uint32_t emittedBefore = display_model_statistics()->frames_emitted;
+  uint32_t readBefore = _framesRead;
+  while (!lumen_project_and_firmware_update_finish() && (_nowInMs - startTime < kTransferTimeLimitInMs)) {
+    step();
+    use_variables();
+  }
+  uint32_t emitted = display_model_statistics()->frames_emitted - emittedBefore;
+
+  CHECK(display_has_image(_imageBuffer, length));
+  CHECK(emitted >= 10);
+  // The frame emitted in the same millisecond as the answer may be read after it.
+  CHECK(_framesRead - readBefore + 1 >= emitted);
+}
+
+// The image arrives in small chunks, far apart: a write does not wait for the next block to go out.
+static void test_multiplexing_flush_on_tick() {
+  const uint32_t length = 8 * 1024;
+  const uint32_t chunkLength = 128;
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+  uint32_t writeTime = 0;
+  uint32_t arrivalTime = 0;
+  uint32_t value = 0x5A5A5A5A;
+  uint32_t valueLength;
+
+  display_model_reset(&config);
+  make_image(_imageBuffer, length, 4);
+
+  for (uint32_t offset = 0; offset < length; offset += chunkLength) {
+    while (!lumen_project_update_send_data(&_imageBuffer[offset], chunkLength)) {
+      step();
+    }
+    for (uint32_t i = 0; i < 10; ++i) {
+      step();
+      if ((writeTime == 0) && (offset >= length / 2) && lumen_project_and_firmware_update_is_multiplexed()) {
+        CHECK(lumen_write(kWriteAddress + 1, (uint8_t *)&value, sizeof(value)) > 0);
+        writeTime = _nowInMs;
+      }
+      if ((writeTime != 0) && (arrivalTime == 0) && (display_model_variable(kWriteAddress + 1, &valueLength) != NULL)) {
+        arrivalTime = _nowInMs;
+      }
+    }
+  }
+  while (!lumen_project_and_firmware_update_finish()) {
+    step();
+  }
+
+  CHECK(display_has_image(_imageBuffer, length));
+  CHECK((writeTime != 0) && (arrivalTime != 0));
+  CHECK(arrivalTime - writeTime <= 2);
+}
+#endif
+
+#if USE_PROJECT_UPDATE_COMPRESSION
+// Text-like bytes: words picked from a small dictionary, which LZSS packs well.
+static void make_compressible_image(uint8_t *image, uint32_t length, uint32_t seed) {
+  static const char *const words[] = { "lumen ", "display ", "widget ", "page ", "\x12\x13", "value ", "\0\0\0\0", "\x7D " };
+  uint32_t random = seed * 2654435761UL + 1;
+  uint32_t i = 0;
+
+  while (i < length) {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    const char *word = words[random % 8];
+    uint32_t wordLength = ((random % 8) == 6) ? 4 : (uint32_t)strlen(word);
+    for (uint32_t j = 0; (j < wordLength) && (i < length); ++j) {
+      image[i++] = (uint8_t)word[j];
+    }
+  }
+}
+
+// Compressible images arrive byte for byte at every block length the display accepts,
+// and every block goes packed.
+static void test_compression() {
+  static const uint32_t maxBlockLengths[] = { 1024, 65536 };
+  const uint32_t length = 64 * 1024 + 777;
+
+  for (uint32_t i = 0; i < sizeof(maxBlockLengths) / sizeof(maxBlockLengths[0]); ++i) {
+    display_model_config_t config = { .max_block_length = maxBlockLengths[i], .answer_latency_ms = 2, .seed = 1 };
+
+    display_model_reset(&config);
+    make_compressible_image(_imageBuffer, length, i + 1);
+
+    CHECK(send_image(_imageBuffer, length));
+    CHECK(display_has_image(_imageBuffer, length));
+    uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+    CHECK(blockLength == ((maxBlockLengths[i] < PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH) ? maxBlockLengths[i] : PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH));
+    CHECK(display_model_statistics()->packed_blocks == (length + blockLength - 1) / blockLength);
+    CHECK(display_model_statistics()->blocks_not_ok == 0);
+  }
+}
+
+// Lost and corrupted packed blocks are sent again, packed again.
+static void test_compression_with_loss() {
+  const uint32_t length = 64 * 1024 + 777;
+  uint32_t refused = 0;
+
+  for (uint32_t seed = 1; seed <= 4; ++seed) {
+    display_model_config_t config = {
+      .max_block_length = 65536,
+      .loss_percent = 10,
+      .corruption_percent = 10,
+      .answer_latency_ms = 2,
+      .block_answer_jitter_ms = 200,
+      .seed = seed
+    };
+
+    display_model_reset(&config);
+    make_compressible_image(_imageBuffer, length, seed);
+
+    CHECK(send_image(_imageBuffer, length));
+    CHECK(display_has_image(_imageBuffer, length));
+    CHECK(display_model_statistics()->packed_blocks > 0);
+    refused += display_model_statistics()->blocks_not_ok;
+  }
+  CHECK(refused > 0);
+}
+
+// A display that refuses LZSS, or does not know the command, gets plain blocks,
+// and so do blocks that packing would not shrink.
+static void test_compression_fallback() {
+  const uint32_t length = 40 * 1024 + 300;
+
+  for (uint32_t unanswered = 0; unanswered <= 1; ++unanswered) {
+    display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+
+    if (unanswered) {
+      config.unanswered = DISPLAY_MODEL_COMPRESSION;
+    } else {
+      config.refused = DISPLAY_MODEL_COMPRESSION;
+    }
+    display_model_reset(&config);
+    make_compressible_image(_imageBuffer, length, 5);
+
+    CHECK(send_image(_imageBuffer, length));
+    CHECK(display_has_image(_imageBuffer, length));
+    CHECK(display_model_statistics()->packed_blocks == 0);
+  }
+
+  display_model_config_t config = { .max_block_length = 65536, .answer_latency_ms = 2, .seed = 1 };
+  uint32_t random = 0x2545F491;
+
+  display_model_reset(&config);
+  for (uint32_t i = 0; i < length; ++i) {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    _imageBuffer[i] = (uint8_t)(random >> 24);
+  }
+  CHECK(send_image(_imageBuffer, length));
+  CHECK(display_has_image(_imageBuffer, length));
+  // Only the last block, padded with zeros, shrinks.
+  CHECK(display_model_statistics()->packed_blocks == 1);
+}
+#endif
+
+int main() {
+  printf("USE_CRC %d, USE_ACK %d, USE_CLOCK %d, pipelining %d, proposed block length %d, resume %d, delta %d, compression %d, "
+         "multiplexing %d, parallel crc %d, fleet %d\n",
+         USE_CRC, USE_ACK, USE_CLOCK, USE_PROJECT_UPDATE_PIPELINING, PROJECT_UPDATE_PROPOSED_BLOCK_LENGTH, USE_PROJECT_UPDATE_RESUME,
+         USE_PROJECT_UPDATE_DELTA, USE_PROJECT_UPDATE_COMPRESSION, USE_PROJECT_UPDATE_MULTIPLEXING, USE_PROJECT_UPDATE_PARALLEL_CRC,
+         USE_PROJECT_UPDATE_FLEET);
+
+  // The default block buffer only holds 1024 bytes blocks.
+  CHECK(lumen_project_and_firmware_update_set_block_buffer(_blockBuffer, sizeof(_blockBuffer)));
+
+  test_transfer();
+  test_transfer_with_loss_and_reordering();
+#if USE_ACK
+  test_late_ack();
+  test_refused_write();
+#endif
+#if USE_PROJECT_UPDATE_PARALLEL_CRC
+  test_file_crc_cache();
+#endif
+#if USE_PROJECT_UPDATE_FLEET
+  test_fleet_with_dead_link();
+#endif
+#if USE_PROJECT_UPDATE_RESUME
+  lumen_project_and_firmware_update_set_resume_callback(save_resume_point);
+  test_resume();
+  test_resume_from_fewer_blocks();
+  test_resume_other_image();
+  test_resume_fallback();
+#endif
+#if USE_PROJECT_UPDATE_DELTA
+  test_delta();
+  test_delta_manifest_from_image();
+  test_delta_image_rejected();
+  test_delta_fallback();
+  test_delta_manifest_cleared_by_finish();
+#endif
+#if USE_PROJECT_UPDATE_MULTIPLEXING
+  test_multiplexing();
+  test_multiplexing_truncated_frame();
+  test_multiplexing_finish();
+  test_multiplexing_flush_on_tick();
+#endif
+#if USE_PROJECT_UPDATE_COMPRESSION
+  test_compression();
+  test_compression_with_loss();
+  test_compression_fallback();
+#endif
+
+  printf("%s (%u failures)\n", (_failures == 0) ? "passed" : "FAILED", _failures);
+  return (_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,373 @@
+// Benchmarks of the library's hot paths: frame encoding, frame parsing, both
+// CRCs, LZSS packing of the sample projects and a whole project update against
+// an in-process display.
+//
+// Every build measures one USE_CRC x USE_ACK configuration, see run_benchmarks.sh.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "LumenProtocol.h"
+
+// Defined in lumen_benchmark_hooks.c, next to the library internals they reach.
+extern "C" {
+#if USE_CRC
+uint16_t lumen_benchmark_frame_crc(const uint8_t *data, uint32_t length);
+#endif
+#if USE_PROJECT_UPDATE
+uint16_t lumen_benchmark_update_crc(uint8_t *data, uint32_t length);
+#endif
+#if USE_PROJECT_UPDATE_COMPRESSION
+uint32_t lumen_benchmark_pack(const uint8_t *data, uint32_t length, uint8_t *out);
+#endif
+#if USE_ACK
+void lumen_benchmark_release_ack_slots();
+#endif
+}
+
+namespace {
+
+// Answers the update dialogue like a display that accepts every block, without
+// checking it, so the measurement is the host's alone. Compression is refused:
+// the update is measured with plain blocks, BM_Pack measures packing.
+class LoopbackDisplay {
+ public:
+  std::vector<uint8_t> replies;
+
+  void Receive(const uint8_t *data, uint32_t length);
+
+ private:
+  void Say(const char *message) {
+    replies.insert(replies.end(), message, message + strlen(message));
+  }
+
+  bool LineEndsWith(const char *text) const {
+    size_t length = strlen(text);
+    return (lineLength_ >= length) && (memcmp(&line_[lineLength_ - length], text, length) == 0);
+  }
+
+  char line_[32];
+  size_t lineLength_ = 0;
+  uint32_t blockRemaining_ = 0;
+};
+
+std::vector<uint8_t> *_input = nullptr;
+size_t _inputIndex = 0;
+uint64_t _bytesWritten = 0;
+LoopbackDisplay *_display = nullptr;
+
+void LoopbackDisplay::Receive(const uint8_t *data, uint32_t length) {
+  if (_inputIndex == replies.size()) {
+    replies.clear();
+    _inputIndex = 0;
+  }
+
+  for (uint32_t i = 0; i < length;) {
+    if (blockRemaining_ > 0) {
+      uint32_t count = (blockRemaining_ < length - i) ? blockRemaining_ : length - i;
+      blockRemaining_ -= count;
+      i += count;
+      if (blockRemaining_ == 0) {
+        Say("RECEIVED OK A");
+      }
+      continue;
+    }
+
+    if (lineLength_ == sizeof(line_)) {
+      memmove(line_, &line_[1], sizeof(line_) - 1);
+      --lineLength_;
+    }
+    line_[lineLength_++] = static_cast<char>(data[i++]);
+
+    if (LineEndsWith("NEW BLOCK A")) {
+      blockRemaining_ = lumen_project_and_firmware_update_block_length() + 2;
+    } else if (LineEndsWith("COMPRESSION LZSS A")) {
+      lineLength_ = 0;
+      Say("RECEIVED NOT OK A");
+      continue;
+    } else if (!LineEndsWith("UPDATE PROJECT A") && !LineEndsWith("FINISHED A")) {
+      continue;
+    }
+    lineLength_ = 0;
+    Say("RECEIVED OK A");
+  }
+}
+
+uint16_t Crc16(const uint8_t *data, size_t length) {
+  uint16_t crc = 0xFFFF;
+
+  for (size_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+void AppendEscaped(std::vector<uint8_t> &out, uint8_t data) {
+  if (data == START_FLAG || data == END_FLAG || data == ESCAPE_FLAG) {
+    out.push_back(ESCAPE_FLAG);
+    out.push_back(data ^ XOR_FLAG);
+  } else {
+    out.push_back(data);
+  }
+}
+
+// A frame as the display sends it: READ_FLAG, address, value, the ACK id with
+// USE_ACK and the CRC with USE_CRC.
+void AppendDisplayFrame(std::vector<uint8_t> &out, uint16_t address, const uint8_t *value, size_t length, uint8_t ackId) {
+  std::vector<uint8_t> raw = { READ_FLAG, static_cast<uint8_t>(address & 0xFF), static_cast<uint8_t>(address >> 8) };
+
+  raw.insert(raw.end(), value, value + length);
+#if USE_ACK
+  raw.push_back(ackId);
+  raw.push_back(0);
+#else
+  (void)ackId;
+#endif
+
+  out.push_back(START_FLAG);
+  out.push_back(raw[0]);
+  for (size_t i = 1; i < raw.size(); ++i) {
+    AppendEscaped(out, raw[i]);
+  }
+#if USE_CRC
+  uint16_t crc = Crc16(raw.data(), raw.size());
+  AppendEscaped(out, crc >> 8);
+  AppendEscaped(out, crc & 0xFF);
+#endif
+  out.push_back(END_FLAG);
+}
+
+// ns/frame, and MB/s from the bytes on the wire.
+void Report(benchmark::State &state, uint64_t frames, uint64_t bytes) {
+  state.SetBytesProcessed(static_cast<int64_t>(bytes));
+  state.counters["time/frame"] = benchmark::Counter(static_cast<double>(frames), benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+const char *const kTypeNames[] = { "bool", "char", "u8", "s8", "u16", "s16", "u32", "s32", "float", "double", "string" };
+
+void BM_Write(benchmark::State &state) {
+  lumen_packet_t packet = { 121, static_cast<lumen_data_type_t>(state.range(0)) };
+  uint64_t bytesBefore = _bytesWritten;
+
+  // Values without bytes that need escaping.
+  memset(&packet.data, 0x21, sizeof(packet.data));
+  strcpy(packet.data._string, "Lumen");
+
+  for (auto _ : state) {
+#if USE_ACK
+    if (lumen_ack_free_slots() == 0) {
+      state.PauseTiming();
+      lumen_benchmark_release_ack_slots();
+      state.ResumeTiming();
+    }
+#endif
+    lumen_write_packet(&packet);
+  }
+
+#if USE_ACK
+  lumen_benchmark_release_ack_slots();
+#endif
+  state.SetLabel(kTypeNames[state.range(0)]);
+  Report(state, state.iterations(), _bytesWritten - bytesBefore);
+}
+BENCHMARK(BM_Write)->DenseRange(kBool, kString);
+
+void BM_WriteVariableList(benchmark::State &state) {
+  std::vector<uint8_t> text(state.range(0), 'L');
+  uint64_t bytesBefore = _bytesWritten;
+
+  for (auto _ : state) {
+#if USE_ACK
+    if (lumen_ack_free_slots() == 0) {
+      state.PauseTiming();
+      lumen_benchmark_release_ack_slots();
+      state.ResumeTiming();
+    }
+#endif
+    lumen_write_variable_list(122, 7, text.data(), static_cast<uint32_t>(text.size()));
+  }
+
+#if USE_ACK
+  lumen_benchmark_release_ack_slots();
+#endif
+  Report(state, state.iterations(), _bytesWritten - bytesBefore);
+}
+BENCHMARK(BM_WriteVariableList)->Arg(8)->Arg(32)->Arg(MAX_STRING_SIZE - 1);
+
+// Parses 1 MiB of display frames with 4 bytes values. With range(0) set, every
+// value and ACK id needs escaping, which roughly doubles the bytes per frame.
+void BM_Available(benchmark::State &state) {
+  const bool escaped = state.range(0) != 0;
+  const uint8_t plainValue[] = { 0x01, 0x02, 0x03, 0x04 };
+  const uint8_t escapedValue[] = { START_FLAG, END_FLAG, ESCAPE_FLAG, START_FLAG };
+  std::vector<uint8_t> stream;
+  uint64_t frames = 0;
+
+  while (stream.size() < (1 << 20)) {
+    AppendDisplayFrame(stream, 100 + frames % QUANTITY_OF_PACKETS, escaped ? escapedValue : plainValue, 4,
+                       escaped ? END_FLAG : static_cast<uint8_t>(1 + frames % 16));
+    ++frames;
+  }
+
+  _input = &stream;
+  for (auto _ : state) {
+    _inputIndex = 0;
+    lumen_available();
+    while (lumen_get_first_packet() != NULL) {
+    }
+  }
+  _input = nullptr;
+
+  state.SetLabel(escaped ? "escaped" : "plain");
+  Report(state, frames * state.iterations(), stream.size() * state.iterations());
+}
+BENCHMARK(BM_Available)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+std::vector<uint8_t> MakeImage(size_t length) {
+  std::vector<uint8_t> image(length);
+  uint32_t seed = 0x12345678;
+
+  for (auto &data : image) {
+    seed = seed * 1664525 + 1013904223;
+    data = static_cast<uint8_t>(seed >> 24);
+  }
+  return image;
+}
+
+#if USE_CRC
+void BM_FrameCrc(benchmark::State &state) {
+  std::vector<uint8_t> data = MakeImage(state.range(0));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(lumen_benchmark_frame_crc(data.data(), static_cast<uint32_t>(data.size())));
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(data.size() * state.iterations()));
+}
+BENCHMARK(BM_FrameCrc)->Arg(8)->Arg(64)->Arg(4096);
+#endif
+
+#if USE_PROJECT_UPDATE
+void BM_UpdateCrc(benchmark::State &state) {
+  std::vector<uint8_t> data = MakeImage(state.range(0));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(lumen_benchmark_update_crc(data.data(), static_cast<uint32_t>(data.size())));
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(data.size() * state.iterations()));
+}
+BENCHMARK(BM_UpdateCrc)->Arg(1024)->Arg(4096)->Arg(65536);
+
+// A whole update of a range(0) bytes image, start to finish, every tick being 1 ms.
+// A frame here is an update block.
+void BM_UpdateLoopback(benchmark::State &state) {
+  std::vector<uint8_t> image = MakeImage(state.range(0));
+  LoopbackDisplay display;
+  uint64_t bytesBefore = _bytesWritten;
+
+  _display = &display;
+  _input = &display.replies;
+  _inputIndex = 0;
+
+  for (auto _ : state) {
+    while (!lumen_project_update_send_data(image.data(), static_cast<uint32_t>(image.size()))) {
+      lumen_project_and_firmware_update_tick(1);
+    }
+    while (!lumen_project_and_firmware_update_finish()) {
+      lumen_project_and_firmware_update_tick(1);
+    }
+  }
+
+  _display = nullptr;
+  _input = nullptr;
+
+  uint32_t blockLength = lumen_project_and_firmware_update_block_length();
+  Report(state, (image.size() + blockLength - 1) / blockLength * state.iterations(), _bytesWritten - bytesBefore);
+}
+BENCHMARK(BM_UpdateLoopback)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+#endif
+
+#if USE_PROJECT_UPDATE_COMPRESSION
+// The UnicView Studio projects of the examples, relative to tools/benchmark.
+const char *const kSampleProjects[][2] = {
+  { "chart_demo_c", "../../examples/chart_demo_c/UnicViewStudioProject/UnicViewStudioProject.uvs" },
+  { "project_transfer_demo_c", "../../examples/project_transfer_demo_c/UnicViewStudioProject/UnicViewStudioProject.uvs" },
+  { "scrollingpicker_edit_demo_c", "../../examples/scrollingpicker_edit_demo_c/UnicViewStudioProject/ScrollingpickerEditExample.uvs" },
+  { "simple_demo_c", "../../examples/simple_demo_c/UnicViewStudioProject/LumenProtocolExample.uvs" },
+};
+const uint32_t kPackBlockLength = 1024;
+
+// Packs a whole sample project block by block, the last block padded with zeros
+// as the update does. wire_bytes counts each block as it goes out: packed with
+// its length and CRC, or as is with its CRC when packing does not save bytes.
+// wire_ratio is wire_bytes over the project size. A frame here is a block.
+void BM_Pack(benchmark::State &state, const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> image((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::vector<uint8_t> out(kPackBlockLength);
+  uint64_t projectLength = image.size();
+  uint64_t wireBytes = 0;
+
+  if (image.empty()) {
+    state.SkipWithError("sample project not found, run from tools/benchmark");
+    return;
+  }
+  image.resize((image.size() + kPackBlockLength - 1) / kPackBlockLength * kPackBlockLength, 0);
+
+  for (auto _ : state) {
+    wireBytes = 0;
+    for (size_t offset = 0; offset < image.size(); offset += kPackBlockLength) {
+      uint32_t packedLength = lumen_benchmark_pack(&image[offset], kPackBlockLength, out.data());
+      wireBytes += (packedLength > 0) ? 2 + packedLength + 2 : kPackBlockLength + 2;
+    }
+  }
+
+  state.SetBytesProcessed(static_cast<int64_t>(image.size() * state.iterations()));
+  state.counters["time/frame"] = benchmark::Counter(static_cast<double>(image.size() / kPackBlockLength * state.iterations()),
+                                                    benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+  state.counters["project_bytes"] = static_cast<double>(projectLength);
+  state.counters["wire_bytes"] = static_cast<double>(wireBytes);
+  state.counters["wire_ratio"] = static_cast<double>(wireBytes) / static_cast<double>(projectLength);
+}
+#endif
+
+}  // namespace
+
+extern "C" void lumen_write_bytes(uint8_t *data, uint32_t length) {
+  _bytesWritten += length;
+  if (_display != nullptr) {
+    _display->Receive(data, length);
+  }
+}
+
+extern "C" uint16_t lumen_get_byte() {
+  if ((_input != nullptr) && (_inputIndex < _input->size())) {
+    return (*_input)[_inputIndex++];
+  }
+  return DATA_NULL;
+}
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::AddCustomContext("USE_CRC", USE_CRC ? "true" : "false");
+  benchmark::AddCustomContext("USE_ACK", USE_ACK ? "true" : "false");
+#if USE_PROJECT_UPDATE_COMPRESSION
+  for (const auto &project : kSampleProjects) {
+    benchmark::RegisterBenchmark((std::string("BM_Pack/") + project[0]).c_str(), BM_Pack, project[1])->Unit(benchmark::kMillisecond);
+  }
+#endif
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,40 @@
+// Builds the library together with the few entry points the benchmarks need
+// into its internals, so they are measured exactly as they are compiled.
+
+#include "LumenProtocol.c"
+
+#if USE_CRC
+uint16_t lumen_benchmark_frame_crc(const uint8_t *data, uint32_t length) {
+  _crc.value = 0xFFFF;
+  for (uint32_t i = 0; i < length; ++i) {
+    calculate_crc(data[i]);
+  }
+  return _crc.value;
+}
+#endif
+
+#if USE_PROJECT_UPDATE
+uint16_t lumen_benchmark_update_crc(uint8_t *data, uint32_t length) {
+  return lumen_project_update_calculate_crc(data, length).value;
+}
+#endif
+
+#if USE_PROJECT_UPDATE_COMPRESSION
+// Packs one block as lumen_update_pack_block does into out, which holds length bytes.
+// Returns the packed length, 0 when the block would be sent as is.
+uint32_t lumen_benchmark_pack(const uint8_t *data, uint32_t length, uint8_t *out) {
+  if ((length <= kPackedHeaderLength + 1) || (length > kPackMaxBlockLength)) {
+    return 0;
+  }
+  return lumen_update_pack(data, length, out, length - kPackedHeaderLength - 1);
+}
+#endif
+
+#if USE_ACK
+// Acknowledges every write in flight, as if the display had answered them all.
+void lumen_benchmark_release_ack_slots() {
+  for (uint8_t dataOutIndex = 1; dataOutIndex < QUANTITY_OF_DATABUFFER_FOR_RETRY; ++dataOutIndex) {
+    lumen_ack_resolve_slot(dataOutIndex, true);
+  }
+}
+#endif
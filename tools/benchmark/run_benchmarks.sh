@@ -0,0 +1,32 @@
+#!/bin/sh
+# Builds and runs the benchmarks once per USE_CRC x USE_ACK configuration.
+# Arguments are passed to every run, e.g. --benchmark_filter=BM_Available.
+# Needs Google Benchmark (libbenchmark-dev).
+
+set -e
+cd "$(dirname "$0")"
+
+SOURCE=../../src/c
+BUILD=build
+
+for crc in false true; do
+  for ack in false true; do
+    directory="$BUILD/crc_${crc}_ack_${ack}"
+    mkdir -p "$directory"
+    cp "$SOURCE/LumenProtocol.c" "$SOURCE/LumenProtocol.h" lumen_benchmark_hooks.c "$directory"
+    # Long enough strings for lumen_write_variable_list to be worth measuring,
+    # and the LZSS encoder for BM_Pack.
+    sed -e "s/^#define USE_CRC .*/#define USE_CRC $crc/" \
+        -e "s/^#define USE_ACK .*/#define USE_ACK $ack/" \
+        -e "s/^#define MAX_STRING_SIZE .*/#define MAX_STRING_SIZE 64/" \
+        -e "s/^#define USE_PROJECT_UPDATE_COMPRESSION .*/#define USE_PROJECT_UPDATE_COMPRESSION true/" \
+        "$SOURCE/LumenProtocolConfiguration.h" > "$directory/LumenProtocolConfiguration.h"
+
+    ${CC:-cc} -O2 -c "$directory/lumen_benchmark_hooks.c" -o "$directory/lumen_benchmark_hooks.o"
+    ${CXX:-c++} -O2 -std=c++17 -I"$directory" lumen_benchmark.cpp "$directory/lumen_benchmark_hooks.o" \
+      -lbenchmark -lpthread -o "$directory/lumen_benchmark"
+
+    echo "USE_CRC $crc, USE_ACK $ack"
+    "$directory/lumen_benchmark" "$@"
+  done
+done
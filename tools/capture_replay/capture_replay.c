@@ -0,0 +1,208 @@
+// Plays a USE_CAPTURE log back: every received chunk goes through the library's
+// parser again, either as fast as possible or with the original timing.
+
+#define _GNU_SOURCE
+
+#include "LumenProtocol.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  uint64_t records;
+  uint64_t bytes;
+} direction_statistics_t;
+
+static const uint8_t *_received = NULL;
+static uint32_t _receivedLength = 0;
+static uint32_t _receivedIndex = 0;
+static uint64_t _bytesWritten = 0;
+
+// While replaying, the library's answers (ACKs) go nowhere: only their size is kept.
+void lumen_write_bytes(uint8_t *data, uint32_t length) {
+  (void)data;
+  _bytesWritten += length;
+}
+
+uint16_t lumen_get_byte() {
+  if (_receivedIndex < _receivedLength) {
+    return _received[_receivedIndex++];
+  }
+  return DATA_NULL;
+}
+
+static uint64_t now_in_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static uint8_t *load_file(const char *path, uint32_t *length) {
+  FILE *file = fopen(path, "rb");
+  uint8_t *data;
+  long size;
+
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  data = malloc(size > 0 ? (size_t)size : 1);
+  if ((data == NULL) || (fread(data, 1, (size_t)size, file) != (size_t)size)) {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+  *length = (uint32_t)size;
+  return data;
+}
+
+static void dump_record(uint32_t time, uint8_t direction, const uint8_t *data, uint32_t length) {
+  printf("%10u us %s %5u:", time, (direction == LUMEN_CAPTURE_TX) ? "TX" : "RX", length);
+  for (uint32_t i = 0; i < length; ++i) {
+    if ((i > 0) && ((i % 32) == 0)) {
+      printf("\n                      ");
+    }
+    printf(" %02X", data[i]);
+  }
+  printf("\n");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options] <log>\n"
+          "  -t, --timing     keep the original time between records\n"
+          "  -n, --repeat N   play the log N times (default 1)\n"
+          "  -d, --dump       print every record\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    { "timing", no_argument, NULL, 't' },
+    { "repeat", required_argument, NULL, 'n' },
+    { "dump", no_argument, NULL, 'd' },
+    { NULL, 0, NULL, 0 }
+  };
+  bool keepTiming = false;
+  bool dump = false;
+  uint32_t repeat = 1;
+  int option;
+
+  while ((option = getopt_long(argc, argv, "tn:d", options, NULL)) != -1) {
+    switch (option) {
+      case 't':
+        keepTiming = true;
+        break;
+      case 'n':
+        repeat = (uint32_t)strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        dump = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  uint32_t logLength = 0;
+  uint8_t *log = load_file(argv[optind], &logLength);
+
+  if (log == NULL) {
+    fprintf(stderr, "cannot read %s\n", argv[optind]);
+    return 1;
+  }
+  if ((logLength < LUMEN_CAPTURE_LOG_HEADER_SIZE) || (memcmp(log, "LUMC", 4) != 0) || (log[4] != LUMEN_CAPTURE_LOG_VERSION)) {
+    fprintf(stderr, "%s is not a capture log\n", argv[optind]);
+    return 1;
+  }
+
+  // The parser only understands the log when it is built with the same framing.
+  bool logCrc = (log[5] & LUMEN_CAPTURE_LOG_CRC) != 0;
+  bool logAck = (log[5] & LUMEN_CAPTURE_LOG_ACK) != 0;
+  if ((logCrc != USE_CRC) || (logAck != USE_ACK)) {
+    fprintf(stderr, "warning: log captured with USE_CRC %s and USE_ACK %s, replaying with USE_CRC %s and USE_ACK %s\n",
+            logCrc ? "true" : "false", logAck ? "true" : "false", USE_CRC ? "true" : "false", USE_ACK ? "true" : "false");
+  }
+
+  direction_statistics_t statistics[2] = { { 0, 0 }, { 0, 0 } };
+  uint64_t packets = 0;
+  uint64_t startTime = now_in_us();
+
+  for (uint32_t pass = 0; pass < repeat; ++pass) {
+    uint64_t passStartTime = now_in_us();
+    uint64_t logTime = 0;
+    uint32_t previousTime = 0;
+    uint32_t position = LUMEN_CAPTURE_LOG_HEADER_SIZE;
+
+    while (position + LUMEN_CAPTURE_RECORD_HEADER_SIZE <= logLength) {
+      const uint8_t *record = &log[position];
+      uint32_t time = record[0] | (record[1] << 8) | (record[2] << 16) | ((uint32_t)record[3] << 24);
+      uint32_t length = record[4] | (record[5] << 8);
+      uint8_t direction = record[6];
+
+      if (position + LUMEN_CAPTURE_RECORD_HEADER_SIZE + length > logLength) {
+        fprintf(stderr, "log truncated at byte %u\n", position);
+        break;
+      }
+      position += LUMEN_CAPTURE_RECORD_HEADER_SIZE + length;
+
+      // Times are lumen_now_us readings: their differences stay right when the clock wraps.
+      if (statistics[LUMEN_CAPTURE_TX].records + statistics[LUMEN_CAPTURE_RX].records > 0) {
+        logTime += (uint32_t)(time - previousTime);
+      }
+      previousTime = time;
+
+      if (keepTiming) {
+        uint64_t now = now_in_us();
+        if (passStartTime + logTime > now) {
+          usleep((useconds_t)(passStartTime + logTime - now));
+        }
+      }
+      if (dump && (pass == 0)) {
+        dump_record(time, direction, &record[LUMEN_CAPTURE_RECORD_HEADER_SIZE], length);
+      }
+
+      direction = (direction == LUMEN_CAPTURE_TX) ? LUMEN_CAPTURE_TX : LUMEN_CAPTURE_RX;
+      ++statistics[direction].records;
+      statistics[direction].bytes += length;
+
+      if (direction == LUMEN_CAPTURE_RX) {
+        _received = &record[LUMEN_CAPTURE_RECORD_HEADER_SIZE];
+        _receivedLength = length;
+        _receivedIndex = 0;
+        lumen_available();
+        while (lumen_get_first_packet() != NULL) {
+          ++packets;
+        }
+      }
+    }
+  }
+
+  double elapsedInSeconds = (double)(now_in_us() - startTime) / 1000000.0;
+  if (elapsedInSeconds <= 0) {
+    elapsedInSeconds = 1e-6;
+  }
+
+  printf("TX: %llu records, %llu bytes\n", (unsigned long long)statistics[LUMEN_CAPTURE_TX].records,
+         (unsigned long long)statistics[LUMEN_CAPTURE_TX].bytes);
+  printf("RX: %llu records, %llu bytes, %llu packets parsed\n", (unsigned long long)statistics[LUMEN_CAPTURE_RX].records,
+         (unsigned long long)statistics[LUMEN_CAPTURE_RX].bytes, (unsigned long long)packets);
+  printf("library answers: %llu bytes\n", (unsigned long long)_bytesWritten);
+  printf("%.3f s, %.2f MB/s received, %.0f packets/s\n", elapsedInSeconds,
+         (double)statistics[LUMEN_CAPTURE_RX].bytes / elapsedInSeconds / 1000000.0, (double)packets / elapsedInSeconds);
+
+  free(log);
+  return 0;
+}
@@ -0,0 +1,984 @@
+// Virtual Smart Display: answers the Lumen protocol on a pseudo terminal, so
+// lumen_write, lumen_request, ACK retries and project/firmware updates can be
+// exercised and measured without hardware.
+
+#define _GNU_SOURCE
+
+#include "LumenProtocolConfiguration.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_VALUE_SIZE 64
+#define MAX_CHUNK_SIZE (2 * (MAX_VALUE_SIZE + 8))
+#define OUTPUT_QUEUE_SIZE 512
+#define MAX_EMITTERS 16
+#define MAX_LINE_SIZE 64
+#define MAX_BLOCK_LENGTH 65536
+#define DEFAULT_BLOCK_LENGTH 1024
+#define PACKED_HEADER_LENGTH 2
+#define CRC_LENGTH 2
+// A block left incomplete this long is given up, so a host that lost our OK and
+// announces the block again is heard (its retry interval is 1 s).
+#define BLOCK_TIMEOUT_IN_US 500000
+
+typedef struct {
+  uint64_t dueTimeInUs;
+  uint32_t length;
+  uint32_t written;
+  uint8_t data[MAX_CHUNK_SIZE];
+} chunk_t;
+
+typedef struct {
+  uint8_t length;
+  uint8_t data[MAX_VALUE_SIZE];
+} variable_t;
+
+typedef struct {
+  uint16_t address;
+  uint32_t periodInMs;
+  uint64_t nextTimeInUs;
+} emitter_t;
+
+typedef struct {
+  uint8_t *data;
+  uint32_t length;
+  uint32_t capacity;
+} image_t;
+
+typedef enum {
+  kReceivingText,
+  kReceivingFrame,
+  kReceivingBlock,
+  kReceivingPackedBlock,
+  kReceivingManifest
+} receive_state_t;
+
+typedef struct {
+  uint32_t framesIn;
+  uint32_t framesOut;
+  uint32_t writes;
+  uint32_t requests;
+  uint32_t acksOut;
+  uint32_t acksIn;
+  uint32_t crcErrors;
+  uint32_t commands;
+  uint32_t blocksOk;
+  uint32_t blocksNotOk;
+  uint32_t updates;
+  uint32_t lostIn;
+  uint32_t lostOut;
+  uint32_t corruptedIn;
+  uint32_t corruptedOut;
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+} statistics_t;
+
+// Options.
+static uint32_t _baudRate = 115200;
+static uint32_t _latencyInUs = 0;
+static double _lossRate = 0;
+static double _corruptionRate = 0;
+static bool _useCrc = false;
+static bool _useAck = false;
+static bool _verbose = false;
+static uint32_t _maxBlockLength = DEFAULT_BLOCK_LENGTH;
+static bool _refuseResume = false;
+static bool _refuseDelta = false;
+static bool _refuseCompression = false;
+static bool _refuseMultiplex = false;
+static const char *_imagePath = NULL;
+static const char *_linkPath = NULL;
+
+static volatile sig_atomic_t _running = 1;
+static int _master = -1;
+static uint32_t _byteTimeInUs = 0;
+static uint64_t _inputFreeTimeInUs = 0;
+static uint64_t _outputFreeTimeInUs = 0;
+static uint64_t _arrivalTimeInUs = 0;
+static uint64_t _lastByteTimeInUs = 0;
+static uint64_t _startTimeInUs = 0;
+static const char *_lastAnswer = NULL;
+
+static chunk_t _outputQueue[OUTPUT_QUEUE_SIZE];
+static uint32_t _outputHead = 0;
+static uint32_t _outputTail = 0;
+
+static variable_t _variables[65536];
+static emitter_t _emitters[MAX_EMITTERS];
+static uint32_t _quantityOfEmitters = 0;
+static uint8_t _emitSequence = 0;
+
+static receive_state_t _receiveState = kReceivingText;
+static bool _escaped = false;
+static uint8_t _frame[MAX_CHUNK_SIZE];
+static uint32_t _frameLength = 0;
+static bool _frameOverflow = false;
+static char _line[MAX_LINE_SIZE + 1];
+static uint32_t _lineLength = 0;
+
+// Update state: the image being received, the last complete one (the base of
+// delta transfers) and the block being received.
+static image_t _image;
+static image_t _previousImage;
+static uint32_t _partialLength = 0;
+static uint32_t _blockLength = DEFAULT_BLOCK_LENGTH;
+static uint8_t _block[MAX_BLOCK_LENGTH + PACKED_HEADER_LENGTH + CRC_LENGTH];
+static uint32_t _blockIndex = 0;
+static uint8_t _manifest[8192];
+static uint32_t _manifestBlocks = 0;
+static bool _delta = false;
+static uint32_t _deltaPosition = 0;
+// Answer to the last FINISHED with a CRC, repeated if the host sends it again.
+static bool _imageRejected = false;
+
+static statistics_t _statistics;
+
+static uint64_t now_in_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// With --verbose, logs an event with the milliseconds elapsed since the start.
+static void trace(const char *format, ...) {
+  va_list arguments;
+
+  if (!_verbose) {
+    return;
+  }
+  fprintf(stderr, "%10.3f ", (double)(now_in_us() - _startTimeInUs) / 1000.0);
+  va_start(arguments, format);
+  vfprintf(stderr, format, arguments);
+  va_end(arguments);
+  fputc('\n', stderr);
+}
+
+static bool chance(double rate) {
+  return (rate > 0) && ((double)rand() / ((double)RAND_MAX + 1.0) * 100.0 < rate);
+}
+
+static uint16_t calculate_crc(const uint8_t *data, uint32_t length) {
+  uint16_t crc = 0xFFFF;
+
+  for (uint32_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+// CRC-32 (IEEE 802.3, reflected) of the whole image, checked by "FINISHED CRC <n> A".
+static uint32_t calculate_image_crc(const uint8_t *data, uint32_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (uint32_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+    }
+  }
+  return ~crc;
+}
+
+static bool image_append(image_t *image, const uint8_t *data, uint32_t length) {
+  if (image->length + length > image->capacity) {
+    uint32_t capacity = image->capacity ? image->capacity : (1 << 20);
+    while (capacity < image->length + length) {
+      capacity *= 2;
+    }
+    uint8_t *grown = realloc(image->data, capacity);
+    if (grown == NULL) {
+      return false;
+    }
+    image->data = grown;
+    image->capacity = capacity;
+  }
+  memcpy(&image->data[image->length], data, length);
+  image->length += length;
+  return true;
+}
+
+// Output: every answer is a chunk due after the configured latency. A chunk is
+// handed to the pty once the emulated line has had time to carry all its bytes.
+
+static void output_queue(const uint8_t *data, uint32_t length) {
+  chunk_t *chunk;
+
+  if (((_outputTail + 1) % OUTPUT_QUEUE_SIZE) == _outputHead) {
+    fprintf(stderr, "output queue full, answer dropped\n");
+    return;
+  }
+  if (chance(_lossRate)) {
+    ++_statistics.lostOut;
+    return;
+  }
+  chunk = &_outputQueue[_outputTail];
+  memcpy(chunk->data, data, length);
+  chunk->length = length;
+  chunk->written = 0;
+  chunk->dueTimeInUs = _arrivalTimeInUs + _latencyInUs;
+  if (chance(_corruptionRate)) {
+    chunk->data[rand() % length] ^= (uint8_t)(1 << (rand() % 8));
+    ++_statistics.corruptedOut;
+  }
+  _outputTail = (_outputTail + 1) % OUTPUT_QUEUE_SIZE;
+}
+
+static void output_say(const char *message) {
+  _lastAnswer = message;
+  output_queue((const uint8_t *)message, (uint32_t)strlen(message));
+}
+
+static uint32_t frame_put(uint8_t *out, uint32_t index, uint8_t data) {
+  if (data == START_FLAG || data == END_FLAG || data == ESCAPE_FLAG) {
+    out[index++] = ESCAPE_FLAG;
+    out[index++] = data ^ XOR_FLAG;
+  } else {
+    out[index++] = data;
+  }
+  return index;
+}
+
+// Sends command, address and payload framed, escaped and, with --crc, followed by their CRC.
+static void output_frame(uint8_t command, uint16_t address, const uint8_t *payload, uint32_t length) {
+  uint8_t raw[MAX_VALUE_SIZE + 8];
+  uint8_t out[MAX_CHUNK_SIZE];
+  uint32_t rawLength = 0;
+  uint32_t outLength = 0;
+
+  raw[rawLength++] = command;
+  raw[rawLength++] = address & 0xFF;
+  raw[rawLength++] = address >> 8;
+  if (length > 0) {
+    memcpy(&raw[rawLength], payload, length);
+    rawLength += length;
+  }
+
+  out[outLength++] = START_FLAG;
+  out[outLength++] = command;
+  for (uint32_t i = 1; i < rawLength; ++i) {
+    outLength = frame_put(out, outLength, raw[i]);
+  }
+  if (_useCrc) {
+    uint16_t crc = calculate_crc(raw, rawLength);
+    outLength = frame_put(out, outLength, crc >> 8);
+    outLength = frame_put(out, outLength, crc & 0xFF);
+  }
+  out[outLength++] = END_FLAG;
+
+  ++_statistics.framesOut;
+  output_queue(out, outLength);
+}
+
+// Returns how long the loop may wait before the head chunk is due.
+static int output_service(uint64_t now) {
+  while (_outputHead != _outputTail) {
+    chunk_t *chunk = &_outputQueue[_outputHead];
+    uint64_t startTime = (chunk->dueTimeInUs > _outputFreeTimeInUs) ? chunk->dueTimeInUs : _outputFreeTimeInUs;
+    uint64_t doneTime = startTime + (uint64_t)chunk->length * _byteTimeInUs;
+
+    if (now < doneTime) {
+      return (int)((doneTime - now + 999) / 1000);
+    }
+
+    ssize_t written = write(_master, &chunk->data[chunk->written], chunk->length - chunk->written);
+    if (written < 0) {
+      // The host is not reading: keep the chunk and try again shortly.
+      return (errno == EAGAIN) ? 1 : -1;
+    }
+    chunk->written += (uint32_t)written;
+    if (chunk->written < chunk->length) {
+      return 1;
+    }
+    _statistics.bytesOut += chunk->length;
+    _outputFreeTimeInUs = doneTime;
+    _outputHead = (_outputHead + 1) % OUTPUT_QUEUE_SIZE;
+  }
+  return -1;
+}
+
+// Variable frames.
+
+static void handle_frame() {
+  uint32_t length = _frameLength;
+
+  ++_statistics.framesIn;
+  if (chance(_lossRate)) {
+    ++_statistics.lostIn;
+    return;
+  }
+  if (chance(_corruptionRate) && length > 0) {
+    _frame[rand() % length] ^= (uint8_t)(1 << (rand() % 8));
+    ++_statistics.corruptedIn;
+  }
+  if (_useCrc) {
+    if (length < 3 + CRC_LENGTH) {
+      ++_statistics.crcErrors;
+      return;
+    }
+    uint16_t crc = calculate_crc(_frame, length - CRC_LENGTH);
+    if (_frame[length - 2] != (crc >> 8) || _frame[length - 1] != (crc & 0xFF)) {
+      ++_statistics.crcErrors;
+      trace("> frame with bad CRC");
+      return;
+    }
+    length -= CRC_LENGTH;
+  }
+  if (length < 3) {
+    return;
+  }
+
+  uint8_t command = _frame[0];
+  uint16_t address = _frame[1] | (_frame[2] << 8);
+  uint8_t *payload = &_frame[3];
+  uint32_t payloadLength = length - 3;
+
+  if (command == WRITE_FLAG) {
+    uint16_t id = 0;
+
+    if (_useAck) {
+      if (payloadLength < 2) {
+        return;
+      }
+      payloadLength -= 2;
+      // Slot, then its generation: the ACK echoes both.
+      id = payload[payloadLength] | (payload[payloadLength + 1] << 8);
+    }
+    if (payloadLength > MAX_VALUE_SIZE) {
+      payloadLength = MAX_VALUE_SIZE;
+    }
+    memcpy(_variables[address].data, payload, payloadLength);
+    _variables[address].length = (uint8_t)payloadLength;
+    ++_statistics.writes;
+    trace("> write %u (%u bytes)", address, payloadLength);
+    if (_useAck) {
+      ++_statistics.acksOut;
+      output_frame(ACK_FLAG, id, NULL, 0);
+    }
+  } else if (command == READ_FLAG) {
+    variable_t *variable = &_variables[address];
+    uint8_t zero[4] = { 0 };
+
+    ++_statistics.requests;
+    trace("> request %u", address);
+    // Answers to lumen_request carry no ACK id: the host neither strips nor acknowledges them.
+    if (variable->length > 0) {
+      output_frame(READ_FLAG, address, variable->data, variable->length);
+    } else {
+      output_frame(READ_FLAG, address, zero, sizeof(zero));
+    }
+  } else if (command == ACK_FLAG) {
+    ++_statistics.acksIn;
+  }
+}
+
+static void emit_variable(emitter_t *emitter) {
+  variable_t *variable = &_variables[emitter->address];
+  uint8_t payload[MAX_VALUE_SIZE + 2] = { 0 };
+  uint32_t length = (variable->length > 0) ? variable->length : 4;
+
+  memcpy(payload, variable->data, variable->length);
+  if (_useAck) {
+    // Ids 1 to 16 never need escaping.
+    _emitSequence = (uint8_t)((_emitSequence % 16) + 1);
+    payload[length++] = _emitSequence;
+    payload[length++] = 0;
+  }
+  output_frame(READ_FLAG, emitter->address, payload, length);
+}
+
+// Update dialogue.
+
+static bool line_ends_with(const char *text) {
+  uint32_t length = (uint32_t)strlen(text);
+  return (_lineLength >= length) && (memcmp(&_line[_lineLength - length], text, length) == 0);
+}
+
+// Matches "<prefix><number> A" at the start of the line.
+static bool line_number_command(const char *prefix, uint32_t *number) {
+  uint32_t length = (uint32_t)strlen(prefix);
+
+  if (!line_ends_with(" A") || (_lineLength <= length) || (strncmp(_line, prefix, length) != 0)) {
+    return false;
+  }
+  *number = (uint32_t)strtoul(&_line[length], NULL, 10);
+  return true;
+}
+
+// Unchanged blocks of a delta transfer are copied from the previous image.
+static void delta_advance() {
+  if (!_delta) {
+    return;
+  }
+  while ((_deltaPosition < _manifestBlocks) && !(_manifest[_deltaPosition / 8] & (1 << (_deltaPosition % 8)))) {
+    uint32_t offset = _deltaPosition * _blockLength;
+    uint32_t length = _blockLength;
+
+    if (offset >= _previousImage.length) {
+      length = 0;
+    } else if (offset + length > _previousImage.length) {
+      length = _previousImage.length - offset;
+    }
+    image_append(&_image, &_previousImage.data[offset], length);
+    ++_deltaPosition;
+  }
+}
+
+static void accept_block(const uint8_t *data, uint32_t length) {
+  delta_advance();
+  image_append(&_image, data, length);
+  ++_deltaPosition;
+  ++_statistics.blocksOk;
+  output_say("RECEIVED OK A");
+  trace("> block %u: RECEIVED OK A", _deltaPosition);
+}
+
+static void refuse_block() {
+  ++_statistics.blocksNotOk;
+  output_say("RECEIVED NOT OK A");
+  trace("> block %u: RECEIVED NOT OK A", _deltaPosition + 1);
+}
+
+static uint32_t unpack_block(const uint8_t *in, uint32_t length, uint8_t *out, uint32_t capacity) {
+  uint32_t i = 0;
+  uint32_t o = 0;
+
+  while (i < length) {
+    uint8_t flags = in[i++];
+    for (uint8_t bit = 0; (bit < 8) && (i < length); ++bit) {
+      if (flags & (1 << bit)) {
+        if (o >= capacity) {
+          return 0;
+        }
+        out[o++] = in[i++];
+      } else {
+        if (i + 1 >= length) {
+          return 0;
+        }
+        uint32_t offset = (in[i] | ((in[i + 1] >> 6) << 8)) + 1;
+        uint32_t count = (in[i + 1] & 0x3F) + 3;
+        i += 2;
+        if ((offset > o) || (o + count > capacity)) {
+          return 0;
+        }
+        for (uint32_t k = 0; k < count; ++k, ++o) {
+          out[o] = out[o - offset];
+        }
+      }
+    }
+  }
+  return o;
+}
+
+// "FINISHED [RESET] A", or "FINISHED [RESET] CRC <n> A" after a delta manifest.
+static bool line_finish_command(bool *checked, uint32_t *crc) {
+  *checked = line_number_command("FINISHED CRC ", crc) || line_number_command("FINISHED RESET CRC ", crc);
+  return *checked || line_ends_with("FINISHED A") || line_ends_with("FINISHED RESET A");
+}
+
+static bool block_crc_matches(const uint8_t *data, uint32_t length) {
+  uint16_t crc = calculate_crc(data, length);
+  return (data[length] == (crc >> 8)) && (data[length + 1] == (crc & 0xFF));
+}
+
+// Applies the configured loss and corruption to a complete block; false if it was lost.
+static bool inject_block_faults(uint32_t length) {
+  if (chance(_lossRate)) {
+    ++_statistics.lostIn;
+    return false;
+  }
+  if (chance(_corruptionRate)) {
+    _block[rand() % length] ^= (uint8_t)(1 << (rand() % 8));
+    ++_statistics.corruptedIn;
+  }
+  return true;
+}
+
+static void receive_block_byte(uint8_t data) {
+  _block[_blockIndex++] = data;
+
+  if (_receiveState == kReceivingBlock) {
+    if (_blockIndex < _blockLength + CRC_LENGTH) {
+      return;
+    }
+    _receiveState = kReceivingText;
+    if (!inject_block_faults(_blockLength + CRC_LENGTH)) {
+      return;
+    }
+    if (block_crc_matches(_block, _blockLength)) {
+      accept_block(_block, _blockLength);
+    } else {
+      refuse_block();
+    }
+  } else if (_receiveState == kReceivingPackedBlock) {
+    if (_blockIndex < PACKED_HEADER_LENGTH) {
+      return;
+    }
+    uint32_t packedLength = (_block[0] << 8) | _block[1];
+    if (packedLength > MAX_BLOCK_LENGTH) {
+      _receiveState = kReceivingText;
+      refuse_block();
+      return;
+    }
+    if (_blockIndex < PACKED_HEADER_LENGTH + packedLength + CRC_LENGTH) {
+      return;
+    }
+    _receiveState = kReceivingText;
+    if (!inject_block_faults(_blockIndex)) {
+      return;
+    }
+    static uint8_t unpacked[MAX_BLOCK_LENGTH];
+    if (block_crc_matches(_block, PACKED_HEADER_LENGTH + packedLength)
+        && (unpack_block(&_block[PACKED_HEADER_LENGTH], packedLength, unpacked, sizeof(unpacked)) == _blockLength)) {
+      accept_block(unpacked, _blockLength);
+    } else {
+      refuse_block();
+    }
+  } else if (_receiveState == kReceivingManifest) {
+    uint32_t manifestLength = (_manifestBlocks + 7) / 8;
+
+    if (_blockIndex < manifestLength + CRC_LENGTH) {
+      return;
+    }
+    _receiveState = kReceivingText;
+    if (block_crc_matches(_block, manifestLength)) {
+      memcpy(_manifest, _block, manifestLength);
+      _delta = true;
+      _deltaPosition = 0;
+      _image.length = 0;
+      output_say("RECEIVED OK A");
+    } else {
+      output_say("RECEIVED NOT OK A");
+    }
+  }
+}
+
+static void save_image() {
+  if (_imagePath == NULL) {
+    return;
+  }
+  FILE *file = fopen(_imagePath, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "cannot write %s\n", _imagePath);
+    return;
+  }
+  fwrite(_image.data, 1, _image.length, file);
+  fclose(file);
+}
+
+static void handle_line() {
+  uint32_t number;
+  bool checked;
+  bool handled = true;
+
+  if (line_ends_with("UPDATE PROJECT A") || line_ends_with("UPDATE FIRMWARE A")) {
+    _imageRejected = false;
+    // Whatever arrived before is kept as the partial image a RESUME may continue.
+    if (_image.length > 0) {
+      _partialLength = _image.length;
+    }
+    _image.length = 0;
+    _blockLength = DEFAULT_BLOCK_LENGTH;
+    _delta = false;
+    _deltaPosition = 0;
+    ++_statistics.updates;
+    output_say("RECEIVED OK A");
+  } else if (line_ends_with("NEW PACKED BLOCK A")) {
+    if (_refuseCompression) {
+      output_say("RECEIVED NOT OK A");
+    } else {
+      _receiveState = kReceivingPackedBlock;
+      _blockIndex = 0;
+      output_say("RECEIVED OK A");
+    }
+  } else if (line_ends_with("NEW BLOCK A")) {
+    _receiveState = kReceivingBlock;
+    _blockIndex = 0;
+    output_say("RECEIVED OK A");
+  } else if (line_finish_command(&checked, &number)) {
+    delta_advance();
+    // A repeated FINISHED (the host missed our OK) must not replace the image with an empty one.
+    if (_image.length > 0) {
+      _imageRejected = checked && (calculate_image_crc(_image.data, _image.length) != number);
+      if (_imageRejected) {
+        // The previous image stays: the next delta is built against it again.
+        fprintf(stderr, "update refused: image CRC differs from %u\n", number);
+      } else {
+        _previousImage.length = 0;
+        image_append(&_previousImage, _image.data, _image.length);
+        save_image();
+        fprintf(stderr, "update finished: %u bytes\n", _image.length);
+      }
+      _partialLength = 0;
+      _image.length = 0;
+    }
+    output_say(_imageRejected ? "RECEIVED NOT OK A" : "RECEIVED OK A");
+  } else if (line_ends_with("COMPRESSION LZSS A")) {
+    output_say(_refuseCompression ? "RECEIVED NOT OK A" : "RECEIVED OK A");
+  } else if (line_ends_with("MULTIPLEX A")) {
+    output_say(_refuseMultiplex ? "RECEIVED NOT OK A" : "RECEIVED OK A");
+  } else if (line_number_command("BLOCK LENGTH ", &number)) {
+    if ((number > 0) && (number <= _maxBlockLength) && (number % DEFAULT_BLOCK_LENGTH == 0)) {
+      _blockLength = number;
+      output_say("RECEIVED OK A");
+    } else {
+      output_say("RECEIVED NOT OK A");
+    }
+  } else if (line_number_command("RESUME BLOCK ", &number)) {
+    if (_refuseResume) {
+      output_say("RECEIVED NOT OK A");
+    } else {
+      // Reports the blocks kept and continues after the smaller count, as the host does: the host
+      // may have missed our OK of the last block, or we may hold fewer than it saw acknowledged.
+      static char answer[32];
+      uint32_t heldBlocks = _partialLength / _blockLength;
+      uint32_t resumedBlocks = (number < heldBlocks) ? number : heldBlocks;
+      _image.length = resumedBlocks * _blockLength;
+      _deltaPosition = resumedBlocks;
+      snprintf(answer, sizeof(answer), "RECEIVED BLOCKS %u A", heldBlocks);
+      output_say(answer);
+    }
+    _partialLength = 0;
+  } else if (line_number_command("DELTA MANIFEST ", &number)) {
+    if (_refuseDelta || (_previousImage.length == 0) || ((number + 7) / 8 > sizeof(_manifest))) {
+      output_say("RECEIVED NOT OK A");
+    } else {
+      _manifestBlocks = number;
+      _receiveState = kReceivingManifest;
+      _blockIndex = 0;
+      output_say("RECEIVED OK A");
+    }
+  } else {
+    handled = false;
+  }
+
+  if (handled) {
+    ++_statistics.commands;
+    trace("> %s: %s", _line, _lastAnswer);
+    _lineLength = 0;
+  } else if (_lineLength == MAX_LINE_SIZE) {
+    _lineLength = 0;
+  }
+}
+
+static void receive_byte(uint8_t data, uint64_t now) {
+  if ((_receiveState != kReceivingText) && (_receiveState != kReceivingFrame)
+      && (now - _lastByteTimeInUs > BLOCK_TIMEOUT_IN_US)) {
+    trace("> block given up after %u bytes", _blockIndex);
+    _receiveState = kReceivingText;
+    _lineLength = 0;
+  }
+  _lastByteTimeInUs = now;
+
+  switch (_receiveState) {
+    case kReceivingBlock:
+    case kReceivingPackedBlock:
+    case kReceivingManifest:
+      receive_block_byte(data);
+      break;
+    case kReceivingFrame:
+      if (data == START_FLAG) {
+        _frameLength = 0;
+        _frameOverflow = false;
+        _escaped = false;
+      } else if (data == END_FLAG) {
+        _receiveState = kReceivingText;
+        if (!_frameOverflow) {
+          handle_frame();
+        }
+      } else if (data == ESCAPE_FLAG) {
+        _escaped = true;
+      } else {
+        if (_escaped) {
+          data ^= XOR_FLAG;
+          _escaped = false;
+        }
+        if (_frameLength < sizeof(_frame)) {
+          _frame[_frameLength++] = data;
+        } else {
+          _frameOverflow = true;
+        }
+      }
+      break;
+    default:
+      if (data == START_FLAG) {
+        _receiveState = kReceivingFrame;
+        _frameLength = 0;
+        _frameOverflow = false;
+        _escaped = false;
+      } else {
+        _line[_lineLength++] = (char)data;
+        _line[_lineLength] = '\0';
+        handle_line();
+      }
+      break;
+  }
+}
+
+// Setup.
+
+static bool add_emitter(const char *text) {
+  char *end;
+  unsigned long address = strtoul(text, &end, 0);
+
+  if ((*end != ':') || (address > 0xFFFF) || (_quantityOfEmitters >= MAX_EMITTERS)) {
+    return false;
+  }
+  unsigned long period = strtoul(end + 1, &end, 0);
+  if ((*end != '\0') || (period == 0)) {
+    return false;
+  }
+  _emitters[_quantityOfEmitters].address = (uint16_t)address;
+  _emitters[_quantityOfEmitters].periodInMs = (uint32_t)period;
+  ++_quantityOfEmitters;
+  return true;
+}
+
+static bool set_refused(char *list) {
+  for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+    if (strcmp(item, "resume") == 0) {
+      _refuseResume = true;
+    } else if (strcmp(item, "delta") == 0) {
+      _refuseDelta = true;
+    } else if (strcmp(item, "compression") == 0) {
+      _refuseCompression = true;
+    } else if (strcmp(item, "multiplex") == 0) {
+      _refuseMultiplex = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int open_pty() {
+  struct termios settings;
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0)) {
+    return -1;
+  }
+
+  // The slave stays open here as well: the host may close and reopen it
+  // without the master seeing a hangup.
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    return -1;
+  }
+  tcgetattr(slave, &settings);
+  cfmakeraw(&settings);
+  tcsetattr(slave, TCSANOW, &settings);
+
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  return master;
+}
+
+static void stop(int signal) {
+  (void)signal;
+  _running = 0;
+}
+
+static void print_statistics() {
+  fprintf(stderr,
+          "frames in %u (writes %u, requests %u, acks %u, crc errors %u), frames out %u (acks %u)\n"
+          "update commands %u, updates %u, blocks ok %u, blocks not ok %u\n"
+          "lost in %u, lost out %u, corrupted in %u, corrupted out %u\n"
+          "bytes in %llu, bytes out %llu\n",
+          _statistics.framesIn, _statistics.writes, _statistics.requests, _statistics.acksIn,
+          _statistics.crcErrors, _statistics.framesOut, _statistics.acksOut, _statistics.commands,
+          _statistics.updates, _statistics.blocksOk, _statistics.blocksNotOk, _statistics.lostIn,
+          _statistics.lostOut, _statistics.corruptedIn, _statistics.corruptedOut,
+          (unsigned long long)_statistics.bytesIn, (unsigned long long)_statistics.bytesOut);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -b, --baud RATE          emulated line speed, 0 for none (default 115200)\n"
+          "  -l, --latency MS         delay before every answer (default 0)\n"
+          "  -L, --loss PERCENT       drop frames, commands, blocks and answers\n"
+          "  -c, --corrupt PERCENT    flip a bit in frames, blocks and answers\n"
+          "  -C, --crc                frames carry a CRC (USE_CRC)\n"
+          "  -A, --ack                writes are acknowledged, emitted frames carry an id (USE_ACK)\n"
+          "  -e, --emit ADDR:MS       send the value of ADDR every MS milliseconds\n"
+          "  -m, --max-block LENGTH   largest block length accepted (default 1024)\n"
+          "  -r, --refuse LIST        refuse resume,delta,compression,multiplex\n"
+          "  -o, --image FILE         write every finished update image to FILE\n"
+          "  -p, --link PATH          symlink PATH to the pty\n"
+          "  -s, --seed N             seed of the loss and corruption generator\n"
+          "  -v, --verbose            log every frame and command\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    { "baud", required_argument, NULL, 'b' },
+    { "latency", required_argument, NULL, 'l' },
+    { "loss", required_argument, NULL, 'L' },
+    { "corrupt", required_argument, NULL, 'c' },
+    { "crc", no_argument, NULL, 'C' },
+    { "ack", no_argument, NULL, 'A' },
+    { "emit", required_argument, NULL, 'e' },
+    { "max-block", required_argument, NULL, 'm' },
+    { "refuse", required_argument, NULL, 'r' },
+    { "image", required_argument, NULL, 'o' },
+    { "link", required_argument, NULL, 'p' },
+    { "seed", required_argument, NULL, 's' },
+    { "verbose", no_argument, NULL, 'v' },
+    { NULL, 0, NULL, 0 }
+  };
+  unsigned int seed = (unsigned int)time(NULL);
+  int option;
+
+  while ((option = getopt_long(argc, argv, "b:l:L:c:CAe:m:r:o:p:s:v", options, NULL)) != -1) {
+    switch (option) {
+      case 'b':
+        _baudRate = (uint32_t)strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        _latencyInUs = (uint32_t)(strtod(optarg, NULL) * 1000);
+        break;
+      case 'L':
+        _lossRate = strtod(optarg, NULL);
+        break;
+      case 'c':
+        _corruptionRate = strtod(optarg, NULL);
+        break;
+      case 'C':
+        _useCrc = true;
+        break;
+      case 'A':
+        _useAck = true;
+        break;
+      case 'e':
+        if (!add_emitter(optarg)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'm':
+        _maxBlockLength = (uint32_t)strtoul(optarg, NULL, 10);
+        if (_maxBlockLength > MAX_BLOCK_LENGTH) {
+          _maxBlockLength = MAX_BLOCK_LENGTH;
+        }
+        break;
+      case 'r':
+        if (!set_refused(optarg)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'o':
+        _imagePath = optarg;
+        break;
+      case 'p':
+        _linkPath = optarg;
+        break;
+      case 's':
+        seed = (unsigned int)strtoul(optarg, NULL, 10);
+        break;
+      case 'v':
+        _verbose = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  srand(seed);
+  _startTimeInUs = now_in_us();
+  // 10 bits per byte: start, 8 data bits, stop.
+  _byteTimeInUs = _baudRate ? (10000000 / _baudRate) : 0;
+
+  _master = open_pty();
+  if (_master < 0) {
+    perror("pty");
+    return 1;
+  }
+  if (_linkPath != NULL) {
+    unlink(_linkPath);
+    if (symlink(ptsname(_master), _linkPath) != 0) {
+      perror(_linkPath);
+      return 1;
+    }
+  }
+  printf("%s\n", ptsname(_master));
+  fflush(stdout);
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  for (uint32_t i = 0; i < _quantityOfEmitters; ++i) {
+    _emitters[i].nextTimeInUs = _startTimeInUs + (uint64_t)_emitters[i].periodInMs * 1000;
+  }
+
+  while (_running) {
+    struct pollfd pollFd = { _master, POLLIN, 0 };
+    uint64_t now = now_in_us();
+    int timeout = output_service(now);
+
+    for (uint32_t i = 0; i < _quantityOfEmitters; ++i) {
+      emitter_t *emitter = &_emitters[i];
+
+      if (now >= emitter->nextTimeInUs) {
+        _arrivalTimeInUs = now;
+        emit_variable(emitter);
+        emitter->nextTimeInUs += (uint64_t)emitter->periodInMs * 1000;
+      }
+      int emitterTimeout = (int)((emitter->nextTimeInUs > now) ? (emitter->nextTimeInUs - now + 999) / 1000 : 0);
+      if ((timeout < 0) || (emitterTimeout < timeout)) {
+        timeout = emitterTimeout;
+      }
+    }
+
+    if (poll(&pollFd, 1, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (pollFd.revents & POLLIN) {
+      uint8_t received[4096];
+      ssize_t length = read(_master, received, sizeof(received));
+
+      if (length > 0) {
+        now = now_in_us();
+        _statistics.bytesIn += (uint64_t)length;
+        for (ssize_t i = 0; i < length; ++i) {
+          // Bytes arrive one line byte-time apart; answers leave after the last one.
+          _inputFreeTimeInUs = ((_inputFreeTimeInUs > now) ? _inputFreeTimeInUs : now) + _byteTimeInUs;
+          _arrivalTimeInUs = _inputFreeTimeInUs;
+          receive_byte(received[i], now);
+        }
+      }
+    } else if (pollFd.revents & POLLHUP) {
+      // Nobody has the slave open besides us: wait for the host instead of spinning.
+      usleep(1000);
+    }
+  }
+
+  if (_linkPath != NULL) {
+    unlink(_linkPath);
+  }
+  print_statistics();
+  free(_image.data);
+  free(_previousImage.data);
+  return 0;
+}